@@ -3,15 +3,27 @@
 
 #include "ebucket/core.hpp"
 #include "ebucket/elliptics_stat.hpp"
+#include "ebucket/instrumented_mutex.hpp"
+#include "ebucket/metrics.hpp"
+#include "ebucket/storage.hpp"
+#include "ebucket/timer.hpp"
 
 #include <elliptics/session.hpp>
 
 #include <msgpack.hpp>
 
+#include <thevoid/rapidjson/stringbuffer.h>
+#include <thevoid/rapidjson/writer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
+#include <set>
 #include <string>
+#include <tuple>
 
 namespace ioremap { namespace ebucket {
 
@@ -60,6 +72,14 @@ struct bucket_acl {
 		return acl_ss.str();
 	}
 
+	bool operator==(const bucket_acl &other) const {
+		return user == other.user && token == other.token && flags == other.flags;
+	}
+
+	bool operator!=(const bucket_acl &other) const {
+		return !(*this == other);
+	}
+
 	std::string user;
 	std::string token;
 	uint64_t flags = 0;
@@ -107,6 +127,15 @@ struct bucket_meta {
 
 		return ss.str();
 	}
+
+	bool operator==(const bucket_meta &other) const {
+		return name == other.name && acl == other.acl && groups == other.groups &&
+			flags == other.flags && max_size == other.max_size && max_key_num == other.max_key_num;
+	}
+
+	bool operator!=(const bucket_meta &other) const {
+		return !(*this == other);
+	}
 };
 
 struct bucket_stat {
@@ -126,42 +155,248 @@ struct bucket_stat {
 	}
 };
 
+// Weight policy calculates bucket weight, a value in [0, 1] range,
+// the closer to 1, the more likely this bucket will be selected.
+//
+// Policy is a template parameter of the bucket processor (see weight_policy.hpp for alternatives),
+// thus it is never called through virtual function. Policy must provide:
+//  * float weight(const bucket_meta &meta, const bucket_stat &stat) const
+//	size-independent weight, it is called with bucket lock held when bucket statistics
+//	or metadata changes, result is cached in the bucket
+//  * float select_weight(float weight, bool routed) const
+//	called on the selection path for every candidate bucket with its cached weight,
+//	@routed is false if at least one bucket group is not present in the route table,
+//	bucket is not selected if returned weight is zero
+//
+// Default policy: the smallest free space ratio among bucket backends,
+// decreased if statistics is incomplete, free space is below soft limit or there are no routes.
+struct default_weight_policy {
+	limits	l;
+
+	float weight(const bucket_meta &meta, const bucket_stat &stat) const {
+		return weight(meta, stat, 0, l);
+	}
+
+	float select_weight(float w, bool routed) const {
+		// there are no routes to one or more groups in this bucket, heavily decrease its weight
+		if (!routed)
+			return w / 100;
+
+		return w;
+	}
+
+	static float weight(const bucket_meta &meta, const bucket_stat &stat, uint64_t size, const limits &l) {
+		float weight = 0;
+
+		// we select backend with the smallest amount of space available
+		// any other space metric may end up with the situation when we will
+		// write data to backend where there is no space
+		float size_weight = 0;
+		float health = 1;
+		for (auto st = stat.backends.begin(), end = stat.backends.end(); st != end; ++st) {
+			const backend_stat &bs = st->second;
+			float tmp = bs.size.limit - bs.size.used;
+
+			// object is written into every backend, the least healthy one determines bucket health
+			health = std::min(health, bs.health);
+
+			// there is no space at least in one backend for given size in this bucket
+			if (tmp < size) {
+				return 0;
+			}
+
+			tmp /= (float)(bs.size.limit);
+
+			// there is at least one backend which size is less than hard limit,
+			// this backend doesn't have enough space for given request
+			if (tmp < l.size.hard) {
+				return 0;
+			}
+
+			// heavily deacrease weight of this backend (and thus bucket)
+			// if amount of free space is less than soft limit
+			if (tmp < l.size.soft) {
+				tmp /= 10;
+			}
+
+			if (tmp < size_weight || size_weight == 0)
+				size_weight = tmp;
+		}
+		weight = size_weight * health;
+
+		// bucket stat is incomplete, there are no some groups
+		if (stat.backends.size() != meta.groups.size()) {
+			weight /= 50;
+		}
+
+
+		// following metrics are supported:
+		//  * size of the every backend in the bucket
+		//  * health of the every backend in the bucket (corruption, removed records, errors)
+		//  * whether stats for all groups is present or not
+		//
+		// TODO next step is to add network/disk performance metric
+		// TODO we have to measure upload time and modify weight
+		// TODO accordingly to the time it took to write data
+		//
+		return weight;
+	}
+};
+
+// Hedged read parameters, see @raw_bucket::read_hedged()
+struct hedge_config {
+	// hedge is sent when request has not completed within this percentile of its group latency
+	double				percentile = 95;
+
+	// hedge delay until group has at least @min_samples latency samples
+	std::chrono::milliseconds	default_delay = std::chrono::milliseconds(50);
+	uint64_t			min_samples = 20;
+
+	// hedge delay is never smaller than this
+	std::chrono::microseconds	min_delay = std::chrono::microseconds(500);
+
+	// maximum number of hedges per read, 0 disables hedging, failed requests are retried regardless
+	size_t				max_hedges = 1;
+};
+
+// Exponential smoothing of the bucket weight between statistics updates.
+//
+// When statistics changes, the weight does not jump to the new policy weight, instead it approaches it
+// as w(t) = target + (w0 - target) * exp(-t / time_constant), where @rise time constant is used when
+// the weight grows and @fall when it decreases. Zero time constant disables smoothing in that direction.
+//
+// Weight jumps immediately when the new weight is zero (there is no space, bucket must not be selected),
+// when the old one is zero or when statistics of the bucket has been incomplete (bucket has just appeared),
+// thus smoothing only affects transitions of buckets which are already in use, for example when free space
+// crosses soft limit: writers are moved to the other buckets gradually and do not stampede them.
+struct weight_smoothing {
+	std::chrono::milliseconds	rise = std::chrono::milliseconds(0);
+	std::chrono::milliseconds	fall = std::chrono::milliseconds(0);
+};
+
+// Logical bucket usage which is checked against @bucket_meta::max_size and @bucket_meta::max_key_num quotas.
+//
+// By default usage is the size and number of objects successfully written through this process,
+// the counters survive metadata reloads, but they are neither shared between processes nor persisted.
+//
+// Backend statistics are not split by namespace, thus they can only be used if backends of the bucket
+// are not shared with other buckets, this is enabled by @stat_usage. Statistics usage is then the largest
+// live (not removed) size and number of live records among bucket backends, and written counters only
+// hold writes which statistics may not include yet: they are reset when every group of the bucket
+// has reported new statistics.
+//
+// Every counter is atomic, writes are accounted and quotas are checked without bucket lock.
+struct quota_usage {
+	std::atomic<bool>	stat_usage{false};
+
+	std::atomic<uint64_t>	stat_size{0};
+	std::atomic<uint64_t>	stat_keys{0};
+	std::atomic<uint64_t>	written_size{0};
+	std::atomic<uint64_t>	written_keys{0};
+
+	// copies of the bucket metadata quotas, zero means there is no quota
+	std::atomic<uint64_t>	max_size{0};
+	std::atomic<uint64_t>	max_key_num{0};
+
+	uint64_t size() const {
+		return stat_size.load(std::memory_order_relaxed) + written_size.load(std::memory_order_relaxed);
+	}
+
+	uint64_t keys() const {
+		return stat_keys.load(std::memory_order_relaxed) + written_keys.load(std::memory_order_relaxed);
+	}
+
+	void account(uint64_t size, uint64_t keys) {
+		written_size.fetch_add(size, std::memory_order_relaxed);
+		written_keys.fetch_add(keys, std::memory_order_relaxed);
+	}
+
+	// Selection weight multiplier: bucket is excluded when its free quota ratio is below @l.size.hard
+	// or when there is no quota left for @size bytes, its weight is heavily decreased when
+	// free quota ratio is below @l.size.soft, the same way backend free space is treated.
+	// @avail is set to the remaining size quota, it is UINT64_MAX if there is no size quota.
+	float weight(const limits &l, uint64_t &avail) const {
+		avail = UINT64_MAX;
+
+		uint64_t msize = max_size.load(std::memory_order_relaxed);
+		uint64_t mkeys = max_key_num.load(std::memory_order_relaxed);
+		if (!msize && !mkeys)
+			return 1;
+
+		float used = 0;
+		if (msize) {
+			uint64_t sz = size();
+			avail = msize > sz ? msize - sz : 0;
+			used = (float)sz / (float)msize;
+		}
+		if (mkeys) {
+			used = std::max(used, (float)keys() / (float)mkeys);
+		}
+
+		float free = used < 1 ? 1 - used : 0;
+		if (free <= 0 || free < l.size.hard)
+			return 0;
+		if (free < l.size.soft)
+			return 0.1;
+
+		return 1;
+	}
+};
+
 class raw_bucket {
 public:
-	raw_bucket(std::shared_ptr<elliptics::node> &node, const std::vector<int> mgroups, const std::string &name) :
-	m_node(node),
+	raw_bucket(std::shared_ptr<storage> st, const std::vector<int> mgroups, const std::string &name) :
+	m_storage(st),
 	m_meta_groups(mgroups),
 	m_valid(false),
 	m_reloaded(false)
 	{
 		m_meta.name = name;
+		m_json = pack_json(m_meta);
+		m_msgpack = pack_msgpack(m_meta);
 		reload();
 	}
 
+	raw_bucket(std::shared_ptr<elliptics::node> &node, const std::vector<int> mgroups, const std::string &name) :
+	raw_bucket(make_storage(node), mgroups, name)
+	{
+	}
+
+	// creates bucket with already known metadata, it is not read from storage,
+	// used for tests, benchmarks and simulations where there is no storage at all
+	raw_bucket(std::shared_ptr<storage> st, const bucket_meta &meta) :
+	m_storage(st),
+	m_valid(true),
+	m_reloaded(true),
+	m_meta(meta)
+	{
+		m_json = pack_json(m_meta);
+		m_msgpack = pack_msgpack(m_meta);
+		update_weight(default_policy(), std::chrono::steady_clock::now());
+	}
+
+	raw_bucket(std::shared_ptr<elliptics::node> &node, const bucket_meta &meta) :
+	raw_bucket(make_storage(node), meta)
+	{
+	}
+
 	~raw_bucket() {
 		wait_for_reload();
 	}
 
 	void reload() {
-		elliptics::session s(*m_node);
-		s.set_exceptions_policy(elliptics::session::no_exceptions);
-		s.set_groups(m_meta_groups);
-
-		std::string ns = "bucket";
-		s.set_namespace(ns.c_str(), ns.size());
-
 		m_reloaded = false;
 
-		elliptics::logger &log = m_node->get_log();
+		elliptics::logger &log = m_storage->log();
 
 		BH_LOG(log, DNET_LOG_INFO, "reload: going to reload bucket: %s", m_meta.name.c_str());
-		s.read_data(m_meta.name, 0, 0).connect(
+		m_storage->read("bucket", m_meta.name, m_meta_groups,
 			std::bind(&raw_bucket::reload_completed, this,
 				std::placeholders::_1, std::placeholders::_2));
 	}
 
 	bool wait_for_reload() {
-		std::unique_lock<std::mutex> guard(m_lock);
+		std::unique_lock<instrumented_mutex> guard(m_lock);
 		m_wait.wait(guard, [&] {return m_reloaded;});
 
 		return m_valid;
@@ -176,12 +411,24 @@ public:
 	}
 
 	std::string stat_str() {
-		std::unique_lock<std::mutex> guard(m_lock);
+		std::unique_lock<instrumented_mutex> guard(m_lock);
 		return m_stat.str();
 	}
 
+	bucket_stat stat() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_stat;
+	}
+
+	// elliptics session for IO in this bucket,
+	// throws if bucket storage is not elliptics cluster
 	elliptics::session session() const {
-		elliptics::session s(*m_node);
+		std::shared_ptr<elliptics::node> node = m_storage->node();
+		if (!node) {
+			throw std::runtime_error("bucket: " + m_meta.name + ": storage is not elliptics, there is no session");
+		}
+
+		elliptics::session s(*node);
 		s.set_namespace(m_meta.name);
 
 		s.set_exceptions_policy(elliptics::session::no_exceptions);
@@ -198,93 +445,600 @@ public:
 		return s;
 	}
 
+	// reads object from this bucket using bucket storage, works with any storage implementation
+	void read(const std::string &key, const storage_handler &handler) {
+		if (!valid()) {
+			handler(std::vector<storage_result>(),
+					elliptics::create_error(-EINVAL, "bucket %s is not valid", m_meta.name.c_str()));
+			return;
+		}
+
+		m_storage->read(m_meta.name, key, meta().groups, handler);
+	}
+
+	// reads @size bytes at @offset of the object, see @storage::read_part()
+	void read_part(const std::string &key, uint64_t offset, uint64_t size, const storage_handler &handler) {
+		if (!valid()) {
+			handler(std::vector<storage_result>(),
+					elliptics::create_error(-EINVAL, "bucket %s is not valid", m_meta.name.c_str()));
+			return;
+		}
+
+		m_storage->read_part(m_meta.name, key, meta().groups, offset, size, handler);
+	}
+
+	// writes object into all groups of this bucket using bucket storage
+	void write(const std::string &key, const std::string &data, const storage_handler &handler) {
+		if (!valid()) {
+			handler(std::vector<storage_result>(),
+					elliptics::create_error(-EINVAL, "bucket %s is not valid", m_meta.name.c_str()));
+			return;
+		}
+
+		m_storage->write(m_meta.name, key, meta().groups, data, accounted(data.size(), 1, handler));
+	}
+
+	// writes part of the large object into all groups of this bucket, see @storage::write_part()
+	void write_part(const std::string &key, const std::string &data, uint64_t offset, uint64_t total_size,
+			write_part_type type, const storage_handler &handler) {
+		if (!valid()) {
+			handler(std::vector<storage_result>(),
+					elliptics::create_error(-EINVAL, "bucket %s is not valid", m_meta.name.c_str()));
+			return;
+		}
+
+		// object is accounted as a new key when it is committed
+		m_storage->write_part(m_meta.name, key, meta().groups, data, offset, total_size, type,
+				accounted(data.size(), type == write_part_commit ? 1 : 0, handler));
+	}
+
+	// writes all objects into all groups of this bucket using storage bulk write,
+	// @keys and @data must have the same size
+	void bulk_write(const std::vector<std::string> &keys, const std::vector<std::string> &data,
+			const storage_bulk_handler &handler) {
+		if (!valid()) {
+			handler(std::vector<std::vector<storage_result>>(keys.size()),
+					elliptics::create_error(-EINVAL, "bucket %s is not valid", m_meta.name.c_str()));
+			return;
+		}
+
+		std::shared_ptr<quota_usage> usage = m_usage;
+		std::vector<uint64_t> sizes;
+		sizes.reserve(data.size());
+		for (auto it = data.begin(), end = data.end(); it != end; ++it) {
+			sizes.push_back(it->size());
+		}
+
+		m_storage->bulk_write(m_meta.name, keys, data, meta().groups,
+			[usage, sizes, handler] (const std::vector<std::vector<storage_result>> &results,
+					const elliptics::error_info &error) {
+				uint64_t size = 0, keys = 0;
+				for (size_t i = 0; i < results.size() && i < sizes.size(); ++i) {
+					if (std::any_of(results[i].begin(), results[i].end(),
+								[] (const storage_result &r) { return !r.error; })) {
+						size += sizes[i];
+						keys++;
+					}
+				}
+				usage->account(size, keys);
+
+				handler(results, error);
+			});
+	}
+
+	// Reads object from the group with the lowest recent latency. If it has not replied
+	// within @cfg.percentile of that group latency, the same read is sent to the next group,
+	// and so on up to @cfg.max_hedges times. If request fails, the next group is read immediately.
+	//
+	// @handler is called once: with the first successful result, or with all failed results
+	// and the last error when every group has failed. Replies of the other requests are only used
+	// to update group latencies. Failed request is accounted as at least one second latency.
+	void read_hedged(const std::string &key, const storage_handler &handler, const hedge_config &cfg = hedge_config()) {
+		if (!valid()) {
+			handler(std::vector<storage_result>(),
+					elliptics::create_error(-EINVAL, "bucket %s is not valid", m_meta.name.c_str()));
+			return;
+		}
+
+		std::shared_ptr<hedged_read> hr = std::make_shared<hedged_read>();
+		hr->st = m_storage;
+		hr->timer = timer_queue::shared();
+		hr->key = key;
+		hr->handler = handler;
+		hr->cfg = cfg;
+
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		hr->ns = m_meta.name;
+
+		// (p50 latency, group, tracker), metadata may be replaced by reload once the lock is dropped,
+		// thus nothing is looked up in @m_meta after that
+		typedef std::tuple<uint64_t, int, std::shared_ptr<latency_tracker>> group_latency;
+		std::vector<group_latency> order;
+		for (auto g = m_meta.groups.begin(), gend = m_meta.groups.end(); g != gend; ++g) {
+			std::shared_ptr<latency_tracker> &lt = m_read_latency[*g];
+			if (!lt)
+				lt = std::make_shared<latency_tracker>();
+
+			// groups without samples go first, that is how their latency becomes known
+			order.push_back(std::make_tuple(lt->percentile(50), *g, lt));
+		}
+		guard.unlock();
+
+		std::stable_sort(order.begin(), order.end(),
+				[] (const group_latency &a, const group_latency &b) {
+					return std::get<0>(a) < std::get<0>(b);
+				});
+
+		for (auto it = order.begin(), end = order.end(); it != end; ++it) {
+			hr->groups.push_back(std::get<1>(*it));
+			hr->latency.push_back(std::get<2>(*it));
+		}
+
+		std::unique_lock<std::mutex> hguard(hr->lock);
+		size_t idx = hr->next++;
+		hr->inflight++;
+		hguard.unlock();
+
+		hedged_send(hr, idx);
+	}
+
+	// recent read latency percentile of the group in nanoseconds, zero if it has not been read yet
+	uint64_t read_latency(int group, double p) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		auto it = m_read_latency.find(group);
+		if (it == m_read_latency.end())
+			return 0;
+
+		return it->second->percentile(p);
+	}
 
 	bucket_meta meta() {
 		bucket_meta ret;
-		std::lock_guard<std::mutex> guard(m_lock);
+		std::lock_guard<instrumented_mutex> guard(m_lock);
 		ret = m_meta;
 		return ret;
 	}
 
-	void set_backend_stat(int group, const backend_stat &bs) {
-		std::lock_guard<std::mutex> guard(m_lock);
+	// compact JSON object with bucket name and groups: {"bucket":"name","groups":[1,2]}
+	// it is generated when metadata is loaded, returned buffer is never modified
+	std::shared_ptr<const std::string> meta_json() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_json;
+	}
+
+	// the same object as @meta_json() packed into msgpack map
+	std::shared_ptr<const std::string> meta_msgpack() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_msgpack;
+	}
+
+	static std::shared_ptr<const std::string> pack_json(const bucket_meta &meta) {
+		rapidjson::StringBuffer buffer;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+
+		writer.StartObject();
+		writer.String("bucket");
+		writer.String(meta.name.c_str(), meta.name.size());
+		writer.String("groups");
+		writer.StartArray();
+		for (auto group: meta.groups) {
+			writer.Int(group);
+		}
+		writer.EndArray();
+		writer.EndObject();
+		buffer.Put('\n');
+
+		return std::make_shared<const std::string>(buffer.GetString(), buffer.Size());
+	}
+
+	static std::shared_ptr<const std::string> pack_msgpack(const bucket_meta &meta) {
+		msgpack::sbuffer buffer;
+		msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+		pk.pack_map(2);
+		pk.pack(std::string("bucket"));
+		pk.pack(meta.name);
+		pk.pack(std::string("groups"));
+		pk.pack(meta.groups);
+
+		return std::make_shared<const std::string>(buffer.data(), buffer.size());
+	}
+
+	// every statistics update recalculates cached weight of this bucket using given policy,
+	// thus @weight(size) does not need to walk over all backends
+	//
+	// @now is the time of the update used for weight smoothing, simulations pass their virtual time
+	template <typename Policy>
+	void set_backend_stat(int group, const backend_stat &bs, const Policy &policy,
+			const std::chrono::steady_clock::time_point &now = std::chrono::steady_clock::now()) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
 		m_stat.backends[group] = bs;
+
+		update_weight(policy, now);
+		quota_reported(group);
 	}
 
-	// weight is a value in (0,1) range,
-	// the closer to 1, the more likely this bucket will be selected
-	float weight(uint64_t size, const limits &l) {
-		float weight = 0;
+	void set_backend_stat(int group, const backend_stat &bs) {
+		set_backend_stat(group, bs, default_policy());
+	}
 
-		std::lock_guard<std::mutex> guard(m_lock);
+	template <typename Policy>
+	void clear_backend_stat(int group, const Policy &policy,
+			const std::chrono::steady_clock::time_point &now = std::chrono::steady_clock::now()) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		if (m_stat.backends.erase(group))
+			update_weight(policy, now);
+	}
 
-		// we select backend with the smallest amount of space available
-		// any other space metric may end up with the situation when we will
-		// write data to backend where there is no space
-		float size_weight = 0;
-		for (auto st = m_stat.backends.begin(), end = m_stat.backends.end(); st != end; ++st) {
-			const backend_stat &bs = st->second;
-			float tmp = bs.size.limit - bs.size.used;
+	void clear_backend_stat(int group) {
+		clear_backend_stat(group, default_policy());
+	}
 
-			// there is no space at least in one backend for given size in this bucket
-			if (tmp < size) {
-				return 0;
-			}
+	// metadata reload recalculates weight with the default policy,
+	// processor with different policy calls this after reload
+	template <typename Policy>
+	void recalculate_weight(const Policy &policy, const std::chrono::steady_clock::time_point &now = std::chrono::steady_clock::now()) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		update_weight(policy, now);
+	}
 
-			tmp /= (float)(bs.size.limit);
+	// smoothing starts with the next weight change, transition in progress is completed immediately
+	void set_weight_smoothing(const weight_smoothing &ws) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_smoothing = ws;
+		m_weight = m_target_weight;
+	}
 
-			// there is at least one backend which size is less than hard limit,
-			// this backend doesn't have enough space for given request
-			if (tmp < l.size.hard) {
-				return 0;
-			}
+	// returns weight calculated at the last statistics update (smoothed at @now, see @weight_smoothing),
+	// it is zero if there is no space for @size bytes in at least one backend
+	float weight(uint64_t size, const std::chrono::steady_clock::time_point &now) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		if (size > m_avail)
+			return 0;
 
-			// heavily deacrease weight of this backend (and thus bucket)
-			// if amount of free space is less than soft limit
-			if (tmp < l.size.soft) {
-				tmp /= 10;
-			}
+		return current_weight(now);
+	}
 
-			if (tmp < size_weight || size_weight == 0)
-				size_weight = tmp;
-		}
-		weight = size_weight;
+	float weight(uint64_t size) {
+		return weight(size, std::chrono::steady_clock::now());
+	}
 
-		// bucket stat is incomplete, there are no some groups
-		if (m_stat.backends.size() != m_meta.groups.size()) {
-			weight /= 50;
-		}
+	// bucket which replaces @old after metadata reload continues its weight transition
+	// instead of jumping to the new weight
+	void inherit_weight(raw_bucket &old, const std::chrono::steady_clock::time_point &now) {
+		std::unique_lock<instrumented_mutex> old_guard(old.m_lock);
+		float w = old.current_weight(now);
+		bool complete = old.m_stat_complete;
+		old_guard.unlock();
+
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		std::chrono::milliseconds tc = m_target_weight > w ? m_smoothing.rise : m_smoothing.fall;
+		if (tc.count() <= 0 || m_target_weight == 0 || w == 0 || !complete || !m_stat_complete)
+			return;
+
+		m_weight = w;
+		m_weight_time = now;
+	}
 
+	// weight the bucket is approaching, it is equal to @weight() if there is no smoothing
+	float target_weight() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_target_weight;
+	}
 
-		// following metrics are supported:
-		//  * size of the every backend in the bucket
-		//  * whether stats for all groups is present or not
-		//
-		// TODO next step is to add network/disk performance metric
-		// TODO we have to measure upload time and modify weight
-		// TODO accordingly to the time it took to write data
-		//
-		// TODO move weight calculation into separate method called when statistics is being updated in background
-		// TODO this method should be lightweight
-		return weight;
+	// backends of this bucket are not shared with other buckets, see @quota_usage
+	void set_quota_stat_usage(bool enabled) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_usage->stat_usage.store(enabled, std::memory_order_relaxed);
+		m_quota_reported.clear();
+		update_usage();
+	}
+
+	// bucket which replaces @old after metadata reload continues its quota accounting,
+	// writes in flight are accounted to the same counters
+	void inherit_usage(raw_bucket &old) {
+		std::unique_lock<instrumented_mutex> old_guard(old.m_lock);
+		std::shared_ptr<quota_usage> usage = old.m_usage;
+		std::set<int> reported = old.m_quota_reported;
+		uint64_t mark_size = old.m_quota_mark_size;
+		uint64_t mark_keys = old.m_quota_mark_keys;
+		old_guard.unlock();
+
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		if (usage == m_usage)
+			return;
+
+		usage->stat_usage.store(m_usage->stat_usage.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		m_usage = usage;
+		m_quota_reported.swap(reported);
+		m_quota_mark_size = mark_size;
+		m_quota_mark_keys = mark_keys;
+		update_usage();
+	}
+
+	// quota usage of this bucket, it is read and updated without bucket lock
+	const quota_usage &usage() const {
+		return *m_usage;
+	}
+
+	// accounts successful write made bypassing this bucket's write methods
+	void account_write(uint64_t size, uint64_t keys) {
+		m_usage->account(size, keys);
+	}
+
+	// minimal amount of free space among backends of this bucket
+	// cached at the last statistics update
+	uint64_t avail() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_avail;
+	}
+
+	// weight is a value in (0,1) range,
+	// the closer to 1, the more likely this bucket will be selected,
+	// it is calculated with the default policy
+	float weight(uint64_t size, const limits &l) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return default_weight_policy::weight(m_meta, m_stat, size, l);
 	}
 
 private:
-	std::shared_ptr<elliptics::node> m_node;
+	std::shared_ptr<storage> m_storage;
 	std::vector<int> m_meta_groups;
 
 	bool m_valid = false;
 
 	bool m_reloaded = false;
-	std::condition_variable m_wait;
+	std::condition_variable_any m_wait;
 
-	std::mutex m_lock;
+	instrumented_mutex m_lock{"raw_bucket"};
 	bucket_meta m_meta;
 
 	bucket_stat m_stat;
 
-	void reload_completed(const elliptics::sync_read_result &result, const elliptics::error_info &error) {
-		elliptics::logger &log = m_node->get_log();
+	std::shared_ptr<const std::string> m_json;
+	std::shared_ptr<const std::string> m_msgpack;
+
+	// smoothed weight is @m_weight at @m_weight_time approaching @m_target_weight
+	float m_weight = 0;
+	float m_target_weight = 0;
+	std::chrono::steady_clock::time_point m_weight_time;
+	weight_smoothing m_smoothing;
+	bool m_stat_complete = false;
+
+	uint64_t m_avail = 0;
+
+	// shared with write completions, thus bucket may be destroyed while writes are in flight
+	std::shared_ptr<quota_usage> m_usage = std::make_shared<quota_usage>();
+
+	// groups which have reported statistics since the written counters were last reset,
+	// and the counters at the moment the first of them reported
+	std::set<int> m_quota_reported;
+	uint64_t m_quota_mark_size = 0;
+	uint64_t m_quota_mark_keys = 0;
+
+	// wraps write completion to account object which has been written into at least one group
+	storage_handler accounted(uint64_t size, uint64_t keys, const storage_handler &handler) {
+		std::shared_ptr<quota_usage> usage = m_usage;
+		return [usage, size, keys, handler] (const std::vector<storage_result> &result,
+				const elliptics::error_info &error) {
+			if (!error && std::any_of(result.begin(), result.end(),
+						[] (const storage_result &r) { return !r.error; })) {
+				usage->account(size, keys);
+			}
+
+			handler(result, error);
+		};
+	}
+
+	// group -> recent read latency, trackers are shared with reads in flight
+	std::map<int, std::shared_ptr<latency_tracker>> m_read_latency;
+
+	// state of the single hedged read, it does not reference the bucket,
+	// thus the bucket may be destroyed while requests are in flight
+	struct hedged_read {
+		std::shared_ptr<storage>	st;
+		std::shared_ptr<timer_queue>	timer;
+
+		std::string			ns;
+		std::string			key;
+		storage_handler			handler;
+		hedge_config			cfg;
+
+		// groups sorted by their latency and their latency trackers
+		std::vector<int>		groups;
+		std::vector<std::shared_ptr<latency_tracker>> latency;
+
+		std::mutex			lock;
+		size_t				next = 0;
+		size_t				inflight = 0;
+		size_t				hedges = 0;
+		bool				completed = false;
+		std::vector<storage_result>	failed;
+		elliptics::error_info		error;
+	};
+
+	// sends read to the group @idx in @hr->groups order and schedules hedge
+	static void hedged_send(std::shared_ptr<hedged_read> hr, size_t idx) {
+		std::shared_ptr<latency_tracker> lt = hr->latency[idx];
+		auto start = std::chrono::steady_clock::now();
+
+		std::chrono::steady_clock::duration delay = hr->cfg.default_delay;
+		if (lt->count() >= hr->cfg.min_samples)
+			delay = std::chrono::nanoseconds(lt->percentile(hr->cfg.percentile));
+		if (delay < hr->cfg.min_delay)
+			delay = hr->cfg.min_delay;
+
+		if (hr->cfg.max_hedges && idx + 1 < hr->groups.size()) {
+			hr->timer->schedule(delay, [hr, idx] () {
+					std::unique_lock<std::mutex> guard(hr->lock);
+
+					// hedge is only sent if this request is the last one sent and it is still in flight
+					if (hr->completed || hr->next != idx + 1 || hr->hedges >= hr->cfg.max_hedges)
+						return;
+
+					size_t next = hr->next++;
+					hr->hedges++;
+					hr->inflight++;
+					guard.unlock();
+
+					hedged_send(hr, next);
+				});
+		}
+
+		hr->st->read(hr->ns, hr->key, std::vector<int>(1, hr->groups[idx]),
+			[hr, lt, start] (const std::vector<storage_result> &result, const elliptics::error_info &error) {
+				hedged_completed(hr, lt, start, result, error);
+			});
+	}
+
+	static void hedged_completed(std::shared_ptr<hedged_read> hr, std::shared_ptr<latency_tracker> lt,
+			const std::chrono::steady_clock::time_point &start,
+			const std::vector<storage_result> &result, const elliptics::error_info &error) {
+		std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+		auto ok = std::find_if(result.begin(), result.end(),
+				[] (const storage_result &r) { return !r.error; });
+
+		if (error || ok == result.end()) {
+			lt->record(std::max<std::chrono::steady_clock::duration>(elapsed, std::chrono::seconds(1)));
+		} else {
+			lt->record(elapsed);
+		}
+
+		std::unique_lock<std::mutex> guard(hr->lock);
+		hr->inflight--;
+
+		if (hr->completed)
+			return;
+
+		if (!error && ok != result.end()) {
+			hr->completed = true;
+			guard.unlock();
+
+			hr->handler(std::vector<storage_result>(1, *ok), elliptics::error_info());
+			return;
+		}
+
+		hr->failed.insert(hr->failed.end(), result.begin(), result.end());
+		if (error) {
+			hr->error = error;
+		} else if (!result.empty()) {
+			hr->error = result.back().error;
+		} else {
+			hr->error = elliptics::create_error(-ENOENT, "%s: read has not returned any result", hr->key.c_str());
+		}
+
+		// other request is still in flight, it will either succeed or send the next read
+		if (hr->inflight != 0)
+			return;
+
+		if (hr->next < hr->groups.size()) {
+			size_t next = hr->next++;
+			hr->inflight++;
+			guard.unlock();
+
+			hedged_send(hr, next);
+			return;
+		}
+
+		hr->completed = true;
+		std::vector<storage_result> failed;
+		failed.swap(hr->failed);
+		elliptics::error_info err = hr->error;
+		guard.unlock();
+
+		hr->handler(failed, err);
+	}
+
+	static const default_weight_policy &default_policy() {
+		static const default_weight_policy policy;
+		return policy;
+	}
+
+	// must be called with @m_lock held
+	float current_weight(const std::chrono::steady_clock::time_point &now) const {
+		if (m_weight == m_target_weight)
+			return m_weight;
+
+		std::chrono::milliseconds tc = m_target_weight > m_weight ? m_smoothing.rise : m_smoothing.fall;
+		double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_weight_time).count();
+		if (elapsed <= 0)
+			return m_weight;
+		if (tc.count() <= 0)
+			return m_target_weight;
+
+		return m_target_weight + (m_weight - m_target_weight) * std::exp(-elapsed / 1000.0 / tc.count());
+	}
+
+	// must be called with @m_lock held
+	template <typename Policy>
+	void update_weight(const Policy &policy, const std::chrono::steady_clock::time_point &now) {
+		m_avail = 0;
+		for (auto st = m_stat.backends.begin(), end = m_stat.backends.end(); st != end; ++st) {
+			const backend_stat &bs = st->second;
+			uint64_t avail = bs.size.limit > bs.size.used ? bs.size.limit - bs.size.used : 0;
+
+			if (st == m_stat.backends.begin() || avail < m_avail)
+				m_avail = avail;
+		}
+
+		float target = policy.weight(m_meta, m_stat);
+		float current = current_weight(now);
+
+		std::chrono::milliseconds tc = target > current ? m_smoothing.rise : m_smoothing.fall;
+		bool smooth = tc.count() > 0 && target > 0 && current > 0 && m_stat_complete;
+
+		m_weight = smooth ? current : target;
+		m_target_weight = target;
+		m_weight_time = now;
+		m_stat_complete = m_stat.backends.size() == m_meta.groups.size();
+
+		update_usage();
+	}
+
+	// must be called with @m_lock held
+	void update_usage() {
+		uint64_t size = 0, keys = 0;
+		if (m_usage->stat_usage.load(std::memory_order_relaxed)) {
+			for (auto st = m_stat.backends.begin(), end = m_stat.backends.end(); st != end; ++st) {
+				const backend_stat &bs = st->second;
+				size = std::max(size, bs.size.used > bs.size.removed ? bs.size.used - bs.size.removed : 0);
+				keys = std::max(keys, bs.records.total > bs.records.removed ?
+						bs.records.total - bs.records.removed : 0);
+			}
+		}
+
+		m_usage->stat_size.store(size, std::memory_order_relaxed);
+		m_usage->stat_keys.store(keys, std::memory_order_relaxed);
+		m_usage->max_size.store(m_meta.max_size, std::memory_order_relaxed);
+		m_usage->max_key_num.store(m_meta.max_key_num, std::memory_order_relaxed);
+	}
+
+	// must be called with @m_lock held,
+	// statistics usage is the maximum among groups, writes accounted before the first group of the round
+	// has reported are dropped only when every group has reported, thus they are never lost from usage
+	void quota_reported(int group) {
+		if (!m_usage->stat_usage.load(std::memory_order_relaxed))
+			return;
+
+		if (m_quota_reported.empty()) {
+			m_quota_mark_size = m_usage->written_size.load(std::memory_order_relaxed);
+			m_quota_mark_keys = m_usage->written_keys.load(std::memory_order_relaxed);
+		}
+		m_quota_reported.insert(group);
+
+		for (auto g = m_meta.groups.begin(), end = m_meta.groups.end(); g != end; ++g) {
+			if (m_quota_reported.find(*g) == m_quota_reported.end())
+				return;
+		}
+
+		m_usage->written_size.fetch_sub(m_quota_mark_size, std::memory_order_relaxed);
+		m_usage->written_keys.fetch_sub(m_quota_mark_keys, std::memory_order_relaxed);
+		m_quota_reported.clear();
+	}
+
+	void reload_completed(const std::vector<storage_result> &result, const elliptics::error_info &error) {
+		elliptics::logger &log = m_storage->log();
 
 		if (error) {
 			BH_LOG(log, DNET_LOG_ERROR, "reload_completed: bucket: %s: could not reload: %s, error: %d",
@@ -297,35 +1051,41 @@ private:
 		m_wait.notify_all();
 	}
 
-	void meta_unpack(const elliptics::sync_read_result &result) {
-		elliptics::logger &log = m_node->get_log();
+	void meta_unpack(const std::vector<storage_result> &result) {
+		elliptics::logger &log = m_storage->log();
 
 		for (auto ent = result.begin(), end = result.end(); ent != end; ++ent) {
-			if (ent->error()) {
-				BH_LOG(log, DNET_LOG_ERROR, "meta_unpack: bucket: %s, error result: %s [%d]",
-						m_meta.name.c_str(), ent->error().message(), ent->error().code());
+			if (ent->error) {
+				BH_LOG(log, DNET_LOG_ERROR, "meta_unpack: bucket: %s, group: %d, error result: %s [%d]",
+						m_meta.name.c_str(), ent->group, ent->error.message(), ent->error.code());
 				continue;
 			}
 
 			try {
-				const elliptics::data_pointer &file = ent->file();
-
 				msgpack::unpacked msg;
-				msgpack::unpack(&msg, file.data<char>(), file.size());
+				msgpack::unpack(&msg, ent->data.data(), ent->data.size());
 
 				bucket_meta tmp;
 
 				msg.get().convert(&tmp);
 
+				std::shared_ptr<const std::string> json = pack_json(tmp);
+				std::shared_ptr<const std::string> mpack = pack_msgpack(tmp);
+
 				std::ostringstream ss;
 				std::copy(tmp.groups.begin(), tmp.groups.end(), std::ostream_iterator<int>(ss, ":"));
 
 				BH_LOG(log, DNET_LOG_INFO, "meta_unpack: bucket: %s, acls: %ld, flags: 0x%lx, groups: %s",
 						tmp.name.c_str(), tmp.acl.size(), tmp.flags, ss.str());
 
-				std::unique_lock<std::mutex> guard(m_lock);
+				std::unique_lock<instrumented_mutex> guard(m_lock);
 				std::swap(m_meta, tmp);
+				m_json.swap(json);
+				m_msgpack.swap(mpack);
 				m_valid = true;
+
+				// number of groups affects weight
+				update_weight(default_policy(), std::chrono::steady_clock::now());
 			} catch (const std::exception &e) {
 				BH_LOG(log, DNET_LOG_ERROR, "meta_unpack: bucket: %s, exception: %s",
 						m_meta.name.c_str(), e.what());
@@ -338,6 +1098,15 @@ typedef std::shared_ptr<raw_bucket> bucket;
 static inline bucket make_bucket(std::shared_ptr<elliptics::node> &node, const std::vector<int> mgroups, const std::string &name) {
 	return std::make_shared<raw_bucket>(node, mgroups, name);
 }
+static inline bucket make_bucket(std::shared_ptr<elliptics::node> &node, const bucket_meta &meta) {
+	return std::make_shared<raw_bucket>(node, meta);
+}
+static inline bucket make_bucket(std::shared_ptr<storage> st, const std::vector<int> mgroups, const std::string &name) {
+	return std::make_shared<raw_bucket>(st, mgroups, name);
+}
+static inline bucket make_bucket(std::shared_ptr<storage> st, const bucket_meta &meta) {
+	return std::make_shared<raw_bucket>(st, meta);
+}
 
 }} // namespace ioremap::ebucket
 
@@ -3,15 +3,148 @@
 
 #include "ebucket/bucket.hpp"
 #include "ebucket/elliptics_stat.hpp"
+#include "ebucket/hot_log.hpp"
+#include "ebucket/metrics.hpp"
+#include "ebucket/storage.hpp"
+#include "ebucket/trace.hpp"
 
 #include <elliptics/session.hpp>
 
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <functional>
+#include <future>
+#include <random>
+#include <set>
 #include <thread>
 
 namespace ioremap { namespace ebucket {
 
+// Notification sent to subscribers from the bucket update path.
+// @meta_changed is also sent when bucket becomes valid or invalid.
+struct bucket_event {
+	enum event_type {
+		added = 0,
+		removed,
+		meta_changed,
+		weight_changed,
+	};
+
+	event_type	type = added;
+	std::string	name;
+	bucket		b;
+	bool		valid = false;
+
+	// weight does not depend on requested size here, it is the value
+	// cached at the last statistics update
+	float		old_weight = 0;
+	float		new_weight = 0;
+};
+
+typedef std::function<void (const bucket_event &)> bucket_event_handler;
+
+// Result of the write with failover.
+// On success @url points to the object, @b is the bucket it has been written into
+// and @results contains per-group results of the last attempt.
+// @failed lists buckets tried before, partially written copies are not removed from them.
+struct write_result {
+	eurl				url;
+	bucket				b;
+	std::vector<storage_result>	results;
+	std::vector<std::string>	failed;
+	elliptics::error_info		error;
+};
+
+typedef std::function<void (const write_result &)> write_handler;
+
+// Result of the bulk write, every vector has one entry per written object in request order.
+// Object is written if its @errors entry is not set, then @urls entry points to it.
+struct bulk_write_result {
+	std::vector<eurl>			urls;
+	std::vector<elliptics::error_info>	errors;
+
+	// number of objects which have not been written
+	size_t					failed = 0;
+};
+
+typedef std::function<void (const bulk_write_result &)> bulk_write_handler;
+
+// Failure domains (datacenters, racks, hosts) used by the two-level bucket selection.
+//
+// Domain of the group is taken from @groups, otherwise it is the domain of the host of its backend
+// (see @backend_stat::addr) from @hosts, or the host itself if it is not listed there.
+// Bucket belongs to every domain its groups are placed in, groups without statistics
+// and not listed in @groups do not affect bucket domains.
+struct failure_domains {
+	// selection is flat if domains are disabled
+	bool					enabled = false;
+
+	std::map<std::string, std::string>	hosts;
+	std::map<int, std::string>		groups;
+
+	std::string group_domain(int group, const bucket_stat &stat) const {
+		auto g = groups.find(group);
+		if (g != groups.end())
+			return g->second;
+
+		auto st = stat.backends.find(group);
+		if (st == stat.backends.end())
+			return std::string();
+
+		std::string host = dnet_addr_host_string(&st->second.addr);
+		auto h = hosts.find(host);
+		if (h != hosts.end())
+			return h->second;
+
+		return host;
+	}
+
+	// sorted list of distinct domains of the bucket groups
+	std::vector<std::string> bucket_domains(const std::vector<int> &bgroups, const bucket_stat &stat) const {
+		std::set<std::string> domains;
+		for (auto g = bgroups.begin(), end = bgroups.end(); g != end; ++g) {
+			std::string domain = group_domain(*g, stat);
+			if (!domain.empty())
+				domains.insert(domain);
+		}
+
+		return std::vector<std::string>(domains.begin(), domains.end());
+	}
+};
+
+// Immutable copy of the bucket state taken on the update path.
+struct bucket_state {
+	std::string	name;
+	bool		valid = false;
+	std::vector<int> groups;
+
+	// size-independent weight and minimal free space among backends
+	// cached at the last statistics update
+	float		weight = 0;
+	uint64_t	avail = 0;
+
+	// quota usage at the time snapshot was taken
+	uint64_t	used_size = 0;
+	uint64_t	used_keys = 0;
+
+	// failure domains of the bucket groups, see @failure_domains, empty if domains are disabled
+	std::vector<std::string> domains;
+
+	bucket_stat	stat;
+};
+
+// Immutable snapshot of the whole processor, it is published atomically
+// after every bucket reload or statistics change and can be read without any processor or bucket locks.
+struct processor_state {
+	// time of the last successful statistics update and the last metadata reload
+	std::chrono::system_clock::time_point	stat_time;
+	std::chrono::system_clock::time_point	meta_time;
+
+	// bucket list is shared between snapshots if only statistics time has changed
+	std::shared_ptr<const std::vector<bucket_state>>	buckets = std::make_shared<std::vector<bucket_state>>();
+};
+
 // This class implements main distribution logic.
 // There are multiple @bucket objects in the processor,
 // each bucket corresponds to logical entity which handles replication
@@ -37,19 +170,29 @@ namespace ioremap { namespace ebucket {
 // quickly one can read object from given destination point. When reading data from bucket, it selects
 // the fastest desistnation point among its replicas and reads data from that point. If data is not available,
 // elliptics will automatically fetch (data recover) data from other copies.
-class bucket_processor {
+//
+// Bucket weights are calculated by @WeightPolicy, see @default_weight_policy for the interface.
+// Policy is a template parameter, thus its calls are inlined on the selection path.
+template <typename WeightPolicy = default_weight_policy>
+class basic_bucket_processor {
 public:
-	bucket_processor(std::shared_ptr<elliptics::node> node) :
-	m_node(node),
-	m_stat(node),
-	m_error_session(*m_node),
-	m_buckets_update(std::bind(&bucket_processor::buckets_update, this))
+	typedef WeightPolicy weight_policy_type;
+
+	basic_bucket_processor(std::shared_ptr<elliptics::node> node, const WeightPolicy &policy = WeightPolicy()) :
+	basic_bucket_processor(make_storage(node), policy)
 	{
-		m_error_session.set_exceptions_policy(elliptics::session::no_exceptions);
-		m_error_session.set_filter(elliptics::filters::all_with_ack);
 	}
 
-	virtual ~bucket_processor() {
+	// processor works with any storage implementation, for example with @memory_storage
+	basic_bucket_processor(std::shared_ptr<storage> st, const WeightPolicy &policy = WeightPolicy()) :
+	m_storage(st),
+	m_policy(policy),
+	m_stat(st, m_metrics),
+	m_buckets_update(std::bind(&basic_bucket_processor::buckets_update, this))
+	{
+	}
+
+	virtual ~basic_bucket_processor() {
 		m_need_exit = true;
 		m_wait.notify_all();
 		if (m_buckets_update.joinable())
@@ -60,7 +203,7 @@ public:
 		if (bucket_key.empty())
 			return false;
 
-		std::unique_lock<std::mutex> lock(m_lock);
+		std::unique_lock<instrumented_mutex> lock(m_lock);
 		m_bucket_key = bucket_key;
 		m_meta_groups = mgroups;
 		lock.unlock();
@@ -78,12 +221,23 @@ public:
 
 	bool init(const std::vector<int> &mgroups, const std::vector<std::string> &bnames) {
 		std::map<std::string, bucket> buckets = read_buckets(mgroups, bnames);
+		std::map<int, std::vector<bucket>> group_buckets = index_groups(buckets);
+
+		std::unique_lock<instrumented_mutex> lock(m_lock);
 
-		std::unique_lock<std::mutex> lock(m_lock);
+		std::map<std::string, bucket> old_buckets;
+		old_buckets.swap(m_buckets);
 
 		m_buckets = buckets;
+		m_group_buckets.swap(group_buckets);
 		m_bnames = bnames;
 		m_meta_groups = mgroups;
+		m_static_buckets = false;
+		lock.unlock();
+
+		trace_reload(buckets);
+		notify_changes(old_buckets, buckets);
+		publish_state(true);
 
 		if (buckets.empty())
 			return false;
@@ -91,105 +245,254 @@ public:
 		return true;
 	}
 
+	// returns the last published snapshot, it never takes processor or bucket locks,
+	// returned pointer is never empty
+	std::shared_ptr<const processor_state> state() const {
+		return std::atomic_load(&m_state);
+	}
+
+	// Uses given buckets as is: neither bucket list nor bucket metadata is reloaded,
+	// only backend statistics is periodically updated.
+	// This is used for tests and benchmarks with synthetic buckets.
+	bool init(const std::vector<bucket> &static_buckets) {
+		std::map<std::string, bucket> buckets;
+		for (auto it = static_buckets.begin(), end = static_buckets.end(); it != end; ++it) {
+			(*it)->set_weight_smoothing(weight_smoothing_config());
+			(*it)->set_quota_stat_usage(quota_stat_usage_config());
+			(*it)->recalculate_weight(m_policy);
+			buckets[(*it)->name()] = *it;
+		}
+		std::map<int, std::vector<bucket>> group_buckets = index_groups(buckets);
+
+		std::unique_lock<instrumented_mutex> lock(m_lock);
+
+		std::map<std::string, bucket> old_buckets;
+		old_buckets.swap(m_buckets);
+
+		m_buckets = buckets;
+		m_group_buckets.swap(group_buckets);
+		m_bucket_key.clear();
+		m_bnames.clear();
+		m_static_buckets = true;
+		lock.unlock();
+
+		trace_reload(buckets);
+		notify_changes(old_buckets, buckets);
+		publish_state(true);
+
+		return !buckets.empty();
+	}
+
+	// Registers handler which will be invoked from the update thread
+	// when bucket is added, removed, its metadata or validity changes,
+	// or its weight changes by at least @set_weight_notify_threshold() since the last notification.
+	// Handler must not block, it delays bucket updates.
+	//
+	// Returns subscription id which should be used to unsubscribe.
+	uint64_t subscribe(const bucket_event_handler &handler) {
+		std::lock_guard<std::mutex> guard(m_subscribers_lock);
+		uint64_t id = ++m_subscriber_id;
+		m_subscribers[id] = handler;
+		return id;
+	}
+
+	void unsubscribe(uint64_t id) {
+		std::lock_guard<std::mutex> guard(m_subscribers_lock);
+		m_subscribers.erase(id);
+	}
+
+	// weight change notification is sent when weight differs from previously
+	// notified value by at least @threshold, or when it becomes zero or non-zero
+	void set_weight_notify_threshold(float threshold) {
+		std::lock_guard<std::mutex> guard(m_subscribers_lock);
+		m_weight_notify_threshold = threshold;
+	}
+
 	const elliptics::logger &logger() const {
-		return m_node->get_log();
+		return m_storage->log();
+	}
+
+	std::shared_ptr<storage> get_storage() const {
+		return m_storage;
 	}
 
+	// policy is shared by the update thread and selection threads,
+	// its methods must be safe to call concurrently
+	const WeightPolicy &weight_policy() const {
+		return m_policy;
+	}
+
+	// all processor metrics, applications may register their own metrics here too
+	metrics_registry &metrics() {
+		return m_metrics;
+	}
+
+	// throws if processor storage is not elliptics cluster
 	elliptics::session error_session() const {
-		return m_error_session;
+		std::shared_ptr<elliptics::node> node = m_storage->node();
+		if (!node) {
+			throw std::runtime_error("bucket processor storage is not elliptics, there is no session");
+		}
+
+		elliptics::session s(*node);
+		s.set_exceptions_policy(elliptics::session::no_exceptions);
+		s.set_filter(elliptics::filters::all_with_ack);
+		return s;
 	}
 
-	// returns bucket name in @data or negative error code in @error
-	elliptics::error_info get_bucket(size_t size, bucket &ret) {
-		elliptics::logger &log = m_node->get_log();
+	// Backend statistics is polled every @stat_interval and propagated only
+	// to buckets which use groups whose statistics has changed.
+	// Bucket metadata and bucket list are reloaded every @meta_interval.
+	void set_update_intervals(const std::chrono::milliseconds &stat_interval, const std::chrono::milliseconds &meta_interval) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_stat_interval = stat_interval;
+		m_meta_interval = meta_interval;
+		m_wait.notify_all();
+	}
 
-		std::unique_lock<std::mutex> guard(m_lock);
-		if (m_buckets.size() == 0) {
-			return elliptics::create_error(-ENODEV, "there are no buckets at all");
+	// Starts recording placement trace into @path, see trace.hpp for the format.
+	// Current buckets and their statistics are written first, then every selection,
+	// statistics change and bucket reload is appended. Previous trace is closed.
+	bool start_trace(const std::string &path) {
+		elliptics::logger &log = m_storage->log();
+
+		std::shared_ptr<trace_writer> trace;
+		try {
+			trace = std::make_shared<trace_writer>(path);
+		} catch (const std::exception &e) {
+			BH_LOG(log, DNET_LOG_ERROR, "start_trace: %s", e.what());
+			return false;
 		}
 
-		struct bw {
-			bucket		b;
-			float		w = 0;
-		};
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		std::map<std::string, bucket> buckets = m_buckets;
+		guard.unlock();
 
-		std::vector<bw> good_buckets;
-		good_buckets.reserve(m_buckets.size());
+		trace_buckets(*trace, buckets);
+		std::atomic_store(&m_trace, trace);
 
-		limits l;
-		for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
-			if (!it->second->valid())
-				continue;
+		BH_LOG(log, DNET_LOG_INFO, "start_trace: recording placement trace into %s, buckets: %zd",
+				path.c_str(), buckets.size());
+		return true;
+	}
 
-			bw b;
-			b.b = it->second;
-			// weight calculation is a rather heavy task, cache this value
-			b.w = it->second->weight(size, l);
-			if (b.w == 0)
-				continue;
+	// trace file is flushed and closed when the last selection using it completes
+	void stop_trace() {
+		std::shared_ptr<trace_writer> trace = std::atomic_exchange(&m_trace, std::shared_ptr<trace_writer>());
+		if (trace)
+			trace->flush();
+	}
 
-			good_buckets.push_back(b);
+	// requests fresh backend statistics and updates weights of the buckets
+	// which contain groups whose statistics has changed
+	void update_stats() {
+		std::vector<int> changed = m_stat.schedule_update_and_wait();
+		if (changed.empty()) {
+			// bucket states have not changed, only refresh statistics time
+			std::shared_ptr<processor_state> st = std::make_shared<processor_state>(*state());
+			st->stat_time = m_stat.update_time();
+			std::atomic_store(&m_state, std::shared_ptr<const processor_state>(st));
+			return;
 		}
 
-		guard.unlock();
+		std::map<int, std::vector<bucket>> affected;
 
-		if (good_buckets.size() == 0) {
-			return elliptics::create_error(-ENODEV, "there are buckets, but they are not suitable for size %zd", size);
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		for (auto g = changed.begin(), gend = changed.end(); g != gend; ++g) {
+			auto it = m_group_buckets.find(*g);
+			if (it != m_group_buckets.end())
+				affected[*g] = it->second;
 		}
+		guard.unlock();
 
-		auto routes = m_error_session.get_routes();
+		std::shared_ptr<trace_writer> trace = std::atomic_load(&m_trace);
 
-		float sum = 0;
-		for (auto it = good_buckets.rbegin(), end = good_buckets.rend(); it != end; ++it) {
-			// check whether all groups from given buckets are present in the current route table
-			size_t have_routes = 0;
-			bucket_meta bmeta = it->b->meta();
+		size_t updated = 0;
+		std::map<std::string, bucket> updated_buckets;
+		for (auto it = affected.begin(), end = affected.end(); it != end; ++it) {
+			backend_stat bs = m_stat.stat(it->first);
 
-			for (auto it = routes.begin(), it_end = routes.end(); it != it_end; ++it) {
-				for (size_t i = 0; i < bmeta.groups.size(); ++i) {
-					if (it->group_id == bmeta.groups[i]) {
-						have_routes++;
-						break;
-					}
+			if (trace) {
+				if (bs.group == it->first) {
+					trace->stat(it->first, bs);
+				} else {
+					trace->clear_stat(it->first);
 				}
-
-				if (have_routes == bmeta.groups.size())
-					break;
 			}
 
+			for (auto b = it->second.begin(), bend = it->second.end(); b != bend; ++b) {
+				if (bs.group == it->first) {
+					(*b)->set_backend_stat(it->first, bs, m_policy);
+				} else {
+					(*b)->clear_backend_stat(it->first, m_policy);
+				}
 
-			// there are no routes to one or more groups in this bucket, heavily decrease its weight
-			if (have_routes != bmeta.groups.size()) {
-				it->w /= 100;
+				updated_buckets[(*b)->name()] = *b;
+				updated++;
 			}
+		}
 
-			sum += it->w;
+		notify_weights(updated_buckets);
+		publish_state(false);
+
+		elliptics::logger &log = m_storage->log();
+		BH_LOG(log, DNET_LOG_INFO, "update_stats: changed groups: %zd, affected groups: %zd, bucket updates: %zd",
+				changed.size(), affected.size(), updated);
+	}
+
+	// returns bucket name in @data or negative error code in @error
+	elliptics::error_info get_bucket(size_t size, bucket &ret) {
+		scoped_timer timer(m_get_bucket_hist);
+
+		std::vector<bucket_candidate> good_buckets;
+		elliptics::error_info err = candidates(good_buckets);
+		if (err) {
+			m_select_errors.inc();
+			trace_select(size, bucket());
+			return err;
 		}
 
-		struct {
-			// reverse sort - from higher to lower weights
-			bool operator()(const bw &b1, const bw &b2) {
-				return b1.w > b2.w;
-			}
-		} cmp;
-		std::sort(good_buckets.begin(), good_buckets.end(), cmp);
+		ret = select(good_buckets, size);
+		trace_select(size, ret);
+		if (!ret) {
+			m_select_errors.inc();
+			return elliptics::create_error(-ENODEV, "there are buckets, but they are not suitable for size %zd", size);
+		}
 
-		// randomly select value in a range [0, sum+1)
-		// then iterate over all good buckets starting from the one with the highest weight
-		//
-		// the higher the weight, the more likely this bucket will be selected
-		float rnd = (0 + (rand() % (int)(sum * 10 - 0 + 1))) / 10.0;
+		return elliptics::error_info();
+	}
 
-		BH_LOG(log, DNET_LOG_NOTICE, "test: weight selection: good-buckets: %d, rnd: %f, sum: %f",
-				good_buckets.size(), rnd, sum);
+	// Selects bucket for every size in @sizes using single candidate list,
+	// thus lock, route table and bucket metadata are only accessed once per batch.
+	//
+	// @ret and @errors will have the same number of entries as @sizes,
+	// if there is no bucket for given size, @ret entry is empty and @errors entry contains error.
+	// Returned error is set only if there are no suitable buckets at all.
+	elliptics::error_info get_buckets(const std::vector<uint64_t> &sizes,
+			std::vector<bucket> &ret, std::vector<elliptics::error_info> &errors) {
+		scoped_timer timer(m_get_buckets_hist);
+
+		ret.assign(sizes.size(), bucket());
+		errors.assign(sizes.size(), elliptics::error_info());
+
+		std::vector<bucket_candidate> good_buckets;
+		elliptics::error_info err = candidates(good_buckets);
+		if (err) {
+			errors.assign(sizes.size(), err);
+			for (auto it = sizes.begin(), end = sizes.end(); it != end; ++it) {
+				trace_select(*it, bucket());
+			}
+			return err;
+		}
 
-		for (auto it = good_buckets.rbegin(), end = good_buckets.rend(); it != end; ++it) {
-			BH_LOG(log, DNET_LOG_NOTICE, "test: weight comparison: bucket: %s, sum: %f, rnd: %f, weight: %f",
-					it->b->name().c_str(), sum, rnd, it->w);
-			rnd -= it->w;
-			if (rnd <= 0) {
-				ret = it->b;
-				break;
+		for (size_t i = 0; i < sizes.size(); ++i) {
+			ret[i] = select(good_buckets, sizes[i]);
+			trace_select(sizes[i], ret[i]);
+			if (!ret[i]) {
+				m_select_errors.inc();
+				errors[i] = elliptics::create_error(-ENODEV,
+						"there are buckets, but they are not suitable for size %llu",
+						(unsigned long long)sizes[i]);
 			}
 		}
 
@@ -207,7 +510,7 @@ public:
 	}
 
 	elliptics::error_info find_bucket(const std::string &bname, bucket &b) {
-		std::lock_guard<std::mutex> lock(m_lock);
+		std::lock_guard<instrumented_mutex> lock(m_lock);
 		auto it = m_buckets.find(bname);
 		if (it == m_buckets.end()) {
 			return elliptics::create_error(-ENOENT, "could not find bucket '%s' in bucket list", bname.c_str());
@@ -221,249 +524,1247 @@ public:
 		return elliptics::error_info();
 	}
 
+	// Selects bucket for @data and writes object @key into all its groups.
+	// If write fails in at least one group, next bucket is selected out of the same candidate list
+	// with failed buckets excluded, at most @set_write_attempts() buckets are tried.
+	// @handler is called exactly once, either from the calling thread or from storage IO thread.
+	void write(const std::string &key, const std::string &data, const write_handler &handler) {
+		std::shared_ptr<write_state> state = std::make_shared<write_state>();
+		state->key = key;
+		state->data = data;
+		state->handler = handler;
+		state->start = std::chrono::steady_clock::now();
+
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		state->attempts = m_write_attempts;
+		guard.unlock();
+
+		elliptics::error_info err = candidates(state->cands);
+		if (err) {
+			m_select_errors.inc();
+			trace_select(data.size(), bucket());
+			state->res.error = err;
+			write_complete(state);
+			return;
+		}
+
+		write_next(state);
+	}
+
+	// synchronous version of the write with failover
+	write_result write(const std::string &key, const std::string &data) {
+		std::shared_ptr<std::promise<write_result>> done = std::make_shared<std::promise<write_result>>();
+		std::future<write_result> completed = done->get_future();
+
+		write(key, data, [done] (const write_result &res) {
+				done->set_value(res);
+			});
+
+		return completed.get();
+	}
+
+	// Writes batch of objects: buckets are selected for all objects out of single candidate list,
+	// objects are grouped by bucket and every bucket gets one storage bulk write.
+	// Object is written only if it has been written into every group of its bucket,
+	// failed objects are not retried in other buckets.
+	// @handler is called exactly once, either from the calling thread or from storage IO thread.
+	void bulk_write(const std::vector<std::string> &keys, const std::vector<std::string> &data,
+			const bulk_write_handler &handler) {
+		std::shared_ptr<bulk_write_state> state = std::make_shared<bulk_write_state>();
+		state->handler = handler;
+		state->start = std::chrono::steady_clock::now();
+		state->res.urls.resize(keys.size());
+		state->res.errors.resize(keys.size());
+
+		if (keys.size() != data.size()) {
+			elliptics::error_info err = elliptics::create_error(-EINVAL,
+					"number of keys %zd does not match number of objects %zd", keys.size(), data.size());
+			state->res.errors.assign(keys.size(), err);
+			bulk_write_complete(state);
+			return;
+		}
+
+		std::vector<uint64_t> sizes;
+		sizes.reserve(data.size());
+		for (auto it = data.begin(), end = data.end(); it != end; ++it) {
+			sizes.push_back(it->size());
+		}
+
+		std::vector<bucket> buckets;
+		get_buckets(sizes, buckets, state->res.errors);
+
+		// bucket name -> indexes of objects which go into this bucket
+		std::map<std::string, std::vector<size_t>> groups;
+		std::map<std::string, bucket> bmap;
+		for (size_t i = 0; i < buckets.size(); ++i) {
+			if (!buckets[i])
+				continue;
+
+			groups[buckets[i]->name()].push_back(i);
+			bmap[buckets[i]->name()] = buckets[i];
+		}
+
+		if (groups.empty()) {
+			bulk_write_complete(state);
+			return;
+		}
+
+		// handlers may be called from this thread, thus counter is set before the first write
+		state->pending = groups.size();
+
+		for (auto it = groups.begin(), end = groups.end(); it != end; ++it) {
+			std::vector<std::string> bkeys, bdata;
+			bkeys.reserve(it->second.size());
+			bdata.reserve(it->second.size());
+
+			for (auto i = it->second.begin(), iend = it->second.end(); i != iend; ++i) {
+				bkeys.push_back(keys[*i]);
+				bdata.push_back(data[*i]);
+			}
+
+			bucket b = bmap[it->first];
+			std::shared_ptr<std::vector<size_t>> idx = std::make_shared<std::vector<size_t>>(it->second);
+
+			b->bulk_write(bkeys, bdata,
+				[this, state, b, idx, bkeys] (const std::vector<std::vector<storage_result>> &results,
+						const elliptics::error_info &error) {
+					bulk_write_completed(state, b, *idx, bkeys, results, error);
+				});
+		}
+	}
+
+	// synchronous version of the bulk write
+	bulk_write_result bulk_write(const std::vector<std::string> &keys, const std::vector<std::string> &data) {
+		std::shared_ptr<std::promise<bulk_write_result>> done = std::make_shared<std::promise<bulk_write_result>>();
+		std::future<bulk_write_result> completed = done->get_future();
+
+		bulk_write(keys, data, [done] (const bulk_write_result &res) {
+				done->set_value(res);
+			});
+
+		return completed.get();
+	}
+
+	// maximum number of buckets @write() tries for one object
+	void set_write_attempts(size_t attempts) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_write_attempts = attempts ? attempts : 1;
+	}
+
+	// weight transitions of all buckets, see @weight_smoothing, smoothing is disabled by default
+	void set_weight_smoothing(const weight_smoothing &ws) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_weight_smoothing = ws;
+		for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
+			it->second->set_weight_smoothing(ws);
+		}
+	}
+
+	weight_smoothing weight_smoothing_config() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_weight_smoothing;
+	}
+
+	// Thresholds of the free quota ratio of the bucket (see @bucket_meta::max_size and @bucket_meta::max_key_num),
+	// bucket is excluded from selection below hard limit and its weight is heavily decreased below soft limit
+	void set_quota_limits(const limits &l) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_quota_limits = l;
+	}
+
+	// Enables two-level selection: physical domain is selected first, then bucket among those
+	// which have at least one group in that domain.
+	// Domain weight is the mean weight of buckets placed in it, thus domain which hosts groups
+	// of many buckets does not get more writes than domain with few buckets of the same weight.
+	void set_failure_domains(const failure_domains &fd) {
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		m_failure_domains = fd;
+		guard.unlock();
+
+		publish_state(false);
+	}
+
+	// Quota usage is taken from backend statistics, this is only correct if backends
+	// are not shared between buckets, see @quota_usage. Disabled by default.
+	void set_quota_stat_usage(bool enabled) {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_quota_stat_usage = enabled;
+		for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
+			it->second->set_quota_stat_usage(enabled);
+		}
+	}
+
+	bool quota_stat_usage_config() {
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		return m_quota_stat_usage;
+	}
+
+	// backend health parameters, they are used starting from the next statistics update
+	void set_health_config(const health_config &cfg) {
+		m_stat.set_health_config(cfg);
+	}
+
+	// result of the selection self test
+	struct test_result {
+		// buckets with non-zero weight and bins used in chi-square test
+		// after merging buckets with too small expected selection number
+		size_t		buckets = 0;
+		size_t		bins = 0;
+
+		size_t		selections = 0;
+		double		seconds = 0;
+		double		throughput = 0;
+
+		double		chi2 = 0;
+		double		critical = 0;
+	};
 
 	// run self test, raise exception if there are problems
 	//
 	// Tests:
-	// 1. select bucket for upload multiple times,
-	// 	check that distribution is biased towards buckets with more free space available
-	void test() {
-		elliptics::logger &log = m_node->get_log();
-		BH_LOG(log, DNET_LOG_INFO, "test: start: buckets: %d", m_buckets.size());
+	// 1. select bucket for upload @num times from @threads threads in parallel,
+	// 	check with chi-square goodness-of-fit test that selection distribution
+	// 	matches bucket weights at given @confidence level
+	test_result test(size_t num = 100000, int threads = 4, double confidence = 0.999) {
+		elliptics::logger &log = m_storage->log();
+
+		std::vector<bucket_candidate> cands;
+		elliptics::error_info err = candidates(cands);
+		if (err) {
+			throw std::runtime_error("test: " + err.message());
+		}
 
-		std::unique_lock<std::mutex> guard(m_lock);
-		if (m_buckets.size() == 0) {
-			throw std::runtime_error("there are no buckets at all");
+		std::map<std::string, size_t> index;
+		for (size_t i = 0; i < cands.size(); ++i) {
+			index[cands[i].b->name()] = i;
 		}
 
-		limits l;
+		// with failure domains selection probability is not proportional to the bucket weight
+		std::vector<double> prob = probabilities(cands, 1);
 
-		struct bucket_weight {
-			bucket		b;
-			float		weight = 0;
-			int		counter = 0;
-		};
+		BH_LOG(log, DNET_LOG_INFO, "test: start: buckets: %zd, selections: %zd, threads: %d, confidence: %f",
+				cands.size(), num, threads, confidence);
 
-		std::vector<bucket_weight> good_buckets;
-		std::vector<bucket_weight> really_good_buckets;
+		if (threads < 1)
+			threads = 1;
 
-		float sum = 0;
-		float really_good_sum = 0;
-		for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
-			if (it->second->valid()) {
-				float w = it->second->weight(1, l);
+		std::vector<std::vector<size_t>> counters(threads, std::vector<size_t>(cands.size(), 0));
+		std::vector<std::string> errors(threads);
 
-				BH_LOG(log, DNET_LOG_NOTICE, "test: bucket: %s, weight: %f", it->second->name(), w);
+		auto start = std::chrono::steady_clock::now();
 
-				// skip buckets with zero weights
-				// usually this means that there is no free space for this request
-				// or stats are broken (timed out)
-				if (w <= 0)
-					continue;
+		std::vector<std::thread> workers;
+		for (int t = 0; t < threads; ++t) {
+			size_t thread_num = num / threads + ((size_t)t < num % threads ? 1 : 0);
 
-				bucket_weight bw;
-				bw.b = it->second;
-				bw.weight = w;
+			workers.emplace_back([&, t, thread_num] () {
+				std::vector<size_t> &cnt = counters[t];
 
-				good_buckets.push_back(bw);
-				sum += w;
+				for (size_t i = 0; i < thread_num; ++i) {
+					bucket b;
+					elliptics::error_info err = get_bucket(1, b);
+					if (err) {
+						errors[t] = "get_bucket() failed: " + err.message();
+						return;
+					}
 
-				if (w > 0.5) {
-					really_good_buckets.push_back(bw);
-					really_good_sum += w;
+					auto it = index.find(b->name());
+					if (it != index.end())
+						cnt[it->second]++;
 				}
-			}
+			});
 		}
 
-		guard.unlock();
-
-		// use really good buckets if we have them
-		if (really_good_sum > 0) {
-			sum = really_good_sum;
-			good_buckets.swap(really_good_buckets);
+		for (auto it = workers.begin(), end = workers.end(); it != end; ++it) {
+			it->join();
 		}
 
-		if (good_buckets.size() == 0) {
-			throw std::runtime_error("there are buckets, but they are not suitable for size " +
-					elliptics::lexical_cast(1));
+		test_result res;
+		res.buckets = cands.size();
+		res.selections = num;
+		res.seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count() / 1000000.0;
+		res.throughput = res.seconds > 0 ? num / res.seconds : 0;
+
+		for (auto it = errors.begin(), end = errors.end(); it != end; ++it) {
+			if (!it->empty())
+				throw std::runtime_error(*it);
 		}
 
+		struct bin {
+			double	expected = 0;
+			size_t	observed = 0;
+		};
 
-		// first test - call @get_bucket() many times, check that distribution
-		// of the buckets looks similar to the initial weights
-		int num = 10000;
-		for (int i = 0; i < num; ++i) {
-			std::string bname;
-			elliptics::error_info err = get_bucket(1, bname);
-			if (err) {
-				throw std::runtime_error("get_bucket() failed: " + err.message());
+		std::vector<bin> bins(cands.size());
+		for (size_t i = 0; i < cands.size(); ++i) {
+			bins[i].expected = (double)num * prob[i];
+			for (int t = 0; t < threads; ++t) {
+				bins[i].observed += counters[t][i];
 			}
 
-			auto bit = std::find_if(good_buckets.begin(), good_buckets.end(),
-					[&](const bucket_weight &bw) { return bw.b->name() == bname; });
-			if (bit != good_buckets.end()) {
-				bit->counter++;
-			}
+			BH_LOG(log, DNET_LOG_NOTICE, "test: bucket: %s, weight: %f, selected: %zd, expected: %f",
+					cands[i].b->name().c_str(), cands[i].w, bins[i].observed, bins[i].expected);
 		}
 
-		float eq_min = 0.9;
-		float eq_max = 1.1;
-		for (auto it = good_buckets.begin(), end = good_buckets.end(); it != end; ++it) {
-			float ratio = (float)it->counter/(float)num;
-			float wratio = it->weight / sum;
+		// chi-square approximation requires expected number in every bin to be at least 5,
+		// merge the least probable buckets together until this holds
+		std::sort(bins.begin(), bins.end(), [] (const bin &b1, const bin &b2) { return b1.expected < b2.expected; });
 
-			// @ratio is a number of this bucket selection related to total number of runs
-			// it should rougly correspond to the ratio of free space in given bucket, or weight
+		std::vector<bin> merged;
+		bin acc;
+		for (auto it = bins.begin(), end = bins.end(); it != end; ++it) {
+			acc.expected += it->expected;
+			acc.observed += it->observed;
+
+			if (acc.expected >= 5) {
+				merged.push_back(acc);
+				acc = bin();
+			}
+		}
+		if (acc.expected > 0) {
+			if (merged.empty()) {
+				merged.push_back(acc);
+			} else {
+				merged.back().expected += acc.expected;
+				merged.back().observed += acc.observed;
+			}
+		}
 
-			float eq = ratio / wratio;
+		res.bins = merged.size();
 
-			BH_LOG(log, DNET_LOG_INFO, "test: bucket: %s, weight: %f, counter: %d/%d, "
-					"weight ratio: %f, selection ratio: %f, ratio/wratio: %.2f (must be in [%.2f, %.2f]",
-					it->b->name(), it->weight,
-					it->counter, num,
-					wratio, ratio,
-					eq, eq_min, eq_max);
+		for (auto it = merged.begin(), end = merged.end(); it != end; ++it) {
+			double diff = (double)it->observed - it->expected;
+			res.chi2 += diff * diff / it->expected;
+		}
 
-			if (eq > eq_max || eq < eq_min) {
-				std::ostringstream ss;
-				ss << "bucket: " << it->b->name() <<
-					", weight: " << it->weight <<
-					", weight ratio: " << wratio <<
-					", selection ratio: " << ratio <<
-					": parameters mismatch, weight and selection ratios should be close to each other";
-				throw std::runtime_error(ss.str());
-			}
+		// there is nothing to compare if all selections fall into the single bin
+		if (merged.size() > 1)
+			res.critical = chi2_critical(merged.size() - 1, confidence);
+
+		BH_LOG(log, DNET_LOG_INFO, "test: buckets: %zd, bins: %zd, selections: %zd, time: %f seconds, "
+				"throughput: %f selections/s, chi2: %f, critical value: %f, confidence: %f",
+				res.buckets, res.bins, res.selections, res.seconds,
+				res.throughput, res.chi2, res.critical, confidence);
+
+		if (merged.size() > 1 && res.chi2 > res.critical) {
+			std::ostringstream ss;
+			ss << "selection distribution does not match bucket weights: " <<
+				"buckets: " << res.buckets <<
+				", bins: " << res.bins <<
+				", selections: " << res.selections <<
+				", chi2: " << res.chi2 <<
+				", critical value: " << res.critical <<
+				", confidence: " << confidence;
+			throw std::runtime_error(ss.str());
 		}
 
-		BH_LOG(log, DNET_LOG_INFO, "test: weight comparison of %d buckets has been completed", m_buckets.size());
+		return res;
 	}
 
 
 private:
-	std::shared_ptr<elliptics::node> m_node;
-
-	std::mutex m_lock;
+	std::shared_ptr<storage> m_storage;
+	WeightPolicy m_policy;
+
+	metrics_registry m_metrics;
+	latency_histogram &m_get_bucket_hist = m_metrics.histogram("ebucket_select_seconds",
+			"Bucket selection time", "op=\"get_bucket\"");
+	latency_histogram &m_get_buckets_hist = m_metrics.histogram("ebucket_select_seconds",
+			"Bucket selection time", "op=\"get_buckets\"");
+	metric_counter &m_select_errors = m_metrics.counter("ebucket_select_errors_total",
+			"Number of failed bucket selections");
+	latency_histogram &m_meta_reload_hist = m_metrics.histogram("ebucket_meta_reload_seconds",
+			"Time to reload metadata and statistics of all buckets");
+	latency_histogram &m_write_hist = m_metrics.histogram("ebucket_write_seconds",
+			"Time to write object including failover to other buckets");
+	metric_counter &m_write_errors = m_metrics.counter("ebucket_write_errors_total",
+			"Number of objects which could not be written into any bucket");
+	metric_counter &m_write_failovers = m_metrics.counter("ebucket_write_failovers_total",
+			"Number of bucket writes which failed and were retried in another bucket");
+	latency_histogram &m_bulk_write_hist = m_metrics.histogram("ebucket_bulk_write_seconds",
+			"Time to write the whole batch of objects");
+	metric_counter &m_bulk_write_objects = m_metrics.counter("ebucket_bulk_write_objects_total",
+			"Number of objects written using bulk write");
+
+	instrumented_mutex m_lock{"bucket_processor"};
 	std::vector<int> m_meta_groups;
 
 	std::string m_bucket_key;
 	std::vector<std::string> m_bnames;
 	std::map<std::string, bucket> m_buckets;
 
+	// reverse index: group id -> buckets which contain given group
+	std::map<int, std::vector<bucket>> m_group_buckets;
+
+	// buckets were provided by the caller, they are never reloaded
+	bool m_static_buckets = false;
+
+	size_t m_write_attempts = 3;
+
+	limits m_quota_limits;
+	bool m_quota_stat_usage = false;
+	weight_smoothing m_weight_smoothing;
+
+	// bucket name -> indexes of its failure domains, rebuilt with every published state,
+	// buckets which are not there yet and buckets without known domains share index @m_domains_num
+	failure_domains m_failure_domains;
+	std::map<std::string, std::shared_ptr<const std::vector<int>>> m_bucket_domains;
+	int m_domains_num = 0;
+	std::shared_ptr<const std::vector<int>> m_unknown_domain = std::make_shared<const std::vector<int>>(1, 0);
+
 	elliptics_stat m_stat;
 
-	elliptics::session m_error_session;
+	std::chrono::milliseconds m_stat_interval = std::chrono::seconds(30);
+	std::chrono::milliseconds m_meta_interval = std::chrono::seconds(30);
+
+	std::mutex m_subscribers_lock;
+	uint64_t m_subscriber_id = 0;
+	std::map<uint64_t, bucket_event_handler> m_subscribers;
+	float m_weight_notify_threshold = 0.05;
+
+	// bucket name -> state sent in the last notification
+	struct notified_state {
+		bucket_meta	meta;
+		bool		valid = false;
+		float		weight = 0;
+	};
+	std::map<std::string, notified_state> m_notified;
+	std::mutex m_notified_lock;
+
+	std::shared_ptr<const processor_state> m_state = std::make_shared<processor_state>();
+
+	// placement trace, empty if tracing is disabled
+	std::shared_ptr<trace_writer> m_trace;
 
 	bool m_need_exit = false;
-	std::condition_variable m_wait;
+	std::condition_variable_any m_wait;
 	std::thread m_buckets_update;
 
 	std::map<std::string, bucket> read_buckets(const std::vector<int> mgroups, const std::vector<std::string> &bnames) {
+		scoped_timer timer(m_meta_reload_hist);
+
 		std::map<std::string, bucket> buckets;
 
+		weight_smoothing ws = weight_smoothing_config();
+		bool quota_stat_usage = quota_stat_usage_config();
 		for (auto it = bnames.begin(), end = bnames.end(); it != end; ++it) {
-			buckets[*it] = make_bucket(m_node, mgroups, *it);
+			buckets[*it] = make_bucket(m_storage, mgroups, *it);
+			buckets[*it]->set_weight_smoothing(ws);
+			buckets[*it]->set_quota_stat_usage(quota_stat_usage);
 		}
 		m_stat.schedule_update_and_wait();
 
-		limits l;
-		elliptics::logger &log = m_node->get_log();
 		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
 			it->second->wait_for_reload();
+		}
 
-			bucket_meta meta = it->second->meta();
-			for (auto g = meta.groups.begin(), gend = meta.groups.end(); g != gend; ++g) {
-				backend_stat bs = m_stat.stat(*g);
-				if (bs.group == *g) {
-					it->second->set_backend_stat(*g, bs);
-				}
+		// freshly created buckets do not have any statistics yet,
+		// fill them group by group using reverse index
+		std::map<int, std::vector<bucket>> group_buckets = index_groups(buckets);
+		for (auto it = group_buckets.begin(), end = group_buckets.end(); it != end; ++it) {
+			backend_stat bs = m_stat.stat(it->first);
+			if (bs.group != it->first)
+				continue;
+
+			for (auto b = it->second.begin(), bend = it->second.end(); b != bend; ++b) {
+				(*b)->set_backend_stat(it->first, bs, m_policy);
 			}
+		}
+
+		elliptics::logger &log = m_storage->log();
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			// metadata unpacking has calculated weight with the default policy,
+			// buckets without statistics have not been updated above
+			it->second->recalculate_weight(m_policy);
 
 			BH_LOG(log, DNET_LOG_INFO, "read_buckets: bucket: %s: reloaded, valid: %d, "
 					"stats: %s, weight: %f",
 					it->first.c_str(), it->second->valid(),
-					it->second->stat_str().c_str(), it->second->weight(1, l));
+					it->second->stat_str().c_str(), it->second->weight(1));
+		}
+
+		// reloaded buckets replace the current ones, weight transitions in progress
+		// and quota accounting are continued
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		std::map<std::string, bucket> current = m_buckets;
+		guard.unlock();
+
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			auto old = current.find(it->first);
+			if (old != current.end()) {
+				it->second->inherit_weight(*old->second, now);
+				it->second->inherit_usage(*old->second);
+			}
 		}
 
 		return buckets;
 	}
 
-	void received_bucket_list(const elliptics::sync_read_result &result, const elliptics::error_info &error) {
-		elliptics::logger &log = m_node->get_log();
-
-		if (error) {
-			BH_LOG(log, DNET_LOG_ERROR, "received_bucket_list: key: %s: could not read bucket list, error: %s [%d]",
-					m_bucket_key.c_str(), error.message().c_str(), error.code());
+	void notify(const std::vector<bucket_event> &events) {
+		if (events.empty())
 			return;
-		}
 
-		const elliptics::data_pointer &file = result[0].file();
-
-		std::vector<std::string> bnames;
+		std::unique_lock<std::mutex> guard(m_subscribers_lock);
+		std::vector<bucket_event_handler> handlers;
+		handlers.reserve(m_subscribers.size());
+		for (auto it = m_subscribers.begin(), end = m_subscribers.end(); it != end; ++it) {
+			handlers.push_back(it->second);
+		}
+		guard.unlock();
 
-		char *start = file.data<char>();
-		for (size_t i = 0; i < file.size(); ++i) {
-			char *n = file.data<char>() + i;
-			if (*n == '\n' || i == file.size() - 1) {
-				if (i == file.size() - 1) {
-					n++;
+		elliptics::logger &log = m_storage->log();
+		for (auto ev = events.begin(), ev_end = events.end(); ev != ev_end; ++ev) {
+			for (auto h = handlers.begin(), h_end = handlers.end(); h != h_end; ++h) {
+				try {
+					(*h)(*ev);
+				} catch (const std::exception &e) {
+					BH_LOG(log, DNET_LOG_ERROR, "notify: bucket: %s, event: %d, handler exception: %s",
+							ev->name.c_str(), ev->type, e.what());
 				}
-
-				std::string bname(start, n - start);
-				bnames.emplace_back(bname);
-
-				start = n + 1;
 			}
 		}
-
-		std::lock_guard<std::mutex> guard(m_lock);
-		m_bnames = bnames;
 	}
 
-	elliptics::error_info request_bucket_list(const std::string &key, bool sync) {
-		elliptics::session s(*m_node);
-		s.set_exceptions_policy(elliptics::session::no_exceptions);
-		s.set_groups(m_meta_groups);
-
-		std::string ns = "bucket";
-		s.set_namespace(ns.c_str(), ns.size());
+	// compares old and new bucket sets and sends added/removed/meta_changed events,
+	// weight changes are checked for every new bucket
+	void notify_changes(const std::map<std::string, bucket> &old_buckets, const std::map<std::string, bucket> &buckets) {
+		std::vector<bucket_event> events;
 
-		auto ret = s.read_data(key, 0, 0);
-		if (!ret.is_valid()) {
-			return elliptics::create_error(-EINVAL, "async read data is not valid");
-		}
-		if (sync) {
-			ret.wait();
-			if (ret.error())
-				return ret.error();
+		std::unique_lock<std::mutex> guard(m_notified_lock);
+		for (auto it = old_buckets.begin(), end = old_buckets.end(); it != end; ++it) {
+			if (buckets.find(it->first) != buckets.end())
+				continue;
 
-			received_bucket_list(ret.get(), ret.error());
-		} else {
-			ret.connect(std::bind(&bucket_processor::received_bucket_list, this,
-					std::placeholders::_1, std::placeholders::_2));
+			bucket_event ev;
+			ev.type = bucket_event::removed;
+			ev.name = it->first;
+			ev.b = it->second;
+			ev.old_weight = m_notified[it->first].weight;
+			events.push_back(ev);
 
+			m_notified.erase(it->first);
 		}
 
-		return elliptics::error_info();
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			bucket_event ev;
+			ev.name = it->first;
+			ev.b = it->second;
+			ev.valid = it->second->valid();
+
+			bucket_meta meta = it->second->meta();
+
+			auto prev = m_notified.find(it->first);
+			if (prev == m_notified.end()) {
+				notified_state &st = m_notified[it->first];
+				st.meta = meta;
+				st.valid = ev.valid;
+				st.weight = it->second->weight(0);
+
+				ev.type = bucket_event::added;
+				ev.new_weight = st.weight;
+				events.push_back(ev);
+				continue;
+			}
+
+			if (prev->second.meta != meta || prev->second.valid != ev.valid) {
+				prev->second.meta = meta;
+				prev->second.valid = ev.valid;
+
+				ev.type = bucket_event::meta_changed;
+				ev.old_weight = ev.new_weight = prev->second.weight;
+				events.push_back(ev);
+			}
+		}
+		guard.unlock();
+
+		notify(events);
+		notify_weights(buckets);
+	}
+
+	void notify_weights(const std::map<std::string, bucket> &buckets) {
+		std::unique_lock<std::mutex> guard(m_subscribers_lock);
+		float threshold = m_weight_notify_threshold;
+		guard.unlock();
+
+		std::vector<bucket_event> events;
+
+		guard = std::unique_lock<std::mutex>(m_notified_lock);
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			auto prev = m_notified.find(it->first);
+			if (prev == m_notified.end())
+				continue;
+
+			float w = it->second->weight(0);
+			float old = prev->second.weight;
+			if (std::fabs(w - old) < threshold && ((w == 0) == (old == 0)))
+				continue;
+
+			prev->second.weight = w;
+
+			bucket_event ev;
+			ev.type = bucket_event::weight_changed;
+			ev.name = it->first;
+			ev.b = it->second;
+			ev.valid = it->second->valid();
+			ev.old_weight = old;
+			ev.new_weight = w;
+			events.push_back(ev);
+		}
+		guard.unlock();
+
+		notify(events);
+	}
+
+	// builds new snapshot out of the current bucket set and publishes it,
+	// @reloaded means bucket metadata has just been reloaded
+	void publish_state(bool reloaded) {
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		std::map<std::string, bucket> buckets = m_buckets;
+		failure_domains fd = m_failure_domains;
+		guard.unlock();
+
+		std::shared_ptr<const processor_state> prev = state();
+
+		std::shared_ptr<processor_state> st = std::make_shared<processor_state>();
+		st->stat_time = m_stat.update_time();
+		st->meta_time = reloaded ? std::chrono::system_clock::now() : prev->meta_time;
+
+		std::shared_ptr<std::vector<bucket_state>> states = std::make_shared<std::vector<bucket_state>>();
+		states->reserve(buckets.size());
+
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			bucket_state bs;
+			bs.name = it->first;
+			bs.valid = it->second->valid();
+			bs.groups = it->second->meta().groups;
+			bs.weight = it->second->weight(0);
+			bs.avail = it->second->avail();
+			bs.used_size = it->second->usage().size();
+			bs.used_keys = it->second->usage().keys();
+			bs.stat = it->second->stat();
+
+			if (fd.enabled)
+				bs.domains = fd.bucket_domains(bs.groups, bs.stat);
+
+			states->emplace_back(std::move(bs));
+		}
+		st->buckets = states;
+
+		std::map<std::string, std::shared_ptr<const std::vector<int>>> bucket_domains;
+		std::map<std::string, int> domains;
+		if (fd.enabled) {
+			for (auto it = states->begin(), end = states->end(); it != end; ++it) {
+				std::shared_ptr<std::vector<int>> idx = std::make_shared<std::vector<int>>();
+				for (auto d = it->domains.begin(), dend = it->domains.end(); d != dend; ++d) {
+					auto ins = domains.insert(std::make_pair(*d, (int)domains.size()));
+					idx->push_back(ins.first->second);
+				}
+
+				bucket_domains[it->name] = idx;
+			}
+		}
+
+		guard.lock();
+		m_bucket_domains.swap(bucket_domains);
+		m_domains_num = domains.size();
+		m_unknown_domain = std::make_shared<const std::vector<int>>(1, m_domains_num);
+		guard.unlock();
+
+		std::atomic_store(&m_state, std::shared_ptr<const processor_state>(st));
+	}
+
+	struct bucket_candidate {
+		bucket		b;
+		float		w = 0;
+		uint64_t	avail = 0;
+
+		// indexes of the failure domains of the bucket, empty if failure domains are disabled
+		std::shared_ptr<const std::vector<int>> domains;
+	};
+
+	// collects valid buckets with non-zero weight sorted from higher to lower weight,
+	// size check is performed in @select() using cached free space
+	elliptics::error_info candidates(std::vector<bucket_candidate> &good_buckets) {
+		std::unique_lock<instrumented_mutex> guard(m_lock);
+		if (m_buckets.size() == 0) {
+			return elliptics::create_error(-ENODEV, "there are no buckets at all");
+		}
+
+		good_buckets.reserve(m_buckets.size());
+
+		// smoothed weights of all buckets are taken at the same time
+		auto now = std::chrono::steady_clock::now();
+
+		for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
+			if (!it->second->valid())
+				continue;
+
+			bucket_candidate c;
+			c.b = it->second;
+			// weight is cached in the bucket and recalculated on statistics update
+			c.w = it->second->weight(0, now);
+			if (c.w == 0)
+				continue;
+
+			// quota usage is checked on every selection, since it changes with every write
+			uint64_t quota_avail;
+			c.w *= it->second->usage().weight(m_quota_limits, quota_avail);
+			if (c.w == 0)
+				continue;
+
+			c.avail = std::min(it->second->avail(), quota_avail);
+
+			if (m_failure_domains.enabled) {
+				auto d = m_bucket_domains.find(it->first);
+				if (d != m_bucket_domains.end() && !d->second->empty()) {
+					c.domains = d->second;
+				} else {
+					c.domains = m_unknown_domain;
+				}
+			}
+
+			good_buckets.push_back(c);
+		}
+
+		guard.unlock();
+
+		if (good_buckets.size() == 0) {
+			return elliptics::create_error(-ENODEV, "there are buckets, but none of them has non-zero weight");
+		}
+
+		std::set<int> route_groups = m_storage->route_groups();
+
+		for (auto it = good_buckets.begin(), end = good_buckets.end(); it != end; ++it) {
+			// check whether all groups from given buckets are present in the current route table
+			bucket_meta bmeta = it->b->meta();
+
+			bool routed = true;
+			for (auto g = bmeta.groups.begin(), gend = bmeta.groups.end(); g != gend; ++g) {
+				if (route_groups.find(*g) == route_groups.end()) {
+					routed = false;
+					break;
+				}
+			}
+
+			it->w = m_policy.select_weight(it->w, routed);
+		}
+
+		good_buckets.erase(std::remove_if(good_buckets.begin(), good_buckets.end(),
+					[] (const bucket_candidate &c) { return c.w <= 0; }),
+				good_buckets.end());
+		if (good_buckets.size() == 0) {
+			return elliptics::create_error(-ENODEV, "there are buckets, but policy has excluded all of them");
+		}
+
+		struct {
+			// reverse sort - from higher to lower weights
+			bool operator()(const bucket_candidate &b1, const bucket_candidate &b2) {
+				return b1.w > b2.w;
+			}
+		} cmp;
+		std::sort(good_buckets.begin(), good_buckets.end(), cmp);
+
+		return elliptics::error_info();
+	}
+
+	// per-domain sum of weights and number of candidates suitable for @size,
+	// bucket is accounted in every domain it is placed in, returns false if failure domains are disabled
+	static bool domain_weights(const std::vector<bucket_candidate> &good_buckets, uint64_t size,
+			std::vector<float> &sums, std::vector<size_t> &counts) {
+		if (good_buckets.empty() || !good_buckets.front().domains)
+			return false;
+
+		for (auto it = good_buckets.begin(), end = good_buckets.end(); it != end; ++it) {
+			if (it->avail < size)
+				continue;
+
+			for (auto d = it->domains->begin(), dend = it->domains->end(); d != dend; ++d) {
+				if ((size_t)*d >= sums.size()) {
+					sums.resize(*d + 1, 0);
+					counts.resize(*d + 1, 0);
+				}
+
+				sums[*d] += it->w;
+				counts[*d]++;
+			}
+		}
+
+		return true;
+	}
+
+	static bool in_domain(const bucket_candidate &c, int domain) {
+		return domain < 0 || std::find(c.domains->begin(), c.domains->end(), domain) != c.domains->end();
+	}
+
+	// selects domain with probability proportional to the mean weight of its suitable candidates,
+	// returns -1 if failure domains are disabled
+	static int select_domain(const std::vector<bucket_candidate> &good_buckets, uint64_t size, std::mt19937 &rng) {
+		std::vector<float> sums;
+		std::vector<size_t> counts;
+		if (!domain_weights(good_buckets, size, sums, counts))
+			return -1;
+
+		float sum = 0;
+		for (size_t d = 0; d < sums.size(); ++d) {
+			if (counts[d])
+				sum += sums[d] / counts[d];
+		}
+
+		std::uniform_real_distribution<float> dist(0, sum);
+		float rnd = dist(rng);
+
+		int last = -1;
+		for (size_t d = 0; d < sums.size(); ++d) {
+			if (!counts[d])
+				continue;
+
+			rnd -= sums[d] / counts[d];
+			if (rnd < 0)
+				return d;
+
+			last = d;
+		}
+
+		// float rounding may leave small positive remainder, use the last domain then
+		return last;
+	}
+
+	// selection probability of every candidate for the given @size, this is what @select() implements
+	static std::vector<double> probabilities(const std::vector<bucket_candidate> &good_buckets, uint64_t size) {
+		std::vector<double> ret(good_buckets.size(), 0);
+
+		std::vector<float> sums;
+		std::vector<size_t> counts;
+		bool domains = domain_weights(good_buckets, size, sums, counts);
+
+		double sum = 0;
+		if (domains) {
+			for (size_t d = 0; d < sums.size(); ++d) {
+				if (counts[d])
+					sum += sums[d] / counts[d];
+			}
+		} else {
+			for (auto it = good_buckets.begin(), end = good_buckets.end(); it != end; ++it) {
+				if (it->avail >= size)
+					sum += it->w;
+			}
+		}
+
+		if (sum <= 0)
+			return ret;
+
+		for (size_t i = 0; i < good_buckets.size(); ++i) {
+			const bucket_candidate &c = good_buckets[i];
+			if (c.avail < size)
+				continue;
+
+			if (!domains) {
+				ret[i] = c.w / sum;
+				continue;
+			}
+
+			// bucket may be selected through every domain it is placed in:
+			// domain probability multiplied by the bucket probability within the domain
+			for (auto d = c.domains->begin(), dend = c.domains->end(); d != dend; ++d) {
+				ret[i] += (sums[*d] / counts[*d]) / sum * c.w / sums[*d];
+			}
+		}
+
+		return ret;
+	}
+
+	// returns empty pointer if there is no candidate with enough space for @size,
+	// if failure domains are enabled, bucket is selected among buckets placed in randomly selected domain
+	bucket select(const std::vector<bucket_candidate> &good_buckets, uint64_t size) {
+		elliptics::logger &log = m_storage->log();
+
+		static thread_local std::mt19937 rng(std::random_device{}());
+		int domain = select_domain(good_buckets, size, rng);
+
+		float sum = 0;
+		size_t suitable = 0;
+		for (auto it = good_buckets.begin(), end = good_buckets.end(); it != end; ++it) {
+			if (it->avail < size || !in_domain(*it, domain))
+				continue;
+
+			sum += it->w;
+			suitable++;
+		}
+
+		if (suitable == 0)
+			return bucket();
+
+		// randomly select value in a range [0, sum)
+		// then iterate over all good buckets starting from the one with the lowest weight
+		//
+		// the higher the weight, the more likely this bucket will be selected,
+		// selection probability is exactly proportional to the weight
+		std::uniform_real_distribution<float> dist(0, sum);
+		float rnd = dist(rng);
+
+		bucket last;
+		for (auto it = good_buckets.rbegin(), end = good_buckets.rend(); it != end; ++it) {
+			if (it->avail < size || !in_domain(*it, domain))
+				continue;
+
+			rnd -= it->w;
+			if (rnd < 0) {
+				EBUCKET_HOT_BH_LOG(log, DNET_LOG_NOTICE,
+						"select: good-buckets: %zd, domain: %d, sum: %f, selected bucket: %s, weight: %f",
+						suitable, domain, sum, it->b->name().c_str(), it->w);
+				return it->b;
+			}
+
+			last = it->b;
+		}
+
+		// float rounding may leave small positive remainder, use the last checked bucket then
+		return last;
+	}
+
+	struct write_state {
+		std::string		key;
+		std::string		data;
+		write_handler		handler;
+
+		std::vector<bucket_candidate>	cands;
+		size_t			attempts = 0;
+
+		std::chrono::steady_clock::time_point	start;
+		write_result		res;
+	};
+
+	// selects next bucket out of remaining candidates and writes object there
+	void write_next(std::shared_ptr<write_state> state) {
+		bucket b = select(state->cands, state->data.size());
+		trace_select(state->data.size(), b);
+
+		if (!b) {
+			m_select_errors.inc();
+
+			// keep error of the last failed write if there was one
+			if (!state->res.error) {
+				state->res.error = elliptics::create_error(-ENODEV,
+						"there are buckets, but they are not suitable for size %zd", state->data.size());
+			}
+
+			write_complete(state);
+			return;
+		}
+
+		state->attempts--;
+
+		b->write(state->key, state->data,
+			[this, state, b] (const std::vector<storage_result> &results, const elliptics::error_info &error) {
+				write_completed(state, b, results, error);
+			});
+	}
+
+	void write_completed(std::shared_ptr<write_state> state, const bucket &b,
+			const std::vector<storage_result> &results, const elliptics::error_info &error) {
+		elliptics::error_info err = error;
+		if (!err) {
+			// object must be written into every group of the bucket, otherwise it has fewer replicas than required
+			auto failed = std::find_if(results.begin(), results.end(),
+					[] (const storage_result &r) { return !!r.error; });
+
+			if (failed != results.end()) {
+				err = failed->error;
+			} else if (results.empty()) {
+				err = elliptics::create_error(-ENXIO, "bucket %s: write has not returned any result",
+						b->name().c_str());
+			}
+		}
+
+		if (!err) {
+			state->res.url.bucket = b->name();
+			state->res.url.key = state->key;
+			state->res.b = b;
+			state->res.results = results;
+			state->res.error = elliptics::error_info();
+			write_complete(state);
+			return;
+		}
+
+		elliptics::logger &log = m_storage->log();
+		BH_LOG(log, DNET_LOG_ERROR, "write: key: %s, bucket: %s: write failed: %s [%d], attempts left: %zd",
+				state->key.c_str(), b->name().c_str(), err.message().c_str(), err.code(), state->attempts);
+
+		state->res.failed.push_back(b->name());
+		state->res.results = results;
+		state->res.error = err;
+
+		state->cands.erase(std::remove_if(state->cands.begin(), state->cands.end(),
+					[&b] (const bucket_candidate &c) { return c.b == b; }),
+				state->cands.end());
+
+		if (state->attempts == 0 || state->cands.empty()) {
+			write_complete(state);
+			return;
+		}
+
+		m_write_failovers.inc();
+		write_next(state);
+	}
+
+	void write_complete(std::shared_ptr<write_state> state) {
+		m_write_hist.record(std::chrono::steady_clock::now() - state->start);
+		if (state->res.error)
+			m_write_errors.inc();
+
+		state->handler(state->res);
+	}
+
+	struct bulk_write_state {
+		bulk_write_handler	handler;
+		std::chrono::steady_clock::time_point	start;
+
+		std::mutex		lock;
+		size_t			pending = 0;
+		bulk_write_result	res;
+	};
+
+	void bulk_write_completed(std::shared_ptr<bulk_write_state> state, const bucket &b,
+			const std::vector<size_t> &idx, const std::vector<std::string> &keys,
+			const std::vector<std::vector<storage_result>> &results, const elliptics::error_info &error) {
+		std::unique_lock<std::mutex> guard(state->lock);
+
+		size_t failed = 0;
+
+		// batch error is not set when only some objects fail, the first object error is logged then
+		elliptics::error_info first_error;
+		for (size_t i = 0; i < idx.size(); ++i) {
+			elliptics::error_info err;
+
+			if (i < results.size() && !results[i].empty()) {
+				// object must be written into every group of the bucket
+				for (auto r = results[i].begin(), rend = results[i].end(); r != rend; ++r) {
+					if (r->error) {
+						err = r->error;
+						break;
+					}
+				}
+			} else if (error) {
+				err = error;
+			} else {
+				err = elliptics::create_error(-ENXIO, "bucket %s: write has not returned any result",
+						b->name().c_str());
+			}
+
+			if (err) {
+				state->res.errors[idx[i]] = err;
+				if (!first_error)
+					first_error = err;
+				failed++;
+				continue;
+			}
+
+			state->res.urls[idx[i]].bucket = b->name();
+			state->res.urls[idx[i]].key = keys[i];
+		}
+
+		bool last = --state->pending == 0;
+		guard.unlock();
+
+		if (failed) {
+			elliptics::logger &log = m_storage->log();
+			BH_LOG(log, DNET_LOG_ERROR, "bulk_write: bucket: %s: failed objects: %zd/%zd, error: %s [%d]",
+					b->name().c_str(), failed, idx.size(),
+					first_error.message().c_str(), first_error.code());
+		}
+
+		if (last)
+			bulk_write_complete(state);
+	}
+
+	void bulk_write_complete(std::shared_ptr<bulk_write_state> state) {
+		bulk_write_result &res = state->res;
+		for (size_t i = 0; i < res.errors.size(); ++i) {
+			if (res.errors[i])
+				res.failed++;
+		}
+
+		m_bulk_write_hist.record(std::chrono::steady_clock::now() - state->start);
+		m_bulk_write_objects.inc(res.errors.size() - res.failed);
+		m_write_errors.inc(res.failed);
+
+		state->handler(res);
+	}
+
+	void trace_select(uint64_t size, const bucket &b) {
+		std::shared_ptr<trace_writer> trace = std::atomic_load(&m_trace);
+		if (trace)
+			trace->select(size, b ? b->name() : std::string());
+	}
+
+	void trace_reload(const std::map<std::string, bucket> &buckets) {
+		std::shared_ptr<trace_writer> trace = std::atomic_load(&m_trace);
+		if (trace)
+			trace_buckets(*trace, buckets);
+	}
+
+	// writes metadata and statistics of all given buckets,
+	// statistics is taken from the buckets, this is exactly what their weights are based on
+	void trace_buckets(trace_writer &trace, const std::map<std::string, bucket> &buckets) {
+		std::set<int> groups;
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			bucket_meta meta = it->second->meta();
+			bucket_stat st = it->second->stat();
+
+			trace.bucket(meta.name, meta.groups);
+
+			for (auto g = meta.groups.begin(), gend = meta.groups.end(); g != gend; ++g) {
+				if (!groups.insert(*g).second)
+					continue;
+
+				auto bs = st.backends.find(*g);
+				if (bs != st.backends.end()) {
+					trace.stat(*g, bs->second);
+				} else {
+					trace.clear_stat(*g);
+				}
+			}
+		}
+	}
+
+	// standard normal distribution quantile, rational approximation
+	// from Abramowitz and Stegun 26.2.23, absolute error is less than 4.5e-4
+	static double normal_quantile(double p) {
+		if (p < 0.5)
+			return -normal_quantile(1 - p);
+
+		double t = std::sqrt(-2 * std::log(1 - p));
+		return t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+			(1 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+	}
+
+	// chi-square distribution quantile for @dof degrees of freedom,
+	// Wilson-Hilferty approximation, it is accurate enough for the goodness-of-fit test
+	static double chi2_critical(size_t dof, double confidence) {
+		double k = dof;
+		double h = 2.0 / (9.0 * k);
+		double c = 1 - h + normal_quantile(confidence) * std::sqrt(h);
+		return k * c * c * c;
+	}
+
+	static std::map<int, std::vector<bucket>> index_groups(const std::map<std::string, bucket> &buckets) {
+		std::map<int, std::vector<bucket>> group_buckets;
+
+		for (auto it = buckets.begin(), end = buckets.end(); it != end; ++it) {
+			bucket_meta meta = it->second->meta();
+			for (auto g = meta.groups.begin(), gend = meta.groups.end(); g != gend; ++g) {
+				group_buckets[*g].push_back(it->second);
+			}
+		}
+
+		return group_buckets;
+	}
+
+	void received_bucket_list(const std::vector<storage_result> &result, const elliptics::error_info &error) {
+		elliptics::logger &log = m_storage->log();
+
+		if (error) {
+			BH_LOG(log, DNET_LOG_ERROR, "received_bucket_list: key: %s: could not read bucket list, error: %s [%d]",
+					m_bucket_key.c_str(), error.message().c_str(), error.code());
+			return;
+		}
+
+		auto ent = std::find_if(result.begin(), result.end(),
+				[] (const storage_result &r) { return !r.error; });
+		if (ent == result.end())
+			return;
+
+		const std::string &file = ent->data;
+
+		std::vector<std::string> bnames;
+
+		const char *start = file.data();
+		for (size_t i = 0; i < file.size(); ++i) {
+			const char *n = file.data() + i;
+			if (*n == '\n' || i == file.size() - 1) {
+				if (i == file.size() - 1) {
+					n++;
+				}
+
+				std::string bname(start, n - start);
+				bnames.emplace_back(bname);
+
+				start = n + 1;
+			}
+		}
+
+		std::lock_guard<instrumented_mutex> guard(m_lock);
+		m_bnames = bnames;
+	}
+
+	elliptics::error_info request_bucket_list(const std::string &key, bool sync) {
+		std::shared_ptr<std::promise<elliptics::error_info>> done =
+			std::make_shared<std::promise<elliptics::error_info>>();
+		std::future<elliptics::error_info> completed = done->get_future();
+
+		m_storage->read("bucket", key, m_meta_groups,
+			[this, done] (const std::vector<storage_result> &result, const elliptics::error_info &error) {
+				received_bucket_list(result, error);
+				done->set_value(error);
+			});
+
+		if (sync)
+			return completed.get();
+
+		return elliptics::error_info();
 	}
 
 	void buckets_update() {
+		auto next_reload = std::chrono::steady_clock::now();
+
 		while (!m_need_exit) {
-			if (!m_bucket_key.empty())
-				request_bucket_list(m_bucket_key, true);
+			std::unique_lock<instrumented_mutex> guard(m_lock);
+			std::chrono::milliseconds interval = m_stat_interval;
+			if (m_wait.wait_for(guard, interval, [&] {return m_need_exit || m_stat_interval != interval;})) {
+				if (m_need_exit)
+					break;
 
-			std::unique_lock<std::mutex> guard(m_lock);
-			if (m_wait.wait_for(guard, std::chrono::seconds(30), [&] {return m_need_exit;}))
-				break;
+				// intervals have been changed, start waiting with the new one
+				continue;
+			}
+
+			bool need_reload = !m_static_buckets && std::chrono::steady_clock::now() >= next_reload;
+			if (need_reload)
+				next_reload = std::chrono::steady_clock::now() + m_meta_interval;
 			guard.unlock();
 
+			// metadata reload rereads statistics for all buckets,
+			// otherwise only groups whose statistics has changed are propagated
+			if (!need_reload) {
+				update_stats();
+				continue;
+			}
+
+			if (!m_bucket_key.empty())
+				request_bucket_list(m_bucket_key, true);
+
 			std::map<std::string, bucket> buckets = read_buckets(m_meta_groups, m_bnames);
+			std::map<int, std::vector<bucket>> group_buckets = index_groups(buckets);
 
 			guard.lock();
+			std::map<std::string, bucket> old_buckets;
+			old_buckets.swap(m_buckets);
+
 			m_buckets = buckets;
+			m_group_buckets.swap(group_buckets);
+			guard.unlock();
+
+			trace_reload(buckets);
+			notify_changes(old_buckets, buckets);
+			publish_state(true);
 		}
 	}
 };
 
+typedef basic_bucket_processor<> bucket_processor;
+
 }} // namespace ioremap::ebucket
 
 #endif // __EBUCKET_BUCKET_PROCESSOR_HPP
@@ -2,9 +2,17 @@
 #define __EBUCKET_STAT_HPP
 
 #include "ebucket/json.hpp"
+#include "ebucket/instrumented_mutex.hpp"
+#include "ebucket/metrics.hpp"
+#include "ebucket/storage.hpp"
 
 #include <elliptics/session.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+
 namespace ioremap { namespace ebucket {
 // weight calculation limits
 //
@@ -17,6 +25,28 @@ struct limits {
 	} size;
 };
 
+// Backend health score parameters, see @elliptics_stat::update_health()
+struct health_config {
+	// ratio of corrupted records which halves backend health
+	float	corrupted_ratio = 0.001;
+
+	// number of new corrupted records per statistics update (smoothed) which halves backend health
+	float	corrupted_growth = 1;
+
+	// smoothing factor of the corrupted records growth, the closer to 1, the faster old growth is forgotten
+	float	smoothing = 0.3;
+
+	// removed space ratio above which backend is considered overdue for defragmentation,
+	// health decreases linearly from 1 at this ratio to @min_removed_health when everything is removed
+	float	removed_ratio = 0.3;
+	float	min_removed_health = 0.1;
+
+	// health multipliers of the backend which is being defragmented and of the backend
+	// which reported an error at its last start
+	float	defrag_penalty = 0.5;
+	float	start_error_penalty = 0.5;
+};
+
 struct backend_stat {
 	backend_stat() {}
 	backend_stat(struct dnet_addr *_addr) : addr(*_addr) {}
@@ -48,24 +78,49 @@ struct backend_stat {
 		uint64_t	corrupted = 0;
 	} records;
 
+	// health score in [0, 1] range calculated from corruption, removed records and error signals
+	// and their trend between statistics updates, it is 1 for healthy backend and 0 for read-only one
+	float		health = 1;
+
+	// smoothed number of new corrupted records per statistics update
+	float		corrupted_growth = 0;
+
 	std::string str() const {
 		char tmp[1024];
 		snprintf(tmp, sizeof(tmp), "addr: %s, backend_id: %d, group: %d, "
 			"state: %d, defrag_state: %d, ro: %d, start_error: %d, "
 			"size: limit: %llu, used: %llu, removed: %llu, "
 			"can_be_written: %llu, can_be_written_plus_removed: %llu, "
-			"records: total: %llu, removed: %llu, corrupted: %llu",
+			"records: total: %llu, removed: %llu, corrupted: %llu, health: %.3f",
 				dnet_addr_string(&addr), backend_id, group,
 				state, defrag_state, ro, start_error,
 				(unsigned long long)size.limit, (unsigned long long)size.used, (unsigned long long)size.removed,
 				(unsigned long long)(size.limit - size.used),
 					(unsigned long long)(size.limit - size.used + size.removed),
 				(unsigned long long)records.total, (unsigned long long)records.removed,
-					(unsigned long long)records.corrupted);
+					(unsigned long long)records.corrupted, health);
 
 		return std::string(tmp);
 	}
 
+	// fields filled from monitor statistics and health derived from them are compared,
+	// this is used to find out which groups have changed since the last update
+	bool operator==(const backend_stat &other) const {
+		return dnet_addr_equal(&addr, &other.addr) &&
+			backend_id == other.backend_id && group == other.group &&
+			state == other.state && ro == other.ro &&
+			start_error == other.start_error && defrag_state == other.defrag_state &&
+			size.limit == other.size.limit && size.used == other.size.used && size.removed == other.size.removed &&
+			vfs.avail == other.vfs.avail && vfs.total == other.vfs.total &&
+			records.total == other.records.total && records.removed == other.records.removed &&
+			records.corrupted == other.records.corrupted &&
+			health == other.health;
+	}
+
+	bool operator!=(const backend_stat &other) const {
+		return !(*this == other);
+	}
+
 	void fill_status(elliptics::logger &log, const rapidjson::Value &status) {
 		state = get_int64(status, "state");
 		ro = get_bool(status, "read_only");
@@ -168,24 +223,50 @@ struct backend_stat {
 
 class elliptics_stat {
 public:
-	elliptics_stat(std::shared_ptr<elliptics::node> &node) : m_node(node) {}
+	elliptics_stat(std::shared_ptr<storage> st) : m_storage(st) {}
+	elliptics_stat(std::shared_ptr<elliptics::node> &node) : m_storage(make_storage(node)) {}
+	elliptics_stat(std::shared_ptr<storage> st, metrics_registry &metrics) :
+	m_storage(st),
+	m_update_hist(&metrics.histogram("ebucket_stat_update_seconds",
+				"Time to request and process backend statistics from all nodes")),
+	m_parse_hist(&metrics.histogram("ebucket_stat_parse_seconds",
+				"Time to parse and process statistics of one node")),
+	m_update_errors(&metrics.counter("ebucket_stat_update_errors_total",
+				"Number of failed statistics requests"))
+	{
+	}
 
-	void schedule_update_and_wait() {
-		elliptics::session s(*m_node);
-		s.set_exceptions_policy(elliptics::session::no_exceptions);
+	// requests fresh statistics from every node and returns groups
+	// whose backend statistics has changed (appeared, disappeared or was modified)
+	// since the previous update
+	std::vector<int> schedule_update_and_wait() {
+		elliptics::logger &log = m_storage->log();
 
-		uint64_t cat = DNET_MONITOR_BACKEND;
+		BH_LOG(log, DNET_LOG_INFO, "stat: schedule_update: going to request global backend statistics");
 
-		elliptics::logger &log = m_node->get_log();
+		auto start = std::chrono::steady_clock::now();
 
-		BH_LOG(log, DNET_LOG_INFO, "stat: schedule_update: going to request global backend statistics");
-		auto st = s.monitor_stat(cat);
-		st.connect(std::bind(&elliptics_stat::update_completion, this, std::placeholders::_1, std::placeholders::_2));
-		st.wait();
+		std::shared_ptr<std::promise<void>> done = std::make_shared<std::promise<void>>();
+		std::future<void> completed = done->get_future();
+
+		m_storage->monitor_stat(
+			[this, done] (const std::vector<storage_node_stat> &result, const elliptics::error_info &error) {
+				update_completion(result, error);
+				done->set_value();
+			});
+		completed.wait();
+
+		if (m_update_hist)
+			m_update_hist->record(std::chrono::steady_clock::now() - start);
+
+		std::lock_guard<instrumented_mutex> guard(m_group_lock);
+		std::vector<int> changed;
+		changed.swap(m_changed_groups);
+		return changed;
 	}
 
 	backend_stat stat(int group) {
-		std::lock_guard<std::mutex> guard(m_group_lock);
+		std::lock_guard<instrumented_mutex> guard(m_group_lock);
 		auto it = m_group_stat.find(group);
 		if (it == m_group_stat.end()) {
 			return backend_stat();
@@ -194,104 +275,221 @@ public:
 		return it->second;
 	}
 
+	void set_health_config(const health_config &cfg) {
+		std::lock_guard<instrumented_mutex> guard(m_group_lock);
+		m_health = cfg;
+	}
+
+	// Health is a product of factors, every factor is in [0, 1] range:
+	//  * read-only backend gets zero health, fresh writes must not be sent there
+	//  * corrupted records ratio: 1 / (1 + ratio / @cfg.corrupted_ratio)
+	//  * corruption trend, smoothed number of new corrupted records per update: 1 / (1 + growth / @cfg.corrupted_growth)
+	//  * removed space ratio above @cfg.removed_ratio, backend is overdue for defragmentation,
+	//	unless defragmentation is running, in which case @cfg.defrag_penalty is applied
+	//  * @cfg.start_error_penalty if backend reported an error at its last start
+	//
+	// @prev is the previous statistics of the same backend or NULL, its smoothed corruption growth is continued
+	static void update_health(backend_stat &bs, const backend_stat *prev, const health_config &cfg) {
+		bs.corrupted_growth = 0;
+		if (prev) {
+			float growth = bs.records.corrupted > prev->records.corrupted ?
+				bs.records.corrupted - prev->records.corrupted : 0;
+			bs.corrupted_growth = cfg.smoothing * growth + (1 - cfg.smoothing) * prev->corrupted_growth;
+
+			// decayed growth would otherwise change health slightly on every update for a long time
+			if (bs.corrupted_growth < 0.01)
+				bs.corrupted_growth = 0;
+		}
+
+		if (bs.ro) {
+			bs.health = 0;
+			return;
+		}
+
+		float health = 1;
+
+		if (bs.records.total && cfg.corrupted_ratio > 0) {
+			float ratio = (float)bs.records.corrupted / (float)bs.records.total;
+			health /= 1 + ratio / cfg.corrupted_ratio;
+		}
+
+		if (cfg.corrupted_growth > 0)
+			health /= 1 + bs.corrupted_growth / cfg.corrupted_growth;
+
+		if (bs.defrag_state != 0) {
+			health *= cfg.defrag_penalty;
+		} else if (bs.size.used && cfg.removed_ratio < 1) {
+			float ratio = (float)bs.size.removed / (float)bs.size.used;
+			if (ratio > cfg.removed_ratio) {
+				float overdue = std::min(1.0f, (ratio - cfg.removed_ratio) / (1 - cfg.removed_ratio));
+				health *= 1 - overdue * (1 - cfg.min_removed_health);
+			}
+		}
+
+		if (bs.start_error != 0)
+			health *= cfg.start_error_penalty;
+
+		// health is compared to find changed groups, it is quantized,
+		// thus insignificant changes do not make every bucket of the group to be updated
+		health = std::round(health * 1000) / 1000;
+		bs.health = std::max(0.0f, std::min(1.0f, health));
+	}
+
+	// time when statistics has been successfully received last time,
+	// it is zero (epoch) if there were no successful updates yet
+	std::chrono::system_clock::time_point update_time() {
+		std::lock_guard<instrumented_mutex> guard(m_group_lock);
+		return m_update_time;
+	}
+
+	// parses monitor statistics of one node and puts enabled backends with valid statistics into @gstat
+	static void parse(elliptics::logger &log, struct dnet_addr *addr, const std::string &statistics,
+			std::map<int, backend_stat> &gstat) {
+		rapidjson::Document doc;
+		doc.Parse<0>(statistics.c_str());
+
+		if (doc.HasParseError()) {
+			BH_LOG(log, DNET_LOG_ERROR, "stat: parse: json parser error: %s, offset: %zd",
+					doc.GetParseError(), doc.GetErrorOffset());
+			return;
+		}
+
+		const rapidjson::Value &backends = get_object(doc, "backends");
+		if (!backends.IsObject()) {
+			BH_LOG(log, DNET_LOG_ERROR,
+				"stat: parse: addr: %s, json logic error: no 'backends' object",
+					dnet_addr_string(addr));
+			return;
+		}
+
+		for (rapidjson::Value::ConstMemberIterator backend_it = backends.MemberBegin(),
+				backend_end = backends.MemberEnd();
+				backend_it != backend_end; ++backend_it) {
+			const rapidjson::Value &backend = backend_it->value;
+			if (!backend.IsObject()) {
+				BH_LOG(log, DNET_LOG_ERROR,
+					"stat: parse: addr: %s, json logic error: "
+					"'backends' map does not contain objects",
+						dnet_addr_string(addr));
+				break;
+			}
+
+			backend_stat b(addr);
+
+			b.backend_id = get_int64(backend, "backend_id");
+			if (b.backend_id < 0) {
+				BH_LOG(log, DNET_LOG_ERROR,
+					"stat: parse: addr: %s, json logic error: "
+					"invalid 'backends/%s/backend_id' object",
+						dnet_addr_string(addr), backend_it->name.GetString());
+				continue;
+			}
+
+			const rapidjson::Value &status = get_object(backend, "status");
+			if (!status.IsObject()) {
+				BH_LOG(log, DNET_LOG_ERROR,
+					"stat: parse: addr: %s, backend_id: %d: json logic error: "
+					"invalid 'status' object",
+						dnet_addr_string(addr), b.backend_id);
+				continue;
+			}
+
+			b.fill_status(log, status);
+
+			if (b.state != DNET_BACKEND_ENABLED)
+				continue;
+
+			const rapidjson::Value &raw_backend = get_object(backend, "backend");
+			if (!raw_backend.IsObject()) {
+				BH_LOG(log, DNET_LOG_ERROR,
+					"stat: parse: addr: %s, backend_id: %d: json logic error: "
+					"invalid 'backend' object",
+						dnet_addr_string(addr), b.backend_id);
+				continue;
+			}
+
+			if (!b.fill_raw_stats(log, raw_backend)) {
+				BH_LOG(log, DNET_LOG_ERROR,
+					"stat: parse: addr: %s, backend_id: %d: invalid statistics",
+						dnet_addr_string(addr), b.backend_id);
+				continue;
+			}
+
+			if (b.group > 0)
+				gstat[b.group] = std::move(b);
+		}
+	}
+
 private:
-	std::shared_ptr<elliptics::node> m_node;
+	std::shared_ptr<storage> m_storage;
 
-	std::mutex m_group_lock;
+	instrumented_mutex m_group_lock{"elliptics_stat"};
 	std::map<int, backend_stat> m_group_stat;
+	std::vector<int> m_changed_groups;
+	std::chrono::system_clock::time_point m_update_time;
+	health_config m_health;
 
-	void update_completion(const elliptics::sync_monitor_stat_result &result, const elliptics::error_info &error) {
-		elliptics::logger &log = m_node->get_log();
+	latency_histogram *m_update_hist = NULL;
+	latency_histogram *m_parse_hist = NULL;
+	metric_counter *m_update_errors = NULL;
+
+	void update_completion(const std::vector<storage_node_stat> &result, const elliptics::error_info &error) {
+		elliptics::logger &log = m_storage->log();
 
 		if (error) {
 			BH_LOG(log, DNET_LOG_ERROR, "stat: update_completion: error: %s [%d]", error.message().c_str(), error.code());
+			if (m_update_errors)
+				m_update_errors->inc();
 			return;
 		}
 
 		std::map<int, backend_stat> gstat;
 
 		for (auto res_it = result.begin(), res_end = result.end(); res_it != res_end; ++res_it) {
-			const elliptics::monitor_stat_result_entry &ent = *res_it;
-			std::string statistics = ent.statistics();
+			struct dnet_addr addr = res_it->addr;
 
-			rapidjson::Document doc;
-			doc.Parse<0>(statistics.c_str());
+			std::unique_ptr<scoped_timer> timer;
+			if (m_parse_hist)
+				timer.reset(new scoped_timer(*m_parse_hist));
 
-			if (doc.HasParseError()) {
-				BH_LOG(log, DNET_LOG_ERROR, "stat: update_completion: json parser error: %s, offset: %zd",
-						doc.GetParseError(), doc.GetErrorOffset());
-				continue;
-			}
+			parse(log, &addr, res_it->statistics, gstat);
+		}
 
-			struct dnet_addr *addr = ent.address();
-			const rapidjson::Value &backends = get_object(doc, "backends");
-			if (!backends.IsObject()) {
-				BH_LOG(log, DNET_LOG_ERROR,
-					"stat: update_completion: addr: %s, json logic error: no 'backends' object",
-						dnet_addr_string(addr));
-				continue;
+		std::vector<int> changed;
+		std::lock_guard<instrumented_mutex> guard(m_group_lock);
+
+		for (auto it = gstat.begin(), end = gstat.end(); it != end; ++it) {
+			auto prev = m_group_stat.find(it->first);
+			update_health(it->second, prev == m_group_stat.end() ? NULL : &prev->second, m_health);
+
+			if (it->second.health < 1) {
+				BH_LOG(log, DNET_LOG_NOTICE, "stat: update_completion: group: %d, health: %f, "
+						"corrupted growth: %f, stat: %s",
+						it->first, it->second.health, it->second.corrupted_growth, it->second.str().c_str());
 			}
+		}
 
-			for (rapidjson::Value::ConstMemberIterator backend_it = backends.MemberBegin(),
-					backend_end = backends.MemberEnd();
-					backend_it != backend_end; ++backend_it) {
-				const rapidjson::Value &backend = backend_it->value;
-				if (!backend.IsObject()) {
-					BH_LOG(log, DNET_LOG_ERROR,
-						"stat: update_completion: addr: %s, json logic error: "
-						"'backends' map does not contain objects",
-							dnet_addr_string(addr));
-					break;
-				}
-
-				backend_stat b(addr);
-
-				b.backend_id = get_int64(backend, "backend_id");
-				if (b.backend_id < 0) {
-					BH_LOG(log, DNET_LOG_ERROR,
-						"stat: update_completion: addr: %s, json logic error: "
-						"invalid 'backends/%s/backend_id' object",
-							dnet_addr_string(addr), backend_it->name.GetString());
-					continue;
-				}
-
-				const rapidjson::Value &status = get_object(backend, "status");
-				if (!status.IsObject()) {
-					BH_LOG(log, DNET_LOG_ERROR,
-						"stat: update_completion: addr: %s, backend_id: %d: json logic error: "
-						"invalid 'status' object",
-							dnet_addr_string(addr), b.backend_id);
-					continue;
-				}
-
-				b.fill_status(log, status);
-
-				if (b.state != DNET_BACKEND_ENABLED)
-					continue;
-
-				const rapidjson::Value &raw_backend = get_object(backend, "backend");
-				if (!raw_backend.IsObject()) {
-					BH_LOG(log, DNET_LOG_ERROR,
-						"stat: update_completion: addr: %s, backend_id: %d: json logic error: "
-						"invalid 'backend' object",
-							dnet_addr_string(addr), b.backend_id);
-					continue;
-				}
-
-				if (!b.fill_raw_stats(log, raw_backend)) {
-					BH_LOG(log, DNET_LOG_ERROR,
-						"stat: update_completion: addr: %s, backend_id: %d: invalid statistics",
-							dnet_addr_string(addr), b.backend_id);
-					continue;
-				}
-
-				if (b.group > 0)
-					gstat[b.group] = std::move(b);
+		// both maps are sorted by group id, walk them in parallel
+		auto old_it = m_group_stat.begin(), old_end = m_group_stat.end();
+		auto new_it = gstat.begin(), new_end = gstat.end();
+		while (old_it != old_end || new_it != new_end) {
+			if (new_it == new_end || (old_it != old_end && old_it->first < new_it->first)) {
+				changed.push_back(old_it->first);
+				++old_it;
+			} else if (old_it == old_end || new_it->first < old_it->first) {
+				changed.push_back(new_it->first);
+				++new_it;
+			} else {
+				if (old_it->second != new_it->second)
+					changed.push_back(new_it->first);
+				++old_it;
+				++new_it;
 			}
 		}
 
-		std::lock_guard<std::mutex> guard(m_group_lock);
 		m_group_stat.swap(gstat);
+		m_changed_groups.swap(changed);
+		m_update_time = std::chrono::system_clock::now();
 	}
 };
 
@@ -0,0 +1,20 @@
+#pragma once
+
+// Log statements on the request path (bucket selection, request handlers) are compiled out
+// if their level is below EBUCKET_HOT_LOG_LEVEL: 0 - debug (default, nothing is compiled out),
+// 1 - notice, 2 - info, 3 - warning, 4 - error.
+//
+// Level check is a constant expression, thus disabled statement together with its arguments
+// is removed by the compiler, but arguments are still type-checked.
+#ifndef EBUCKET_HOT_LOG_LEVEL
+#define EBUCKET_HOT_LOG_LEVEL 0
+#endif
+
+#define EBUCKET_HOT_LOG_ENABLED(level) ((int)(level) >= EBUCKET_HOT_LOG_LEVEL)
+
+// BH_LOG() opens record before evaluating its arguments, it only lacks compile-time threshold
+#define EBUCKET_HOT_BH_LOG(log, level, ...) do { \
+	if (EBUCKET_HOT_LOG_ENABLED(level)) { \
+		BH_LOG(log, level, __VA_ARGS__); \
+	} \
+} while (0)
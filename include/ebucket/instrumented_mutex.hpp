@@ -0,0 +1,133 @@
+#ifndef __EBUCKET_INSTRUMENTED_MUTEX_HPP
+#define __EBUCKET_INSTRUMENTED_MUTEX_HPP
+
+#include "ebucket/metrics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace ioremap { namespace ebucket {
+
+// Lock statistics are process-wide and aggregated per lock site,
+// for example all raw_bucket mutexes share "raw_bucket" site.
+// Functions holding the statics are not static, thus every translation unit shares the same instance.
+inline metrics_registry &lock_metrics() {
+	static metrics_registry metrics;
+	return metrics;
+}
+
+inline std::atomic<bool> &lock_stats_flag() {
+	static std::atomic<bool> enabled(false);
+	return enabled;
+}
+
+// lock statistics are disabled by default, instrumented mutex is a plain mutex plus one relaxed load then
+inline void set_lock_stats(bool enabled) {
+	lock_stats_flag().store(enabled, std::memory_order_relaxed);
+}
+
+inline bool lock_stats_enabled() {
+	return lock_stats_flag().load(std::memory_order_relaxed);
+}
+
+struct lock_site {
+	metric_counter		*acquisitions;
+	metric_counter		*contended;
+	latency_histogram	*wait;
+	latency_histogram	*hold;
+};
+
+inline lock_site *get_lock_site(const std::string &name) {
+	static std::mutex lock;
+	static std::map<std::string, lock_site> sites;
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = sites.find(name);
+	if (it != sites.end())
+		return &it->second;
+
+	metrics_registry &metrics = lock_metrics();
+	std::string labels = "site=\"" + name + "\"";
+
+	lock_site &site = sites[name];
+	site.acquisitions = &metrics.counter("ebucket_lock_acquisitions_total",
+			"Number of lock acquisitions", labels);
+	site.contended = &metrics.counter("ebucket_lock_contended_total",
+			"Number of lock acquisitions which had to wait for another owner", labels);
+	site.wait = &metrics.histogram("ebucket_lock_wait_seconds",
+			"Time spent waiting for the lock", labels);
+	site.hold = &metrics.histogram("ebucket_lock_hold_seconds",
+			"Time the lock was held", labels);
+
+	return &site;
+}
+
+// Mutex which records acquisition count, contention, wait and hold time into its lock site
+// when lock statistics is enabled. Satisfies Lockable requirements, thus it works
+// with std::lock_guard, std::unique_lock and std::condition_variable_any.
+class instrumented_mutex {
+public:
+	explicit instrumented_mutex(const std::string &site) : m_site(get_lock_site(site)) {}
+
+	instrumented_mutex(const instrumented_mutex &) = delete;
+	instrumented_mutex &operator=(const instrumented_mutex &) = delete;
+
+	void lock() {
+		if (!lock_stats_enabled()) {
+			m_mutex.lock();
+			m_timed = false;
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		if (!m_mutex.try_lock()) {
+			m_site->contended->inc();
+			m_mutex.lock();
+		}
+
+		acquired(start);
+	}
+
+	bool try_lock() {
+		if (!m_mutex.try_lock())
+			return false;
+
+		if (lock_stats_enabled()) {
+			acquired(std::chrono::steady_clock::now());
+		} else {
+			m_timed = false;
+		}
+
+		return true;
+	}
+
+	void unlock() {
+		if (m_timed)
+			m_site->hold->record(std::chrono::steady_clock::now() - m_acquired);
+
+		m_mutex.unlock();
+	}
+
+private:
+	std::mutex m_mutex;
+	lock_site *m_site;
+
+	// protected by @m_mutex itself
+	bool m_timed = false;
+	std::chrono::steady_clock::time_point m_acquired;
+
+	void acquired(const std::chrono::steady_clock::time_point &start) {
+		m_acquired = std::chrono::steady_clock::now();
+		m_timed = true;
+
+		m_site->acquisitions->inc();
+		m_site->wait->record(m_acquired - start);
+	}
+};
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_INSTRUMENTED_MUTEX_HPP
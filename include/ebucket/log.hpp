@@ -1,43 +1,91 @@
 #pragma once
 
+#include "ebucket/hot_log.hpp"
+
 #include <swarm/logger.hpp>
 
-namespace ioremap { namespace nulla {
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
 
-static inline void dolog(const swarm::logger &logger, swarm::log_level level, const char *fmt, ...) __attribute__ ((format(printf, 3, 4)));
+namespace ioremap { namespace nulla {
 
-static inline void dolog(const swarm::logger &logger, swarm::log_level level, const char *fmt, ...)
+// formats message into already opened @record and pushes it,
+// works with any blackhole logger, i.e. both swarm and elliptics loggers
+template <typename Logger, typename Record>
+static inline void vdolog(const Logger &logger, Record &record, const char *fmt, va_list args)
 {
-	auto record = logger.open_record(level);
-	if (record) {
-		va_list args;
-		va_start(args, fmt);
+	char buffer[2048];
+	const size_t buffer_size = sizeof(buffer);
+
+	vsnprintf(buffer, buffer_size, fmt, args);
+
+	buffer[buffer_size - 1] = '\0';
 
-		char buffer[2048];
-		const size_t buffer_size = sizeof(buffer);
+	size_t len = strlen(buffer);
+	while (len > 0 && buffer[len - 1] == '\n')
+		buffer[--len] = '\0';
+
+	try {
+		record.attributes.insert(blackhole::keyword::message() = buffer);
+	} catch (...) {
+	}
+	logger.push(std::move(record));
+}
 
-		vsnprintf(buffer, buffer_size, fmt, args);
+template <typename Logger, typename Record>
+static inline void dolog_record(const Logger &logger, Record &record, const char *fmt, ...) __attribute__ ((format(printf, 3, 4)));
 
-		buffer[buffer_size - 1] = '\0';
+template <typename Logger, typename Record>
+static inline void dolog_record(const Logger &logger, Record &record, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vdolog(logger, record, fmt, args);
+	va_end(args);
+}
 
-		size_t len = strlen(buffer);
-		while (len > 0 && buffer[len - 1] == '\n')
-			buffer[--len] = '\0';
+// arguments are evaluated by the caller even if @level is disabled,
+// use EBUCKET_LOG*() macros when arguments have to be formatted
+template <typename Logger, typename Level>
+static inline void dolog(const Logger &logger, Level level, const char *fmt, ...) __attribute__ ((format(printf, 3, 4)));
 
-		try {
-			record.attributes.insert(blackhole::keyword::message() = buffer);
-		} catch (...) {
-		}
-		logger.push(std::move(record));
+template <typename Logger, typename Level>
+static inline void dolog(const Logger &logger, Level level, const char *fmt, ...)
+{
+	auto record = logger.open_record(level);
+	if (record) {
+		va_list args;
+		va_start(args, fmt);
+		vdolog(logger, record, fmt, args);
 		va_end(args);
 	}
 }
 
-#define EBUCKET_LOG(level, fmt, a...) ioremap::nulla::dolog(this->logger(), level, fmt, ##a)
+// Record is opened before arguments are evaluated, thus formatting done in arguments
+// (to_string(), to_human_readable() and so on) costs nothing when @level is disabled at runtime.
+#define EBUCKET_LOG_TO(logger, level, fmt, a...) do { \
+	auto ebucket_log_record = (logger).open_record(level); \
+	if (ebucket_log_record) \
+		ioremap::nulla::dolog_record((logger), ebucket_log_record, fmt, ##a); \
+} while (0)
+
+#define EBUCKET_LOG(level, fmt, a...) EBUCKET_LOG_TO(this->logger(), level, fmt, ##a)
 #define EBUCKET_LOG_ERROR(fmt, a...) EBUCKET_LOG(SWARM_LOG_ERROR, fmt, ##a)
 #define EBUCKET_LOG_WARNING(fmt, a...) EBUCKET_LOG(SWARM_LOG_WARNING, fmt, ##a)
 #define EBUCKET_LOG_INFO(fmt, a...) EBUCKET_LOG(SWARM_LOG_INFO, fmt, ##a)
 #define EBUCKET_LOG_NOTICE(fmt, a...) EBUCKET_LOG(SWARM_LOG_NOTICE, fmt, ##a)
 #define EBUCKET_LOG_DEBUG(fmt, a...) EBUCKET_LOG(SWARM_LOG_DEBUG, fmt, ##a)
 
+// request path logging, compiled out below EBUCKET_HOT_LOG_LEVEL, see hot_log.hpp
+#define EBUCKET_HOT_LOG_TO(logger, level, fmt, a...) do { \
+	if (EBUCKET_HOT_LOG_ENABLED(level)) \
+		EBUCKET_LOG_TO(logger, level, fmt, ##a); \
+} while (0)
+
+#define EBUCKET_HOT_LOG(level, fmt, a...) EBUCKET_HOT_LOG_TO(this->logger(), level, fmt, ##a)
+#define EBUCKET_HOT_LOG_INFO(fmt, a...) EBUCKET_HOT_LOG(SWARM_LOG_INFO, fmt, ##a)
+#define EBUCKET_HOT_LOG_NOTICE(fmt, a...) EBUCKET_HOT_LOG(SWARM_LOG_NOTICE, fmt, ##a)
+#define EBUCKET_HOT_LOG_DEBUG(fmt, a...) EBUCKET_HOT_LOG(SWARM_LOG_DEBUG, fmt, ##a)
+
 }} // namespace ioremap::nulla
@@ -0,0 +1,701 @@
+#ifndef __EBUCKET_MEMORY_STORAGE_HPP
+#define __EBUCKET_MEMORY_STORAGE_HPP
+
+#include "ebucket/bucket.hpp"
+#include "ebucket/storage.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace ioremap { namespace ebucket {
+
+// In-process stand-in for elliptics cluster.
+//
+// Every group is served by exactly one backend, backends with the same host and port
+// belong to the same node and are reported in one monitor statistics reply.
+// Objects are stored in memory, every write increases used size of the backend, thus
+// bucket weights change when data is written, the same way they do in real cluster.
+//
+// Latency and failures are configured per group, replies are delivered from
+// internal IO threads after the configured delay.
+class memory_storage : public storage {
+public:
+	// latency is uniformly distributed in [@latency_min, @latency_max],
+	// every request to this group fails with -EIO with @failure_rate probability,
+	// group without route is not reachable at all and it is not present in monitor statistics
+	struct group_config {
+		std::chrono::microseconds	latency_min = std::chrono::microseconds(0);
+		std::chrono::microseconds	latency_max = std::chrono::microseconds(0);
+		double				failure_rate = 0;
+		bool				routed = true;
+	};
+
+	struct backend_config {
+		std::string	host = "127.0.0.1";
+		int		port = 1025;
+
+		uint64_t	limit = 0;
+		uint64_t	used = 0;
+
+		bool		enabled = true;
+		bool		ro = false;
+		int		defrag_state = 0;
+		uint64_t	records_corrupted = 0;
+	};
+
+	struct counters {
+		uint64_t	reads = 0;
+		uint64_t	writes = 0;
+		uint64_t	read_errors = 0;
+		uint64_t	write_errors = 0;
+		uint64_t	stat_requests = 0;
+	};
+
+	memory_storage(elliptics::logger &&log, int io_threads = 4, uint64_t seed = 0) :
+	m_log(std::move(log)),
+	m_rng(seed)
+	{
+		for (int i = 0; i < io_threads; ++i) {
+			m_threads.emplace_back(std::bind(&memory_storage::io_thread, this));
+		}
+	}
+
+	~memory_storage() {
+		std::unique_lock<std::mutex> guard(m_queue_lock);
+		m_need_exit = true;
+		guard.unlock();
+		m_queue_wait.notify_all();
+
+		for (auto it = m_threads.begin(), end = m_threads.end(); it != end; ++it) {
+			it->join();
+		}
+	}
+
+	void add_backend(int group, const backend_config &cfg) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		backend &b = m_backends[group];
+		b.cfg = cfg;
+		b.id = m_backend_id++;
+		b.addr = make_addr(cfg.host, cfg.port);
+	}
+
+	void add_backend(int group, uint64_t limit, uint64_t used) {
+		backend_config cfg;
+		cfg.limit = limit;
+		cfg.used = used;
+		add_backend(group, cfg);
+	}
+
+	// changes backend state, statistics will be updated at the next monitor request
+	void set_backend(int group, const backend_config &cfg) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto it = m_backends.find(group);
+		if (it != m_backends.end()) {
+			it->second.cfg = cfg;
+			it->second.addr = make_addr(cfg.host, cfg.port);
+		}
+	}
+
+	backend_config get_backend(int group) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto it = m_backends.find(group);
+		if (it == m_backends.end())
+			return backend_config();
+
+		return it->second.cfg;
+	}
+
+	void set_group(int group, const group_config &cfg) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_groups[group] = cfg;
+	}
+
+	// used for groups which do not have their own config
+	void set_default_group(const group_config &cfg) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_default_group = cfg;
+	}
+
+	// monitor statistics request latency and probability of the whole request failure
+	void set_stat(std::chrono::microseconds latency_min, std::chrono::microseconds latency_max, double failure_rate) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stat.latency_min = latency_min;
+		m_stat.latency_max = latency_max;
+		m_stat.failure_rate = failure_rate;
+	}
+
+	// stores object immediately, without latency, failures and size accounting,
+	// this is used to prepare cluster content
+	void put(const std::string &ns, const std::string &key, const std::vector<int> &groups, const std::string &data) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		for (auto g = groups.begin(), gend = groups.end(); g != gend; ++g) {
+			m_backends[*g].objects[ns + "\n" + key] = data;
+		}
+	}
+
+	// stores packed bucket metadata into metadata groups
+	void put_bucket(const std::vector<int> &mgroups, const bucket_meta &meta) {
+		msgpack::sbuffer buffer;
+		msgpack::pack(buffer, meta);
+
+		put("bucket", meta.name, mgroups, std::string(buffer.data(), buffer.size()));
+	}
+
+	// stores bucket list in the same format bucket processor reads it from @bucket_key
+	void put_bucket_list(const std::vector<int> &mgroups, const std::string &bucket_key,
+			const std::vector<std::string> &bnames) {
+		std::ostringstream ss;
+		for (auto it = bnames.begin(), end = bnames.end(); it != end; ++it) {
+			if (it != bnames.begin())
+				ss << "\n";
+			ss << *it;
+		}
+
+		put("bucket", bucket_key, mgroups, ss.str());
+	}
+
+	counters get_counters() const {
+		counters c;
+		c.reads = m_reads.load();
+		c.writes = m_writes.load();
+		c.read_errors = m_read_errors.load();
+		c.write_errors = m_write_errors.load();
+		c.stat_requests = m_stat_requests.load();
+		return c;
+	}
+
+	virtual elliptics::logger &log() {
+		return m_log;
+	}
+
+	// groups are tried one after another like elliptics does,
+	// the reply is delivered after the sum of latencies of all tried groups
+	virtual void read(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const storage_handler &handler) {
+		read_part(ns, key, groups, 0, 0, handler);
+	}
+
+	virtual void read_part(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			uint64_t offset, uint64_t size, const storage_handler &handler) {
+		m_reads++;
+
+		std::vector<storage_result> results;
+		std::chrono::microseconds delay(0);
+		bool found = false;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto g = groups.begin(), gend = groups.end(); g != gend && !found; ++g) {
+			storage_result r;
+			r.group = *g;
+
+			auto b = m_backends.find(*g);
+			const group_config &gc = group(*g);
+			if (b == m_backends.end() || !gc.routed) {
+				r.error = elliptics::create_error(-ENXIO, "group %d: there is no route", *g);
+				results.emplace_back(std::move(r));
+				continue;
+			}
+
+			delay += latency(gc.latency_min, gc.latency_max);
+
+			if (failed(gc.failure_rate)) {
+				r.error = elliptics::create_error(-EIO, "group %d: injected read failure", *g);
+			} else {
+				auto obj = b->second.objects.find(ns + "\n" + key);
+				if (obj == b->second.objects.end()) {
+					r.error = elliptics::create_error(-ENOENT, "group %d: object not found", *g);
+				} else if (offset != 0 && offset >= obj->second.size()) {
+					r.error = elliptics::create_error(-E2BIG, "group %d: offset %llu is beyond the end of %zd bytes object",
+							*g, (unsigned long long)offset, obj->second.size());
+				} else {
+					r.data = obj->second.substr(offset, size ? size : std::string::npos);
+					r.total_size = obj->second.size();
+					found = true;
+				}
+			}
+
+			results.emplace_back(std::move(r));
+		}
+		guard.unlock();
+
+		elliptics::error_info error;
+		if (!found) {
+			m_read_errors++;
+			error = results.empty() ?
+				elliptics::create_error(-ENXIO, "there are no groups to read from") :
+				results.back().error;
+		}
+
+		schedule(delay, [handler, results, error] () {
+			handler(results, error);
+		});
+	}
+
+	// object is written into all groups in parallel, the reply is delivered after the slowest group,
+	// every write appends data to the backend, overwritten object becomes removed space
+	virtual void write(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const std::string &data, const storage_handler &handler) {
+		m_writes++;
+
+		std::vector<storage_result> results;
+		std::chrono::microseconds delay(0);
+		bool written = false;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto g = groups.begin(), gend = groups.end(); g != gend; ++g) {
+			storage_result r;
+			r.group = *g;
+
+			auto b = m_backends.find(*g);
+			const group_config &gc = group(*g);
+			if (b == m_backends.end() || !gc.routed) {
+				r.error = elliptics::create_error(-ENXIO, "group %d: there is no route", *g);
+				results.emplace_back(std::move(r));
+				continue;
+			}
+
+			delay = std::max(delay, latency(gc.latency_min, gc.latency_max));
+
+			if (failed(gc.failure_rate)) {
+				r.error = elliptics::create_error(-EIO, "group %d: injected write failure", *g);
+			} else {
+				store(b->second, *g, ns, key, data, r);
+				if (!r.error)
+					written = true;
+			}
+
+			results.emplace_back(std::move(r));
+		}
+		guard.unlock();
+
+		elliptics::error_info error;
+		if (!written) {
+			m_write_errors++;
+			error = results.empty() ?
+				elliptics::create_error(-ENXIO, "there are no groups to write to") :
+				results.back().error;
+		}
+
+		schedule(delay, [handler, results, error] () {
+			handler(results, error);
+		});
+	}
+
+	// every part is a separate request with its own latency and failure injection,
+	// object is reserved by prepare and becomes visible to readers only after commit
+	virtual void write_part(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const std::string &data, uint64_t offset, uint64_t total_size, write_part_type type,
+			const storage_handler &handler) {
+		m_writes++;
+
+		std::vector<storage_result> results;
+		std::chrono::microseconds delay(0);
+		bool written = false;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto g = groups.begin(), gend = groups.end(); g != gend; ++g) {
+			storage_result r;
+			r.group = *g;
+
+			auto b = m_backends.find(*g);
+			const group_config &gc = group(*g);
+			if (b == m_backends.end() || !gc.routed) {
+				r.error = elliptics::create_error(-ENXIO, "group %d: there is no route", *g);
+				results.emplace_back(std::move(r));
+				continue;
+			}
+
+			delay = std::max(delay, latency(gc.latency_min, gc.latency_max));
+
+			if (failed(gc.failure_rate)) {
+				r.error = elliptics::create_error(-EIO, "group %d: injected write failure", *g);
+			} else {
+				store_part(b->second, *g, ns, key, data, offset, total_size, type, r);
+				if (!r.error)
+					written = true;
+			}
+
+			results.emplace_back(std::move(r));
+		}
+		guard.unlock();
+
+		elliptics::error_info error;
+		if (!written) {
+			m_write_errors++;
+			error = results.empty() ?
+				elliptics::create_error(-ENXIO, "there are no groups to write to") :
+				results.back().error;
+		}
+
+		schedule(delay, [handler, results, error] () {
+			handler(results, error);
+		});
+	}
+
+	// every group gets single request for all objects: one latency sample and one failure injection per group
+	virtual void bulk_write(const std::string &ns, const std::vector<std::string> &keys,
+			const std::vector<std::string> &data, const std::vector<int> &groups,
+			const storage_bulk_handler &handler) {
+		m_writes++;
+
+		std::vector<std::vector<storage_result>> results(keys.size());
+		std::chrono::microseconds delay(0);
+		bool written = false;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (auto g = groups.begin(), gend = groups.end(); g != gend; ++g) {
+			storage_result r;
+			r.group = *g;
+
+			auto b = m_backends.find(*g);
+			const group_config &gc = group(*g);
+			if (b == m_backends.end() || !gc.routed) {
+				r.error = elliptics::create_error(-ENXIO, "group %d: there is no route", *g);
+			} else {
+				delay = std::max(delay, latency(gc.latency_min, gc.latency_max));
+				if (failed(gc.failure_rate))
+					r.error = elliptics::create_error(-EIO, "group %d: injected write failure", *g);
+			}
+
+			for (size_t i = 0; i < keys.size(); ++i) {
+				storage_result obj = r;
+				if (!obj.error) {
+					store(b->second, *g, ns, keys[i], data[i], obj);
+					if (!obj.error)
+						written = true;
+				}
+
+				results[i].emplace_back(std::move(obj));
+			}
+		}
+		guard.unlock();
+
+		elliptics::error_info error;
+		if (!written && !keys.empty()) {
+			m_write_errors++;
+			error = groups.empty() ?
+				elliptics::create_error(-ENXIO, "there are no groups to write to") :
+				results.back().back().error;
+		}
+
+		schedule(delay, [handler, results, error] () {
+			handler(results, error);
+		});
+	}
+
+	virtual void monitor_stat(const storage_stat_handler &handler) {
+		m_stat_requests++;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		std::chrono::microseconds delay = latency(m_stat.latency_min, m_stat.latency_max);
+
+		if (failed(m_stat.failure_rate)) {
+			guard.unlock();
+
+			elliptics::error_info error = elliptics::create_error(-ETIMEDOUT, "injected monitor statistics failure");
+			schedule(delay, [handler, error] () {
+				handler(std::vector<storage_node_stat>(), error);
+			});
+			return;
+		}
+
+		// node address -> json objects of its backends
+		std::map<std::string, std::vector<std::string>> nodes;
+		std::map<std::string, struct dnet_addr> addrs;
+		for (auto it = m_backends.begin(), end = m_backends.end(); it != end; ++it) {
+			if (!group(it->first).routed || it->second.cfg.limit == 0)
+				continue;
+
+			std::ostringstream addr;
+			addr << it->second.cfg.host << ":" << it->second.cfg.port;
+
+			nodes[addr.str()].push_back(backend_json(it->first, it->second));
+			addrs[addr.str()] = it->second.addr;
+		}
+		guard.unlock();
+
+		std::vector<storage_node_stat> stats;
+		for (auto it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+			storage_node_stat st;
+			st.addr = addrs[it->first];
+
+			std::ostringstream ss;
+			ss << "{\"backends\":{";
+			for (auto b = it->second.begin(), bend = it->second.end(); b != bend; ++b) {
+				if (b != it->second.begin())
+					ss << ",";
+				ss << *b;
+			}
+			ss << "}}";
+
+			st.statistics = ss.str();
+			stats.emplace_back(std::move(st));
+		}
+
+		schedule(delay, [handler, stats] () {
+			handler(stats, elliptics::error_info());
+		});
+	}
+
+	virtual std::set<int> route_groups() {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		std::set<int> groups;
+		for (auto it = m_backends.begin(), end = m_backends.end(); it != end; ++it) {
+			if (group(it->first).routed)
+				groups.insert(it->first);
+		}
+
+		return groups;
+	}
+
+private:
+	elliptics::logger m_log;
+
+	struct backend {
+		backend_config	cfg;
+		int		id = 0;
+		struct dnet_addr addr;
+
+		uint64_t	removed_size = 0;
+		uint64_t	records_total = 0;
+		uint64_t	records_removed = 0;
+
+		// namespace + '\n' + key -> data
+		std::map<std::string, std::string> objects;
+
+		// objects which have been prepared, but not yet committed
+		std::map<std::string, std::string> uncommitted;
+	};
+
+	std::mutex m_lock;
+	std::map<int, backend> m_backends;
+	std::map<int, group_config> m_groups;
+	group_config m_default_group;
+	group_config m_stat;
+	int m_backend_id = 0;
+	std::mt19937_64 m_rng;
+
+	std::atomic<uint64_t> m_reads{0};
+	std::atomic<uint64_t> m_writes{0};
+	std::atomic<uint64_t> m_read_errors{0};
+	std::atomic<uint64_t> m_write_errors{0};
+	std::atomic<uint64_t> m_stat_requests{0};
+
+	std::mutex m_queue_lock;
+	std::condition_variable m_queue_wait;
+	std::multimap<std::chrono::steady_clock::time_point, std::function<void ()>> m_queue;
+	bool m_need_exit = false;
+	std::vector<std::thread> m_threads;
+
+	// must be called with @m_lock held
+	const group_config &group(int g) const {
+		auto it = m_groups.find(g);
+		if (it == m_groups.end())
+			return m_default_group;
+
+		return it->second;
+	}
+
+	// must be called with @m_lock held
+	std::chrono::microseconds latency(std::chrono::microseconds min, std::chrono::microseconds max) {
+		if (max <= min)
+			return min;
+
+		std::uniform_int_distribution<int64_t> dist(min.count(), max.count());
+		return std::chrono::microseconds(dist(m_rng));
+	}
+
+	// must be called with @m_lock held
+	bool failed(double rate) {
+		if (rate <= 0)
+			return false;
+
+		std::uniform_real_distribution<double> dist(0, 1);
+		return dist(m_rng) < rate;
+	}
+
+	static struct dnet_addr make_addr(const std::string &host, int port) {
+		struct dnet_addr addr;
+		memset(&addr, 0, sizeof(addr));
+
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		inet_pton(AF_INET, host.c_str(), &sin.sin_addr);
+
+		memcpy(addr.addr, &sin, sizeof(sin));
+		addr.addr_len = sizeof(sin);
+		addr.family = AF_INET;
+
+		return addr;
+	}
+
+	// must be called with @m_lock held
+	static std::string backend_json(int group, const backend &b) {
+		const uint64_t bsize = 4096;
+		uint64_t blocks = b.cfg.limit * 2 / bsize;
+		uint64_t bfree = blocks > b.cfg.used / bsize ? blocks - b.cfg.used / bsize : 0;
+
+		std::ostringstream ss;
+		ss << "\"" << b.id << "\":{" <<
+			"\"backend_id\":" << b.id << "," <<
+			"\"status\":{" <<
+				"\"state\":" << (b.cfg.enabled ? DNET_BACKEND_ENABLED : 0) << "," <<
+				"\"read_only\":" << (b.cfg.ro ? "true" : "false") << "," <<
+				"\"defrag_state\":" << b.cfg.defrag_state << "," <<
+				"\"last_start_err\":0" <<
+			"}," <<
+			"\"backend\":{" <<
+				"\"summary_stats\":{" <<
+					"\"base_size\":" << b.cfg.used << "," <<
+					"\"records_removed_size\":" << b.removed_size << "," <<
+					"\"records_total\":" << b.records_total << "," <<
+					"\"records_removed\":" << b.records_removed << "," <<
+					"\"records_corrupted\":" << b.cfg.records_corrupted <<
+				"}," <<
+				"\"config\":{" <<
+					"\"group\":" << group << "," <<
+					"\"blob_size_limit\":" << b.cfg.limit << "," <<
+					"\"blob_flags\":0" <<
+				"}," <<
+				"\"vfs\":{" <<
+					"\"bsize\":" << bsize << "," <<
+					"\"frsize\":" << bsize << "," <<
+					"\"blocks\":" << blocks << "," <<
+					"\"bfree\":" << bfree << "," <<
+					"\"bavail\":" << bfree <<
+				"}" <<
+			"}" <<
+		"}";
+
+		return ss.str();
+	}
+
+	// must be called with @m_lock held
+	void store(backend &be, int group, const std::string &ns, const std::string &key, const std::string &data,
+			storage_result &r) {
+		if (!be.cfg.enabled || be.cfg.ro) {
+			r.error = elliptics::create_error(-EROFS, "group %d: backend is read-only", group);
+		} else if (be.cfg.used + data.size() > be.cfg.limit) {
+			r.error = elliptics::create_error(-ENOSPC, "group %d: no space left, limit: %llu, used: %llu",
+					group, (unsigned long long)be.cfg.limit, (unsigned long long)be.cfg.used);
+		} else {
+			std::string &obj = be.objects[ns + "\n" + key];
+			if (!obj.empty()) {
+				be.removed_size += obj.size();
+				be.records_removed++;
+			}
+
+			obj = data;
+			be.cfg.used += data.size();
+			be.records_total++;
+		}
+	}
+
+	// must be called with @m_lock held,
+	// space for the whole object is accounted at prepare time, like elliptics does
+	void store_part(backend &be, int group, const std::string &ns, const std::string &key, const std::string &data,
+			uint64_t offset, uint64_t total_size, write_part_type type, storage_result &r) {
+		std::string name = ns + "\n" + key;
+
+		if (!be.cfg.enabled || be.cfg.ro) {
+			r.error = elliptics::create_error(-EROFS, "group %d: backend is read-only", group);
+			return;
+		}
+
+		if (type == write_part_prepare) {
+			if (be.cfg.used + total_size > be.cfg.limit) {
+				r.error = elliptics::create_error(-ENOSPC, "group %d: no space left, limit: %llu, used: %llu",
+						group, (unsigned long long)be.cfg.limit, (unsigned long long)be.cfg.used);
+				return;
+			}
+
+			std::string &obj = be.uncommitted[name];
+			if (!obj.empty())
+				be.removed_size += obj.size();
+
+			obj.assign(total_size, '\0');
+			be.cfg.used += total_size;
+		}
+
+		auto it = be.uncommitted.find(name);
+		if (it == be.uncommitted.end()) {
+			r.error = elliptics::create_error(-ENOENT, "group %d: object has not been prepared", group);
+			return;
+		}
+
+		std::string &obj = it->second;
+		if (offset + data.size() > obj.size()) {
+			r.error = elliptics::create_error(-E2BIG, "group %d: part is out of reserved space: "
+					"offset: %llu, size: %zd, reserved: %zd",
+					group, (unsigned long long)offset, data.size(), obj.size());
+			return;
+		}
+
+		obj.replace(offset, data.size(), data);
+
+		if (type == write_part_commit) {
+			if (total_size < obj.size())
+				obj.resize(total_size);
+
+			std::string &committed = be.objects[name];
+			if (!committed.empty()) {
+				be.removed_size += committed.size();
+				be.records_removed++;
+			}
+
+			committed.swap(obj);
+			be.uncommitted.erase(it);
+			be.records_total++;
+		}
+	}
+
+	void schedule(std::chrono::microseconds delay, const std::function<void ()> &func) {
+		std::unique_lock<std::mutex> guard(m_queue_lock);
+		m_queue.insert(std::make_pair(std::chrono::steady_clock::now() + delay, func));
+		guard.unlock();
+
+		m_queue_wait.notify_one();
+	}
+
+	// pending requests are dropped on exit, storage is only destroyed when
+	// nobody (neither buckets nor processor) uses it anymore
+	void io_thread() {
+		std::unique_lock<std::mutex> guard(m_queue_lock);
+		while (!m_need_exit) {
+			if (m_queue.empty()) {
+				m_queue_wait.wait(guard);
+				continue;
+			}
+
+			auto first = m_queue.begin();
+			if (first->first > std::chrono::steady_clock::now()) {
+				m_queue_wait.wait_until(guard, first->first);
+				continue;
+			}
+
+			std::function<void ()> func = std::move(first->second);
+			m_queue.erase(first);
+			guard.unlock();
+
+			func();
+
+			guard.lock();
+		}
+	}
+};
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_MEMORY_STORAGE_HPP
@@ -0,0 +1,354 @@
+#ifndef __EBUCKET_METRICS_HPP
+#define __EBUCKET_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace ebucket {
+
+// Metrics are updated on the hot path without locks: every metric is split into
+// several cache-line aligned shards, each thread always updates the same shard
+// using relaxed atomic operations. Shards are summed only when metrics are exported.
+// @metrics_shard() has external linkage, thus thread keeps its shard in every translation unit.
+enum {
+	metrics_shards = 16,
+};
+
+inline size_t metrics_shard() {
+	static std::atomic<size_t> next(0);
+	static thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % metrics_shards;
+	return shard;
+}
+
+class metric_counter {
+public:
+	metric_counter() {
+		for (int i = 0; i < metrics_shards; ++i) {
+			m_shards[i].value.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void inc(uint64_t value = 1) {
+		m_shards[metrics_shard()].value.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	uint64_t value() const {
+		uint64_t ret = 0;
+		for (int i = 0; i < metrics_shards; ++i) {
+			ret += m_shards[i].value.load(std::memory_order_relaxed);
+		}
+
+		return ret;
+	}
+
+private:
+	struct alignas(64) shard {
+		std::atomic<uint64_t> value;
+	};
+
+	shard m_shards[metrics_shards];
+};
+
+// HDR-style log-linear histogram of nanosecond values.
+// Values below 8 have their own buckets, every power of two above that
+// is split into 8 linear sub-buckets, thus relative error is below 12.5%.
+class latency_histogram {
+public:
+	enum {
+		sub_buckets = 8,
+		sub_bits = 3,
+		num_buckets = (64 - sub_bits + 1) * sub_buckets,
+	};
+
+	// aggregated copy of all shards
+	struct snapshot {
+		std::vector<uint64_t> buckets;
+		uint64_t count = 0;
+		uint64_t sum = 0;
+
+		// returns upper bound of the bucket which contains given percentile (0, 100]
+		uint64_t percentile(double p) const {
+			if (count == 0)
+				return 0;
+
+			uint64_t need = (uint64_t)(count * p / 100.0);
+			if (need == 0)
+				need = 1;
+
+			uint64_t seen = 0;
+			for (size_t i = 0; i < buckets.size(); ++i) {
+				seen += buckets[i];
+				if (seen >= need)
+					return upper_bound(i);
+			}
+
+			return upper_bound(buckets.size() - 1);
+		}
+	};
+
+	latency_histogram() {
+		for (int i = 0; i < metrics_shards; ++i) {
+			shard &sh = m_shards[i];
+			for (int j = 0; j < num_buckets; ++j) {
+				sh.buckets[j].store(0, std::memory_order_relaxed);
+			}
+			sh.sum.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void record(uint64_t value) {
+		shard &sh = m_shards[metrics_shard()];
+		sh.buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+		sh.sum.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	template <typename Duration>
+	void record(const Duration &d) {
+		record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+	}
+
+	snapshot get() const {
+		snapshot ret;
+		ret.buckets.assign(num_buckets, 0);
+
+		for (int i = 0; i < metrics_shards; ++i) {
+			const shard &sh = m_shards[i];
+			for (int j = 0; j < num_buckets; ++j) {
+				uint64_t v = sh.buckets[j].load(std::memory_order_relaxed);
+				ret.buckets[j] += v;
+				ret.count += v;
+			}
+			ret.sum += sh.sum.load(std::memory_order_relaxed);
+		}
+
+		return ret;
+	}
+
+	static size_t index(uint64_t value) {
+		if (value < sub_buckets)
+			return value;
+
+		int msb = 63 - __builtin_clzll(value);
+		int shift = msb - sub_bits;
+		return (msb - sub_bits + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+	}
+
+	// the smallest value which does not fit into given bucket
+	static uint64_t upper_bound(size_t idx) {
+		if (idx < sub_buckets)
+			return idx + 1;
+
+		int msb = idx / sub_buckets + sub_bits - 1;
+		int shift = msb - sub_bits;
+		uint64_t lower = (uint64_t)(sub_buckets + idx % sub_buckets) << shift;
+		return lower + (1ULL << shift);
+	}
+
+private:
+	struct alignas(64) shard {
+		std::atomic<uint64_t> buckets[num_buckets];
+		std::atomic<uint64_t> sum;
+	};
+
+	shard m_shards[metrics_shards];
+};
+
+// Recent latency distribution of a single destination (for example, a group), it is used
+// to order and hedge requests. Buckets are the same as in @latency_histogram, but limited to ~137 seconds,
+// all counters are halved every @decay_samples records, thus percentiles follow latency changes.
+class latency_tracker {
+public:
+	enum {
+		decay_samples = 1024,
+		num_buckets = (37 - latency_histogram::sub_bits + 1) * latency_histogram::sub_buckets,
+	};
+
+	latency_tracker() {
+		for (int i = 0; i < num_buckets; ++i) {
+			m_buckets[i] = 0;
+		}
+	}
+
+	void record(uint64_t value) {
+		size_t idx = latency_histogram::index(value);
+		if (idx >= num_buckets)
+			idx = num_buckets - 1;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_buckets[idx]++;
+		m_count++;
+
+		if (++m_samples >= decay_samples) {
+			m_count = 0;
+			for (int i = 0; i < num_buckets; ++i) {
+				m_buckets[i] /= 2;
+				m_count += m_buckets[i];
+			}
+			m_samples = 0;
+		}
+	}
+
+	template <typename Duration>
+	void record(const Duration &d) {
+		record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+	}
+
+	// number of samples with decay applied, it is zero if nothing has been recorded yet
+	uint64_t count() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_count;
+	}
+
+	// returns upper bound of the bucket which contains given percentile (0, 100] in nanoseconds,
+	// or zero if there are no samples
+	uint64_t percentile(double p) const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_count == 0)
+			return 0;
+
+		uint64_t need = (uint64_t)(m_count * p / 100.0);
+		if (need == 0)
+			need = 1;
+
+		uint64_t seen = 0;
+		for (int i = 0; i < num_buckets; ++i) {
+			seen += m_buckets[i];
+			if (seen >= need)
+				return latency_histogram::upper_bound(i);
+		}
+
+		return latency_histogram::upper_bound(num_buckets - 1);
+	}
+
+private:
+	mutable std::mutex m_lock;
+	uint32_t m_buckets[num_buckets];
+	uint64_t m_count = 0;
+	uint32_t m_samples = 0;
+};
+
+// records time elapsed since construction into given histogram
+class scoped_timer {
+public:
+	scoped_timer(latency_histogram &h) : m_hist(h), m_start(std::chrono::steady_clock::now()) {}
+	~scoped_timer() {
+		m_hist.record(std::chrono::steady_clock::now() - m_start);
+	}
+
+private:
+	latency_histogram &m_hist;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// Named metrics storage. Metrics are created once (usually at initialization time),
+// returned references stay valid for the registry lifetime and are used on the hot path directly.
+//
+// @labels is a Prometheus label set without braces, for example: handler="bucket"
+class metrics_registry {
+public:
+	metric_counter &counter(const std::string &name, const std::string &help, const std::string &labels = "") {
+		std::lock_guard<std::mutex> guard(m_lock);
+		family &f = get_family(name, help, "counter");
+
+		std::shared_ptr<metric_counter> &c = f.counters[labels];
+		if (!c)
+			c = std::make_shared<metric_counter>();
+		return *c;
+	}
+
+	latency_histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = "") {
+		std::lock_guard<std::mutex> guard(m_lock);
+		family &f = get_family(name, help, "histogram");
+
+		std::shared_ptr<latency_histogram> &h = f.histograms[labels];
+		if (!h)
+			h = std::make_shared<latency_histogram>();
+		return *h;
+	}
+
+	// Prometheus text exposition format, version 0.0.4
+	// histograms are exported in seconds with power-of-two bucket boundaries
+	std::string prometheus() {
+		std::ostringstream ss;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		for (auto it = m_families.begin(), end = m_families.end(); it != end; ++it) {
+			const family &f = it->second;
+
+			ss << "# HELP " << it->first << " " << f.help << "\n";
+			ss << "# TYPE " << it->first << " " << f.type << "\n";
+
+			for (auto c = f.counters.begin(), cend = f.counters.end(); c != cend; ++c) {
+				ss << it->first << braces(c->first) << " " << c->second->value() << "\n";
+			}
+
+			for (auto h = f.histograms.begin(), hend = f.histograms.end(); h != hend; ++h) {
+				export_histogram(ss, it->first, h->first, h->second->get());
+			}
+		}
+
+		return ss.str();
+	}
+
+private:
+	struct family {
+		std::string help;
+		std::string type;
+		std::map<std::string, std::shared_ptr<metric_counter>> counters;
+		std::map<std::string, std::shared_ptr<latency_histogram>> histograms;
+	};
+
+	std::mutex m_lock;
+	std::map<std::string, family> m_families;
+
+	family &get_family(const std::string &name, const std::string &help, const char *type) {
+		family &f = m_families[name];
+		if (f.type.empty()) {
+			f.help = help;
+			f.type = type;
+		}
+
+		return f;
+	}
+
+	static std::string braces(const std::string &labels) {
+		if (labels.empty())
+			return "";
+		return "{" + labels + "}";
+	}
+
+	static void export_histogram(std::ostringstream &ss, const std::string &name, const std::string &labels,
+			const latency_histogram::snapshot &snap) {
+		std::string prefix = labels.empty() ? "" : labels + ",";
+
+		// bucket boundaries from 1us (2^10 ns) up to ~68s (2^36 ns)
+		size_t idx = 0;
+		uint64_t cumulative = 0;
+		for (int power = 10; power <= 36; ++power) {
+			uint64_t bound = 1ULL << power;
+
+			while (idx < snap.buckets.size() && latency_histogram::upper_bound(idx) <= bound) {
+				cumulative += snap.buckets[idx];
+				idx++;
+			}
+
+			ss << name << "_bucket{" << prefix << "le=\"" << (double)bound / 1e9 << "\"} " << cumulative << "\n";
+		}
+
+		ss << name << "_bucket{" << prefix << "le=\"+Inf\"} " << snap.count << "\n";
+		ss << name << "_sum" << braces(labels) << " " << (double)snap.sum / 1e9 << "\n";
+		ss << name << "_count" << braces(labels) << " " << snap.count << "\n";
+	}
+};
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_METRICS_HPP
@@ -0,0 +1,353 @@
+#ifndef __EBUCKET_STORAGE_HPP
+#define __EBUCKET_STORAGE_HPP
+
+#include <elliptics/session.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace ebucket {
+
+// result of the storage operation in one group
+struct storage_result {
+	int			group = 0;
+	elliptics::error_info	error;
+
+	// object data, only set for successful read
+	std::string		data;
+
+	// size of the whole object, only set for successful read, it differs from data size for partial reads
+	uint64_t		total_size = 0;
+};
+
+// monitor statistics of one storage node, the same json elliptics returns for DNET_MONITOR_BACKEND category
+struct storage_node_stat {
+	struct dnet_addr	addr;
+	std::string		statistics;
+};
+
+// Handlers are called exactly once, either from the calling thread or from storage IO thread.
+// Final @error is set when operation has failed as a whole, per-group results contain their own errors.
+typedef std::function<void (const std::vector<storage_result> &, const elliptics::error_info &)> storage_handler;
+typedef std::function<void (const std::vector<storage_node_stat> &, const elliptics::error_info &)> storage_stat_handler;
+
+// bulk write results, @results[i] contains per-group results of the i-th object
+typedef std::function<void (const std::vector<std::vector<storage_result>> &, const elliptics::error_info &)> storage_bulk_handler;
+
+// parts of the streaming write, see @storage::write_part()
+enum write_part_type {
+	write_part_prepare = 0,
+	write_part_plain,
+	write_part_commit,
+};
+
+// Everything buckets, statistics and bucket processor need from the storage.
+// Default implementation is elliptics cluster, @memory_storage is an in-process stand-in
+// which is used for tests, benchmarks and load simulations.
+class storage {
+public:
+	virtual ~storage() {}
+
+	virtual elliptics::logger &log() = 0;
+
+	// reads the whole object @key in namespace @ns, groups are tried in given order,
+	// read succeeds if object has been read from at least one group
+	virtual void read(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const storage_handler &handler) = 0;
+
+	// reads @size bytes at @offset of the object, zero @size reads until the end of the object,
+	// read fails with -E2BIG if @offset is beyond the end of the object, otherwise it is the same as @read()
+	virtual void read_part(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			uint64_t offset, uint64_t size, const storage_handler &handler) = 0;
+
+	// writes object into every group, write succeeds if object has been written into at least one group
+	virtual void write(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const std::string &data, const storage_handler &handler) = 0;
+
+	// writes part of the object which is too large to be sent in a single request:
+	// @write_part_prepare reserves @total_size bytes for the object and writes the first part at @offset,
+	// @write_part_plain writes the next part, @write_part_commit writes the last part and makes
+	// the object of @total_size bytes visible to readers, @total_size is ignored for plain parts.
+	// Result semantics are the same as for @write()
+	virtual void write_part(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const std::string &data, uint64_t offset, uint64_t total_size, write_part_type type,
+			const storage_handler &handler) = 0;
+
+	// writes every object @keys[i] with @data[i] into every group using as few requests as storage allows,
+	// default implementation sends separate write for every object
+	virtual void bulk_write(const std::string &ns, const std::vector<std::string> &keys,
+			const std::vector<std::string> &data, const std::vector<int> &groups,
+			const storage_bulk_handler &handler) {
+		struct bulk_state {
+			std::mutex				lock;
+			size_t					pending = 0;
+			std::vector<std::vector<storage_result>> results;
+			elliptics::error_info			error;
+		};
+
+		if (keys.empty()) {
+			handler(std::vector<std::vector<storage_result>>(), elliptics::error_info());
+			return;
+		}
+
+		std::shared_ptr<bulk_state> state = std::make_shared<bulk_state>();
+		state->pending = keys.size();
+		state->results.resize(keys.size());
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			write(ns, keys[i], groups, data[i],
+				[state, handler, i] (const std::vector<storage_result> &result, const elliptics::error_info &error) {
+					std::unique_lock<std::mutex> guard(state->lock);
+					state->results[i] = result;
+					if (error)
+						state->error = error;
+
+					if (--state->pending != 0)
+						return;
+					guard.unlock();
+
+					// bulk write has failed as a whole only if every object has failed
+					bool failed = std::all_of(state->results.begin(), state->results.end(),
+						[] (const std::vector<storage_result> &res) {
+							return std::all_of(res.begin(), res.end(),
+								[] (const storage_result &r) { return !!r.error; });
+						});
+
+					handler(state->results, failed ? state->error : elliptics::error_info());
+				});
+		}
+	}
+
+	// requests backend statistics from every storage node
+	virtual void monitor_stat(const storage_stat_handler &handler) = 0;
+
+	// groups which have at least one route in the route table
+	virtual std::set<int> route_groups() = 0;
+
+	// elliptics node this storage works with, empty pointer if storage is not elliptics
+	virtual std::shared_ptr<elliptics::node> node() {
+		return std::shared_ptr<elliptics::node>();
+	}
+};
+
+class elliptics_storage : public storage {
+public:
+	elliptics_storage(std::shared_ptr<elliptics::node> node) : m_node(node) {}
+
+	// request timeouts in seconds, large chunks of the streaming upload and read need long timeouts,
+	// they are used by requests started after the call
+	void set_timeouts(long read_timeout, long write_timeout) {
+		m_read_timeout = read_timeout;
+		m_write_timeout = write_timeout;
+	}
+
+	virtual elliptics::logger &log() {
+		return m_node->get_log();
+	}
+
+	virtual void read(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const storage_handler &handler) {
+		read_part(ns, key, groups, 0, 0, handler);
+	}
+
+	virtual void read_part(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			uint64_t offset, uint64_t size, const storage_handler &handler) {
+		elliptics::session s = session(ns, groups, m_read_timeout);
+
+		s.read_data(key, offset, size).connect(
+			[handler] (const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+				std::vector<storage_result> ret;
+				ret.reserve(result.size());
+
+				for (auto ent = result.begin(), end = result.end(); ent != end; ++ent) {
+					storage_result r;
+					r.group = ent->command()->id.group_id;
+					r.error = ent->error();
+					if (!r.error) {
+						r.data = ent->file().to_string();
+						r.total_size = ent->io_attribute()->total_size;
+					}
+
+					ret.emplace_back(std::move(r));
+				}
+
+				handler(ret, error);
+			});
+	}
+
+	virtual void write(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const std::string &data, const storage_handler &handler) {
+		elliptics::session s = session(ns, groups, m_write_timeout);
+		s.set_filter(elliptics::filters::all_with_ack);
+
+		s.write_data(key, elliptics::data_pointer::copy(data), 0).connect(write_completion(handler));
+	}
+
+	virtual void write_part(const std::string &ns, const std::string &key, const std::vector<int> &groups,
+			const std::string &data, uint64_t offset, uint64_t total_size, write_part_type type,
+			const storage_handler &handler) {
+		elliptics::session s = session(ns, groups, m_write_timeout);
+		s.set_filter(elliptics::filters::all_with_ack);
+
+		elliptics::data_pointer dp = elliptics::data_pointer::copy(data);
+
+		switch (type) {
+		case write_part_prepare:
+			s.write_prepare(key, dp, offset, total_size).connect(write_completion(handler));
+			break;
+		case write_part_plain:
+			s.write_plain(key, dp, offset).connect(write_completion(handler));
+			break;
+		case write_part_commit:
+			s.write_commit(key, dp, offset, total_size).connect(write_completion(handler));
+			break;
+		}
+	}
+
+	// all objects are sent in a single elliptics bulk write, results are matched back to objects by their ids
+	virtual void bulk_write(const std::string &ns, const std::vector<std::string> &keys,
+			const std::vector<std::string> &data, const std::vector<int> &groups,
+			const storage_bulk_handler &handler) {
+		if (keys.empty()) {
+			handler(std::vector<std::vector<storage_result>>(), elliptics::error_info());
+			return;
+		}
+
+		elliptics::session s = session(ns, groups, m_write_timeout);
+		s.set_filter(elliptics::filters::all_with_ack);
+
+		std::vector<dnet_io_attr> ios;
+		ios.reserve(keys.size());
+
+		// object id -> indexes of objects with this id, the same key may be written several times
+		std::shared_ptr<std::map<std::string, std::vector<size_t>>> index =
+			std::make_shared<std::map<std::string, std::vector<size_t>>>();
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			elliptics::key k(keys[i]);
+			s.transform(k);
+
+			dnet_io_attr io;
+			memset(&io, 0, sizeof(dnet_io_attr));
+			memcpy(io.id, k.id().id, DNET_ID_SIZE);
+			memcpy(io.parent, k.id().id, DNET_ID_SIZE);
+			io.size = data[i].size();
+
+			ios.push_back(io);
+			(*index)[std::string((const char *)io.id, DNET_ID_SIZE)].push_back(i);
+		}
+
+		size_t num = keys.size();
+		s.bulk_write(ios, data).connect(
+			[handler, index, num] (const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+				std::vector<std::vector<storage_result>> ret(num);
+
+				for (auto ent = result.begin(), end = result.end(); ent != end; ++ent) {
+					const dnet_cmd *cmd = ent->command();
+
+					auto it = index->find(std::string((const char *)cmd->id.id, DNET_ID_SIZE));
+					if (it == index->end())
+						continue;
+
+					storage_result r;
+					r.group = cmd->id.group_id;
+					r.error = ent->error();
+
+					for (auto i = it->second.begin(), iend = it->second.end(); i != iend; ++i) {
+						ret[*i].push_back(r);
+					}
+				}
+
+				handler(ret, error);
+			});
+	}
+
+	virtual void monitor_stat(const storage_stat_handler &handler) {
+		elliptics::session s(*m_node);
+		s.set_exceptions_policy(elliptics::session::no_exceptions);
+
+		s.monitor_stat(DNET_MONITOR_BACKEND).connect(
+			[handler] (const elliptics::sync_monitor_stat_result &result, const elliptics::error_info &error) {
+				std::vector<storage_node_stat> ret;
+				ret.reserve(result.size());
+
+				for (auto ent = result.begin(), end = result.end(); ent != end; ++ent) {
+					storage_node_stat st;
+					st.addr = *ent->address();
+					st.statistics = ent->statistics();
+
+					ret.emplace_back(std::move(st));
+				}
+
+				handler(ret, error);
+			});
+	}
+
+	virtual std::set<int> route_groups() {
+		elliptics::session s(*m_node);
+		s.set_exceptions_policy(elliptics::session::no_exceptions);
+
+		std::set<int> groups;
+		auto routes = s.get_routes();
+		for (auto it = routes.begin(), end = routes.end(); it != end; ++it) {
+			groups.insert(it->group_id);
+		}
+
+		return groups;
+	}
+
+	virtual std::shared_ptr<elliptics::node> node() {
+		return m_node;
+	}
+
+private:
+	std::shared_ptr<elliptics::node> m_node;
+
+	// the same default as the one of @raw_bucket::session()
+	std::atomic<long> m_read_timeout{60};
+	std::atomic<long> m_write_timeout{60};
+
+	static std::function<void (const elliptics::sync_write_result &, const elliptics::error_info &)>
+	write_completion(const storage_handler &handler) {
+		return [handler] (const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+			std::vector<storage_result> ret;
+			ret.reserve(result.size());
+
+			for (auto ent = result.begin(), end = result.end(); ent != end; ++ent) {
+				storage_result r;
+				r.group = ent->command()->id.group_id;
+				r.error = ent->error();
+
+				ret.emplace_back(std::move(r));
+			}
+
+			handler(ret, error);
+		};
+	}
+
+	elliptics::session session(const std::string &ns, const std::vector<int> &groups, long timeout) {
+		elliptics::session s(*m_node);
+		s.set_exceptions_policy(elliptics::session::no_exceptions);
+		s.set_groups(groups);
+		s.set_namespace(ns.c_str(), ns.size());
+		s.set_timeout(timeout);
+
+		return s;
+	}
+};
+
+static inline std::shared_ptr<storage> make_storage(std::shared_ptr<elliptics::node> node) {
+	return std::make_shared<elliptics_storage>(node);
+}
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_STORAGE_HPP
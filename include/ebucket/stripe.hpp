@@ -0,0 +1,353 @@
+#ifndef __EBUCKET_STRIPE_HPP
+#define __EBUCKET_STRIPE_HPP
+
+#include "ebucket/bucket_processor.hpp"
+#include "ebucket/core.hpp"
+
+#include <msgpack.hpp>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+namespace ioremap { namespace ebucket {
+
+// Large object is split into chunks of @chunk_size bytes (the last one may be shorter),
+// every chunk is written as separate object into the bucket selected by weight, thus chunks
+// of one object are spread over many buckets and written in parallel.
+//
+// Manifest is written under the object key, chunk @i is written under "<key>.stripe.<i>".
+// Manifest is msgpack array: [version, size, chunk_size, [[bucket, key, size], ...]]
+struct stripe_chunk {
+	std::string	bucket;
+	std::string	key;
+	uint64_t	size = 0;
+
+	MSGPACK_DEFINE(bucket, key, size);
+};
+
+struct stripe_manifest {
+	enum {
+		current_version = 1,
+	};
+
+	int				version = current_version;
+	uint64_t			size = 0;
+	uint64_t			chunk_size = 0;
+	std::vector<stripe_chunk>	chunks;
+
+	MSGPACK_DEFINE(version, size, chunk_size, chunks);
+
+	std::string pack() const {
+		msgpack::sbuffer buffer;
+		msgpack::pack(buffer, *this);
+		return std::string(buffer.data(), buffer.size());
+	}
+
+	// throws on malformed or unsupported manifest
+	static stripe_manifest unpack(const std::string &data) {
+		msgpack::unpacked msg;
+		msgpack::unpack(&msg, data.data(), data.size());
+
+		stripe_manifest ret;
+		msg.get().convert(&ret);
+
+		if (ret.version != current_version) {
+			throw std::runtime_error("unsupported stripe manifest version " + std::to_string(ret.version));
+		}
+
+		return ret;
+	}
+};
+
+struct stripe_config {
+	uint64_t	chunk_size = 64 * 1024 * 1024;
+
+	// number of chunks written or prefetched in parallel, it also bounds memory usage
+	size_t		max_inflight = 4;
+};
+
+// Streaming striped upload. Data is appended by @write(), every full chunk is written
+// asynchronously using @bucket_processor::write() (with its failover), @write() blocks while
+// @max_inflight chunks are in flight. @finish() writes the last chunk, waits for all chunks and writes manifest.
+//
+// Chunks which have been written before failure are not removed.
+template <typename Processor>
+class basic_stripe_writer {
+public:
+	basic_stripe_writer(Processor &bp, const std::string &key, const stripe_config &cfg = stripe_config()) :
+	m_bp(bp),
+	m_key(key),
+	m_cfg(cfg),
+	m_state(std::make_shared<state>())
+	{
+		if (m_cfg.chunk_size == 0)
+			m_cfg.chunk_size = stripe_config().chunk_size;
+		if (m_cfg.max_inflight == 0)
+			m_cfg.max_inflight = 1;
+
+		m_state->manifest.chunk_size = m_cfg.chunk_size;
+	}
+
+	// chunk completions do not reference the writer, but processor has to outlive them
+	~basic_stripe_writer() {
+		wait(0);
+	}
+
+	// returns the first chunk write error, appended data is dropped after that
+	elliptics::error_info write(const char *data, size_t size) {
+		while (size) {
+			size_t num = std::min<size_t>(size, m_cfg.chunk_size - m_chunk.size());
+			m_chunk.append(data, num);
+			data += num;
+			size -= num;
+
+			if (m_chunk.size() == m_cfg.chunk_size) {
+				elliptics::error_info err = send_chunk();
+				if (err)
+					return err;
+			}
+		}
+
+		std::lock_guard<std::mutex> guard(m_state->lock);
+		return m_state->error;
+	}
+
+	elliptics::error_info write(const std::string &data) {
+		return write(data.data(), data.size());
+	}
+
+	// @res.url points to the manifest, this is the url the object should be read with
+	elliptics::error_info finish(write_result &res) {
+		if (!m_chunk.empty() || m_index == 0) {
+			elliptics::error_info err = send_chunk();
+			if (err)
+				return err;
+		}
+
+		wait(0);
+
+		std::unique_lock<std::mutex> guard(m_state->lock);
+		if (m_state->error)
+			return m_state->error;
+
+		std::string manifest = m_state->manifest.pack();
+		guard.unlock();
+
+		res = m_bp.write(m_key, manifest);
+		return res.error;
+	}
+
+	stripe_manifest manifest() const {
+		std::lock_guard<std::mutex> guard(m_state->lock);
+		return m_state->manifest;
+	}
+
+private:
+	struct state {
+		std::mutex			lock;
+		std::condition_variable		wait;
+		size_t				inflight = 0;
+		stripe_manifest			manifest;
+		elliptics::error_info		error;
+	};
+
+	Processor &m_bp;
+	std::string m_key;
+	stripe_config m_cfg;
+
+	std::shared_ptr<state> m_state;
+
+	std::string m_chunk;
+	size_t m_index = 0;
+
+	// waits until there are at most @inflight chunks in flight
+	void wait(size_t inflight) {
+		std::unique_lock<std::mutex> guard(m_state->lock);
+		m_state->wait.wait(guard, [&] {return m_state->inflight <= inflight;});
+	}
+
+	elliptics::error_info send_chunk() {
+		wait(m_cfg.max_inflight - 1);
+
+		std::unique_lock<std::mutex> guard(m_state->lock);
+		if (m_state->error)
+			return m_state->error;
+
+		size_t idx = m_index++;
+		stripe_chunk chunk;
+		chunk.key = m_key + ".stripe." + std::to_string(idx);
+		chunk.size = m_chunk.size();
+
+		m_state->manifest.chunks.push_back(chunk);
+		m_state->manifest.size += chunk.size;
+		m_state->inflight++;
+		guard.unlock();
+
+		std::string data;
+		data.swap(m_chunk);
+
+		std::shared_ptr<state> st = m_state;
+		m_bp.write(chunk.key, data, [st, idx] (const write_result &res) {
+				std::lock_guard<std::mutex> guard(st->lock);
+				if (res.error) {
+					if (!st->error)
+						st->error = res.error;
+				} else {
+					st->manifest.chunks[idx].bucket = res.url.bucket;
+				}
+
+				st->inflight--;
+				st->wait.notify_all();
+			});
+
+		return elliptics::error_info();
+	}
+};
+
+// Streaming reader of the striped object. Manifest is read by @open(), then chunks are returned
+// in order by @next(), up to @max_inflight chunks are prefetched concurrently using hedged reads.
+template <typename Processor>
+class basic_stripe_reader {
+public:
+	basic_stripe_reader(Processor &bp, const stripe_config &cfg = stripe_config()) :
+	m_bp(bp),
+	m_cfg(cfg),
+	m_state(std::make_shared<state>())
+	{
+		if (m_cfg.max_inflight == 0)
+			m_cfg.max_inflight = 1;
+	}
+
+	// reads manifest @url points to and starts prefetching chunks
+	elliptics::error_info open(const eurl &url) {
+		std::string data;
+		elliptics::error_info err = read_object(url.bucket, url.key, data);
+		if (err)
+			return err;
+
+		try {
+			m_manifest = stripe_manifest::unpack(data);
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "%s: invalid stripe manifest: %s", url.str().c_str(), e.what());
+		}
+
+		m_next = 0;
+		m_sent = 0;
+		while (m_sent < m_manifest.chunks.size() && m_sent < m_cfg.max_inflight) {
+			send(m_sent++);
+		}
+
+		return elliptics::error_info();
+	}
+
+	const stripe_manifest &manifest() const {
+		return m_manifest;
+	}
+
+	// returns false when the whole object has been read or when chunk could not be read, see @error()
+	bool next(std::string &chunk) {
+		if (m_next >= m_manifest.chunks.size())
+			return false;
+
+		std::unique_lock<std::mutex> guard(m_state->lock);
+		m_state->wait.wait(guard, [&] {return !!m_state->error || m_state->chunks.count(m_next);});
+		if (m_state->error)
+			return false;
+
+		chunk.swap(m_state->chunks[m_next]);
+		m_state->chunks.erase(m_next);
+		guard.unlock();
+
+		m_next++;
+		if (m_sent < m_manifest.chunks.size())
+			send(m_sent++);
+
+		return true;
+	}
+
+	elliptics::error_info error() const {
+		std::lock_guard<std::mutex> guard(m_state->lock);
+		return m_state->error;
+	}
+
+private:
+	struct state {
+		mutable std::mutex		lock;
+		std::condition_variable		wait;
+		std::map<size_t, std::string>	chunks;
+		elliptics::error_info		error;
+	};
+
+	Processor &m_bp;
+	stripe_config m_cfg;
+	stripe_manifest m_manifest;
+
+	std::shared_ptr<state> m_state;
+	size_t m_next = 0;
+	size_t m_sent = 0;
+
+	void send(size_t idx) {
+		const stripe_chunk &chunk = m_manifest.chunks[idx];
+		std::shared_ptr<state> st = m_state;
+
+		bucket b;
+		elliptics::error_info err = m_bp.find_bucket(chunk.bucket, b);
+		if (err) {
+			std::lock_guard<std::mutex> guard(st->lock);
+			st->error = err;
+			st->wait.notify_all();
+			return;
+		}
+
+		uint64_t size = chunk.size;
+		std::string key = chunk.key;
+		b->read_hedged(key, [st, idx, size, key] (const std::vector<storage_result> &result,
+					const elliptics::error_info &error) {
+				std::lock_guard<std::mutex> guard(st->lock);
+
+				if (error || result.empty()) {
+					if (!st->error) {
+						st->error = error ? error :
+							elliptics::create_error(-ENOENT, "%s: chunk has not been read", key.c_str());
+					}
+				} else if (result.front().data.size() != size) {
+					if (!st->error) {
+						st->error = elliptics::create_error(-EILSEQ, "%s: chunk size mismatch: %zd, manifest: %llu",
+								key.c_str(), result.front().data.size(), (unsigned long long)size);
+					}
+				} else {
+					st->chunks[idx] = result.front().data;
+				}
+
+				st->wait.notify_all();
+			});
+	}
+
+	elliptics::error_info read_object(const std::string &bname, const std::string &key, std::string &data) {
+		bucket b;
+		elliptics::error_info err = m_bp.find_bucket(bname, b);
+		if (err)
+			return err;
+
+		std::shared_ptr<std::promise<elliptics::error_info>> done =
+			std::make_shared<std::promise<elliptics::error_info>>();
+		std::future<elliptics::error_info> completed = done->get_future();
+
+		b->read_hedged(key, [done, &data] (const std::vector<storage_result> &result, const elliptics::error_info &error) {
+				if (!error && !result.empty())
+					data = result.front().data;
+
+				done->set_value(error);
+			});
+
+		return completed.get();
+	}
+};
+
+typedef basic_stripe_writer<bucket_processor> stripe_writer;
+typedef basic_stripe_reader<bucket_processor> stripe_reader;
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_STRIPE_HPP
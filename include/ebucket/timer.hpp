@@ -0,0 +1,79 @@
+#ifndef __EBUCKET_TIMER_HPP
+#define __EBUCKET_TIMER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace ioremap { namespace ebucket {
+
+// Single thread which calls functions at given time, it is used to send delayed requests (read hedges).
+// Functions are called one by one from the timer thread, they must not block.
+// Functions which have not been called yet are dropped when timer is destroyed.
+class timer_queue {
+public:
+	timer_queue() : m_thread(std::bind(&timer_queue::run, this)) {}
+
+	~timer_queue() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_need_exit = true;
+		guard.unlock();
+		m_wait.notify_all();
+
+		m_thread.join();
+	}
+
+	void schedule(const std::chrono::steady_clock::duration &delay, const std::function<void ()> &func) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_queue.insert(std::make_pair(std::chrono::steady_clock::now() + delay, func));
+		guard.unlock();
+
+		m_wait.notify_one();
+	}
+
+	// timer shared by all buckets, it is created on the first use
+	static std::shared_ptr<timer_queue> shared() {
+		static std::shared_ptr<timer_queue> timer = std::make_shared<timer_queue>();
+		return timer;
+	}
+
+private:
+	std::mutex m_lock;
+	std::condition_variable m_wait;
+	std::multimap<std::chrono::steady_clock::time_point, std::function<void ()>> m_queue;
+	bool m_need_exit = false;
+
+	std::thread m_thread;
+
+	void run() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		while (!m_need_exit) {
+			if (m_queue.empty()) {
+				m_wait.wait(guard);
+				continue;
+			}
+
+			auto first = m_queue.begin();
+			if (first->first > std::chrono::steady_clock::now()) {
+				m_wait.wait_until(guard, first->first);
+				continue;
+			}
+
+			std::function<void ()> func = std::move(first->second);
+			m_queue.erase(first);
+			guard.unlock();
+
+			func();
+
+			guard.lock();
+		}
+	}
+};
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_TIMER_HPP
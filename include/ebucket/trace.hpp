@@ -0,0 +1,252 @@
+#ifndef __EBUCKET_TRACE_HPP
+#define __EBUCKET_TRACE_HPP
+
+#include "ebucket/elliptics_stat.hpp"
+
+#include <msgpack.hpp>
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace ebucket {
+
+// Placement trace is a stream of msgpack arrays, the first element is record type,
+// the second one is record time in microseconds since epoch:
+//
+//  * [1, time, size, bucket] - bucket selection, bucket is empty if selection has failed
+//  * [2, time, group, state, ro, defrag_state, start_error,
+//	size.limit, size.used, size.removed, vfs.avail, vfs.total,
+//	records.total, records.removed, records.corrupted] - backend statistics of the group,
+//	zero size limit means there is no statistics for this group anymore
+//  * [3, time, bucket, [groups]] - bucket metadata
+//
+// Bucket and statistics records are written for every bucket when tracing starts and
+// when buckets are reloaded, statistics records are also written when group statistics changes.
+struct trace_record {
+	enum record_type {
+		select = 1,
+		stat,
+		bucket,
+	};
+
+	int		type = 0;
+	uint64_t	time = 0;
+
+	// selection request size
+	uint64_t	size = 0;
+
+	// selected bucket or bucket whose metadata this record holds
+	std::string	name;
+	std::vector<int> groups;
+
+	backend_stat	bs;
+};
+
+class trace_writer {
+public:
+	// throws if file can not be opened
+	trace_writer(const std::string &path) : m_path(path), m_packer(&m_buffer) {
+		m_out.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!m_out) {
+			throw std::runtime_error("could not open trace file " + path);
+		}
+	}
+
+	~trace_writer() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		write_buffer();
+	}
+
+	const std::string &path() const {
+		return m_path;
+	}
+
+	void select(uint64_t size, const std::string &bname) {
+		uint64_t t = now();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_packer.pack_array(4);
+		m_packer.pack((int)trace_record::select);
+		m_packer.pack(t);
+		m_packer.pack(size);
+		m_packer.pack(bname);
+
+		maybe_write();
+	}
+
+	void stat(int group, const backend_stat &bs) {
+		uint64_t t = now();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_packer.pack_array(15);
+		m_packer.pack((int)trace_record::stat);
+		m_packer.pack(t);
+		m_packer.pack(group);
+		m_packer.pack(bs.state);
+		m_packer.pack(bs.ro);
+		m_packer.pack(bs.defrag_state);
+		m_packer.pack(bs.start_error);
+		m_packer.pack(bs.size.limit);
+		m_packer.pack(bs.size.used);
+		m_packer.pack(bs.size.removed);
+		m_packer.pack(bs.vfs.avail);
+		m_packer.pack(bs.vfs.total);
+		m_packer.pack(bs.records.total);
+		m_packer.pack(bs.records.removed);
+		m_packer.pack(bs.records.corrupted);
+
+		maybe_write();
+	}
+
+	// group has disappeared from the statistics
+	void clear_stat(int group) {
+		stat(group, backend_stat());
+	}
+
+	void bucket(const std::string &bname, const std::vector<int> &groups) {
+		uint64_t t = now();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_packer.pack_array(4);
+		m_packer.pack((int)trace_record::bucket);
+		m_packer.pack(t);
+		m_packer.pack(bname);
+		m_packer.pack(groups);
+
+		maybe_write();
+	}
+
+	void flush() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		write_buffer();
+		m_out.flush();
+	}
+
+private:
+	enum {
+		write_size = 64 * 1024,
+	};
+
+	std::string m_path;
+
+	std::mutex m_lock;
+	msgpack::sbuffer m_buffer;
+	msgpack::packer<msgpack::sbuffer> m_packer;
+	std::ofstream m_out;
+
+	static uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// must be called with @m_lock held
+	void maybe_write() {
+		if (m_buffer.size() >= write_size)
+			write_buffer();
+	}
+
+	// must be called with @m_lock held
+	void write_buffer() {
+		if (m_buffer.size() == 0)
+			return;
+
+		m_out.write(m_buffer.data(), m_buffer.size());
+		m_buffer.clear();
+	}
+};
+
+class trace_reader {
+public:
+	// throws if file can not be opened
+	trace_reader(const std::string &path) {
+		m_in.open(path.c_str(), std::ios::in | std::ios::binary);
+		if (!m_in) {
+			throw std::runtime_error("could not open trace file " + path);
+		}
+	}
+
+	// returns false when the whole trace has been read, throws on malformed record
+	bool next(trace_record &rec) {
+		msgpack::unpacked msg;
+
+		while (!m_unpacker.next(&msg)) {
+			m_unpacker.reserve_buffer(read_size);
+			m_in.read(m_unpacker.buffer(), m_unpacker.buffer_capacity());
+
+			size_t num = m_in.gcount();
+			if (num == 0)
+				return false;
+
+			m_unpacker.buffer_consumed(num);
+		}
+
+		decode(msg.get(), rec);
+		return true;
+	}
+
+private:
+	enum {
+		read_size = 64 * 1024,
+	};
+
+	std::ifstream m_in;
+	msgpack::unpacker m_unpacker;
+
+	static void decode(const msgpack::object &o, trace_record &rec) {
+		if (o.type != msgpack::type::ARRAY || o.via.array.size < 2) {
+			throw std::runtime_error("trace: record must be an array of at least 2 elements");
+		}
+
+		msgpack::object *p = o.via.array.ptr;
+		uint32_t size = o.via.array.size;
+
+		rec = trace_record();
+		p[0].convert(&rec.type);
+		p[1].convert(&rec.time);
+
+		switch (rec.type) {
+		case trace_record::select:
+			if (size != 4)
+				throw std::runtime_error("trace: select record must have 4 elements");
+
+			p[2].convert(&rec.size);
+			p[3].convert(&rec.name);
+			break;
+		case trace_record::stat:
+			if (size != 15)
+				throw std::runtime_error("trace: stat record must have 15 elements");
+
+			p[2].convert(&rec.bs.group);
+			p[3].convert(&rec.bs.state);
+			p[4].convert(&rec.bs.ro);
+			p[5].convert(&rec.bs.defrag_state);
+			p[6].convert(&rec.bs.start_error);
+			p[7].convert(&rec.bs.size.limit);
+			p[8].convert(&rec.bs.size.used);
+			p[9].convert(&rec.bs.size.removed);
+			p[10].convert(&rec.bs.vfs.avail);
+			p[11].convert(&rec.bs.vfs.total);
+			p[12].convert(&rec.bs.records.total);
+			p[13].convert(&rec.bs.records.removed);
+			p[14].convert(&rec.bs.records.corrupted);
+			break;
+		case trace_record::bucket:
+			if (size != 4)
+				throw std::runtime_error("trace: bucket record must have 4 elements");
+
+			p[2].convert(&rec.name);
+			p[3].convert(&rec.groups);
+			break;
+		default:
+			throw std::runtime_error("trace: unknown record type " + std::to_string(rec.type));
+		}
+	}
+};
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_TRACE_HPP
@@ -0,0 +1,175 @@
+#ifndef __EBUCKET_WEIGHT_POLICY_HPP
+#define __EBUCKET_WEIGHT_POLICY_HPP
+
+#include "ebucket/bucket.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+namespace ioremap { namespace ebucket {
+
+// Alternative weight policies for @basic_bucket_processor,
+// the interface and the default policy are described in bucket.hpp near @default_weight_policy.
+//
+// Usage:
+//	basic_bucket_processor<strict_threshold_weight_policy> bp(node);
+
+// Buckets which do not fully satisfy the limits are never selected:
+// unlike the default policy, bucket gets zero weight if free space of any backend is below soft limit,
+// if there is no statistics for some of its groups or if some of its groups have no routes.
+// Remaining buckets are weighted by the smallest free space ratio among their backends
+// multiplied by the smallest backend health.
+struct strict_threshold_weight_policy {
+	limits	l;
+
+	float weight(const bucket_meta &meta, const bucket_stat &stat) const {
+		if (stat.backends.size() != meta.groups.size())
+			return 0;
+
+		float weight = 0;
+		float health = 1;
+		for (auto st = stat.backends.begin(), end = stat.backends.end(); st != end; ++st) {
+			const backend_stat &bs = st->second;
+			if (bs.size.limit == 0 || bs.size.used >= bs.size.limit)
+				return 0;
+
+			health = std::min(health, bs.health);
+
+			float tmp = (float)(bs.size.limit - bs.size.used) / (float)bs.size.limit;
+			if (tmp < l.size.soft)
+				return 0;
+
+			if (tmp < weight || weight == 0)
+				weight = tmp;
+		}
+
+		return weight * health;
+	}
+
+	float select_weight(float w, bool routed) const {
+		if (!routed)
+			return 0;
+
+		return w;
+	}
+};
+
+// Weight is proportional to the time left until the first backend of the bucket is full.
+//
+// Write rate of every group is estimated from the used space change between statistics updates
+// and smoothed exponentially. Default policy weight is multiplied by the ratio of the estimated
+// time to full to @horizon, thus buckets which are filled faster than others lose weight before
+// they hit the limits. Until write rate is known, the policy behaves exactly like the default one.
+class time_to_full_weight_policy {
+public:
+	time_to_full_weight_policy(std::chrono::seconds horizon = std::chrono::hours(24 * 7), double smoothing = 0.3) :
+	m_horizon(horizon),
+	m_smoothing(smoothing)
+	{
+	}
+
+	time_to_full_weight_policy(const time_to_full_weight_policy &other) :
+	l(other.l),
+	m_horizon(other.m_horizon),
+	m_smoothing(other.m_smoothing)
+	{
+	}
+
+	limits	l;
+
+	float weight(const bucket_meta &meta, const bucket_stat &stat) const {
+		float weight = default_weight_policy::weight(meta, stat, 0, l);
+		if (weight == 0)
+			return 0;
+
+		double horizon = m_horizon.count();
+		double time_to_full = horizon;
+
+		auto now = std::chrono::steady_clock::now();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		for (auto st = stat.backends.begin(), end = stat.backends.end(); st != end; ++st) {
+			const backend_stat &bs = st->second;
+			double rate = update_rate(st->first, bs.size.used, now);
+			if (rate <= 0)
+				continue;
+
+			double avail = bs.size.limit > bs.size.used ? bs.size.limit - bs.size.used : 0;
+			time_to_full = std::min(time_to_full, avail / rate);
+		}
+
+		return weight * time_to_full / horizon;
+	}
+
+	float select_weight(float w, bool routed) const {
+		// there are no routes to one or more groups in this bucket, heavily decrease its weight
+		if (!routed)
+			return w / 100;
+
+		return w;
+	}
+
+	// estimated write rate of the group in bytes per second, zero if it is not known yet
+	double rate(int group) const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto it = m_groups.find(group);
+		if (it == m_groups.end())
+			return 0;
+
+		return it->second.rate;
+	}
+
+private:
+	struct group_rate {
+		uint64_t	used = 0;
+		std::chrono::steady_clock::time_point	time;
+
+		// bytes per second
+		double		rate = 0;
+	};
+
+	std::chrono::seconds m_horizon;
+	double m_smoothing;
+
+	// weight is recalculated every time any group of the bucket changes,
+	// rate is only updated when used space of the group itself changes
+	mutable std::mutex m_lock;
+	mutable std::map<int, group_rate> m_groups;
+
+	// must be called with @m_lock held
+	double update_rate(int group, uint64_t used, const std::chrono::steady_clock::time_point &now) const {
+		auto it = m_groups.find(group);
+		if (it == m_groups.end()) {
+			group_rate &gr = m_groups[group];
+			gr.used = used;
+			gr.time = now;
+			return 0;
+		}
+
+		group_rate &gr = it->second;
+		if (gr.used == used)
+			return gr.rate;
+
+		double seconds = std::chrono::duration_cast<std::chrono::microseconds>(now - gr.time).count() / 1000000.0;
+		if (seconds > 0) {
+			// used space decreases after defragmentation, that is not a negative write rate
+			double current = used > gr.used ? (used - gr.used) / seconds : 0;
+
+			if (gr.rate == 0) {
+				gr.rate = current;
+			} else {
+				gr.rate = m_smoothing * current + (1 - m_smoothing) * gr.rate;
+			}
+		}
+
+		gr.used = used;
+		gr.time = now;
+		return gr.rate;
+	}
+};
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_WEIGHT_POLICY_HPP
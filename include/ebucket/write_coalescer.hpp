@@ -0,0 +1,352 @@
+#ifndef __EBUCKET_WRITE_COALESCER_HPP
+#define __EBUCKET_WRITE_COALESCER_HPP
+
+#include "ebucket/bucket_processor.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace ioremap { namespace ebucket {
+
+struct coalescer_config {
+	// batch is flushed when it has this many objects or bytes
+	size_t				max_batch_objects = 128;
+	size_t				max_batch_bytes = 1024 * 1024;
+
+	// batch is flushed when its first object has waited this long
+	std::chrono::milliseconds	max_delay = std::chrono::milliseconds(5);
+
+	// objects buffered or being written, new writes block (or are rejected by @try_write())
+	// until amount of data drops below this limit
+	size_t				max_pending_bytes = 64 * 1024 * 1024;
+};
+
+// Asynchronous small write coalescer in front of the bucket write path.
+//
+// Objects destined for the same bucket are buffered and written with single bulk write
+// (see @raw_bucket::bulk_write()) when batch reaches object or size limit (flushed from the writing thread)
+// or when its deadline expires (flushed from coalescer thread). Every object gets its own completion,
+// it is called from storage IO thread, or from the writing thread if object could not be queued.
+//
+// Object is written only if it has been written into every group of its bucket,
+// failed objects are not retried in other buckets.
+template <typename Processor>
+class basic_write_coalescer {
+public:
+	struct counters {
+		uint64_t	objects = 0;
+		uint64_t	bytes = 0;
+		uint64_t	batches = 0;
+		uint64_t	errors = 0;
+
+		// batches flushed by size and object limits, the rest were flushed by deadline or @flush()
+		uint64_t	full_batches = 0;
+	};
+
+	basic_write_coalescer(Processor &bp, const coalescer_config &cfg = coalescer_config()) :
+	m_bp(bp),
+	m_cfg(cfg),
+	m_flush_thread(std::bind(&basic_write_coalescer::flush_thread, this))
+	{
+	}
+
+	~basic_write_coalescer() {
+		close();
+	}
+
+	// selects bucket using processor and queues object into its batch,
+	// blocks while there are too many pending bytes
+	void write(const std::string &key, const std::string &data, const write_handler &handler) {
+		bucket b;
+		elliptics::error_info err = m_bp.get_bucket(data.size(), b);
+		if (err) {
+			write_result res;
+			res.error = err;
+			handler(res);
+			return;
+		}
+
+		write(b, key, data, handler);
+	}
+
+	// queues object into the batch of the given bucket
+	void write(const bucket &b, const std::string &key, const std::string &data, const write_handler &handler) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_space.wait(guard, [&] {return m_need_exit || !full(data.size());});
+
+		queue(guard, b, key, data, handler);
+	}
+
+	// the same as @write(), but returns false without calling @handler if pending bytes limit is reached
+	bool try_write(const std::string &key, const std::string &data, const write_handler &handler) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		if (full(data.size()))
+			return false;
+		guard.unlock();
+
+		bucket b;
+		elliptics::error_info err = m_bp.get_bucket(data.size(), b);
+		if (err) {
+			write_result res;
+			res.error = err;
+			handler(res);
+			return true;
+		}
+
+		// other writers may have filled the buffer while bucket was being selected
+		guard.lock();
+		if (full(data.size()))
+			return false;
+
+		queue(guard, b, key, data, handler);
+		return true;
+	}
+
+	// sends all buffered batches without waiting for their deadlines
+	void flush() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		std::vector<batch> ready;
+		for (auto it = m_batches.begin(), end = m_batches.end(); it != end; ++it) {
+			ready.emplace_back(std::move(it->second));
+		}
+		m_batches.clear();
+		guard.unlock();
+
+		send(ready, false);
+	}
+
+	// flushes buffered objects and waits until all writes complete, new writes are rejected afterwards
+	void close() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		if (m_need_exit)
+			return;
+
+		m_need_exit = true;
+		guard.unlock();
+
+		m_wait.notify_all();
+		m_space.notify_all();
+		if (m_flush_thread.joinable())
+			m_flush_thread.join();
+
+		flush();
+
+		guard.lock();
+		m_space.wait(guard, [&] {return m_pending_bytes == 0 && m_inflight == 0;});
+	}
+
+	counters get_counters() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_counters;
+	}
+
+private:
+	struct pending_object {
+		std::string	key;
+		std::string	data;
+		write_handler	handler;
+	};
+
+	struct batch {
+		bucket		b;
+		std::vector<pending_object> objects;
+		size_t		bytes = 0;
+		std::chrono::steady_clock::time_point	deadline;
+	};
+
+	Processor &m_bp;
+	coalescer_config m_cfg;
+
+	std::mutex m_lock;
+	std::condition_variable m_wait;
+	std::condition_variable m_space;
+	bool m_need_exit = false;
+
+	// bucket name -> objects buffered for it
+	std::map<std::string, batch> m_batches;
+
+	// bytes of buffered objects and objects being written, and number of batches being written
+	size_t m_pending_bytes = 0;
+	size_t m_inflight = 0;
+
+	counters m_counters;
+
+	std::thread m_flush_thread;
+
+	// must be called with @m_lock held,
+	// single object is always accepted when nothing is pending, even if it is larger than the limit
+	bool full(size_t size) const {
+		return m_pending_bytes != 0 && m_pending_bytes + size > m_cfg.max_pending_bytes;
+	}
+
+	// must be called with @guard locked, it is unlocked on return
+	void queue(std::unique_lock<std::mutex> &guard, const bucket &b,
+			const std::string &key, const std::string &data, const write_handler &handler) {
+		if (m_need_exit) {
+			guard.unlock();
+
+			write_result res;
+			res.error = elliptics::create_error(-ESHUTDOWN, "write coalescer is closed");
+			handler(res);
+			return;
+		}
+
+		batch &bt = m_batches[b->name()];
+		if (bt.objects.empty()) {
+			bt.b = b;
+			bt.deadline = std::chrono::steady_clock::now() + m_cfg.max_delay;
+		}
+
+		pending_object obj;
+		obj.key = key;
+		obj.data = data;
+		obj.handler = handler;
+		bt.objects.emplace_back(std::move(obj));
+		bt.bytes += data.size();
+		m_pending_bytes += data.size();
+
+		if (bt.objects.size() < m_cfg.max_batch_objects && bt.bytes < m_cfg.max_batch_bytes) {
+			bool first = bt.objects.size() == 1;
+			guard.unlock();
+
+			// flush thread may sleep until later deadline
+			if (first)
+				m_wait.notify_one();
+			return;
+		}
+
+		std::vector<batch> ready;
+		ready.emplace_back(std::move(bt));
+		m_batches.erase(b->name());
+		guard.unlock();
+
+		send(ready, true);
+	}
+
+	void send(std::vector<batch> &ready, bool full) {
+		for (auto it = ready.begin(), end = ready.end(); it != end; ++it) {
+			send(std::move(*it), full);
+		}
+	}
+
+	void send(batch &&bt, bool full) {
+		if (bt.objects.empty())
+			return;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_inflight++;
+		m_counters.batches++;
+		if (full)
+			m_counters.full_batches++;
+		guard.unlock();
+
+		std::shared_ptr<std::vector<std::string>> keys = std::make_shared<std::vector<std::string>>();
+		std::vector<std::string> data;
+		keys->reserve(bt.objects.size());
+		data.reserve(bt.objects.size());
+
+		// keys and handlers are kept until completion, data is only needed for the write
+		std::shared_ptr<std::vector<write_handler>> handlers = std::make_shared<std::vector<write_handler>>();
+		handlers->reserve(bt.objects.size());
+
+		for (auto it = bt.objects.begin(), end = bt.objects.end(); it != end; ++it) {
+			keys->emplace_back(std::move(it->key));
+			data.emplace_back(std::move(it->data));
+			handlers->emplace_back(std::move(it->handler));
+		}
+
+		bucket b = bt.b;
+		size_t bytes = bt.bytes;
+
+		b->bulk_write(*keys, data,
+			[this, b, bytes, keys, handlers] (const std::vector<std::vector<storage_result>> &results,
+					const elliptics::error_info &error) {
+				completed(b, bytes, *keys, *handlers, results, error);
+			});
+	}
+
+	void completed(const bucket &b, size_t bytes, const std::vector<std::string> &keys,
+			const std::vector<write_handler> &handlers,
+			const std::vector<std::vector<storage_result>> &results, const elliptics::error_info &error) {
+		size_t errors = 0;
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			write_result res;
+			res.b = b;
+
+			if (i < results.size())
+				res.results = results[i];
+
+			for (auto r = res.results.begin(), rend = res.results.end(); r != rend; ++r) {
+				if (r->error) {
+					res.error = r->error;
+					break;
+				}
+			}
+
+			if (res.results.empty()) {
+				res.error = error ? error : elliptics::create_error(-ENXIO,
+						"bucket %s: write has not returned any result", b->name().c_str());
+			}
+
+			if (res.error) {
+				res.failed.push_back(b->name());
+				errors++;
+			} else {
+				res.url.bucket = b->name();
+				res.url.key = keys[i];
+			}
+
+			handlers[i](res);
+		}
+
+		// notification is sent under the lock, @close() may destroy coalescer as soon as the lock is released
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_pending_bytes -= bytes;
+		m_inflight--;
+		m_counters.objects += keys.size();
+		m_counters.bytes += bytes;
+		m_counters.errors += errors;
+		m_space.notify_all();
+	}
+
+	void flush_thread() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		while (!m_need_exit) {
+			auto now = std::chrono::steady_clock::now();
+			auto next = now + m_cfg.max_delay;
+
+			std::vector<batch> ready;
+			for (auto it = m_batches.begin(); it != m_batches.end();) {
+				if (it->second.deadline <= now) {
+					ready.emplace_back(std::move(it->second));
+					it = m_batches.erase(it);
+					continue;
+				}
+
+				if (it->second.deadline < next)
+					next = it->second.deadline;
+				++it;
+			}
+
+			if (!ready.empty()) {
+				guard.unlock();
+				send(ready, false);
+				guard.lock();
+				continue;
+			}
+
+			m_wait.wait_until(guard, next);
+		}
+	}
+};
+
+typedef basic_write_coalescer<bucket_processor> write_coalescer;
+
+}} // namespace ioremap::ebucket
+
+#endif // __EBUCKET_WRITE_COALESCER_HPP
@@ -5,6 +5,7 @@
 
 #include <thevoid/rapidjson/stringbuffer.h>
 #include <thevoid/rapidjson/prettywriter.h>
+#include <thevoid/rapidjson/writer.h>
 #include <thevoid/rapidjson/document.h>
 
 #include <thevoid/server.hpp>
@@ -12,6 +13,7 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <stdlib.h>
 
 #include <atomic>
 
@@ -47,11 +49,16 @@ public:
 		obj.AddMember("time-raw", tobj_raw, alloc);
 	}
 
-	std::string ToString() const {
+	std::string ToString(bool pretty = true) const {
 		rapidjson::StringBuffer buffer;
-		rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
 
-		Accept(writer);
+		if (pretty) {
+			rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+			Accept(writer);
+		} else {
+			rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+			Accept(writer);
+		}
 		buffer.Put('\n');
 
 		return std::string(buffer.GetString(), buffer.Size());
@@ -65,10 +72,178 @@ private:
 	rapidjson::MemoryPoolAllocator<> m_allocator;
 };
 
+// Reply format is negotiated using Accept header:
+// application/msgpack (or application/x-msgpack) selects msgpack,
+// application/json (or text/json) selects compact JSON,
+// everything else gets pretty-printed JSON.
+// When several types are accepted, the one with the highest q-value wins.
+enum reply_format {
+	reply_json_pretty = 0,
+	reply_json,
+	reply_msgpack,
+};
+
+static inline reply_format negotiate_reply_format(const thevoid::http_request &req) {
+	auto accept = req.headers().get("Accept");
+	if (!accept)
+		return reply_json_pretty;
+
+	reply_format ret = reply_json_pretty;
+	float best_q = 0;
+
+	std::istringstream ss(*accept);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		std::string type = item.substr(0, item.find(';'));
+		type.erase(0, type.find_first_not_of(" \t"));
+		type.erase(type.find_last_not_of(" \t") + 1);
+
+		float q = 1;
+		size_t qpos = item.find("q=");
+		if (qpos != std::string::npos)
+			q = atof(item.c_str() + qpos + 2);
+
+		reply_format fmt;
+		if (type == "application/msgpack" || type == "application/x-msgpack") {
+			fmt = reply_msgpack;
+		} else if (type == "application/json" || type == "text/json") {
+			fmt = reply_json;
+		} else {
+			continue;
+		}
+
+		if (q > best_q) {
+			best_q = q;
+			ret = fmt;
+		}
+	}
+
+	return ret;
+}
+
+static inline const char *reply_content_type(reply_format fmt) {
+	if (fmt == reply_msgpack)
+		return "application/x-msgpack";
+	return "text/json; charset=utf-8";
+}
+
+// @Base is thevoid stream type: simple stream gets the whole request body at once, buffered stream gets it by chunks
+template <typename Server, typename Stream, typename Base = thevoid::simple_request_stream<Server>>
+class on_request_base : public Base, public std::enable_shared_from_this<Stream> {
+public:
+	on_request_base() : m_start(std::chrono::steady_clock::now()) {}
+
+	// stream is destroyed after reply has been sent (or connection has been closed),
+	// thus recorded time covers the whole request handling
+	virtual ~on_request_base() {
+		if (m_hist)
+			m_hist->record(std::chrono::steady_clock::now() - m_start);
+	}
+
+	virtual void on_error(const boost::system::error_code &error) {
+		EBUCKET_LOG_ERROR("on_error: url: %s, error: %s",
+			this->request().url().to_human_readable().c_str(), error.message().c_str());
+	}
+
+protected:
+	// account this request in the handler's latency histogram
+	void track(const std::string &handler) {
+		m_hist = this->server()->http_histogram(handler);
+	}
+
+	reply_format format() {
+		return negotiate_reply_format(this->request());
+	}
+
+	void send_body(enum swarm::http_response::status_type status, reply_format fmt, std::string &&data) {
+		thevoid::http_response reply;
+		reply.set_code(status);
+		reply.headers().set_content_type(reply_content_type(fmt));
+		reply.headers().set_content_length(data.size());
+
+		this->send_reply(std::move(reply), std::move(data));
+	}
+
+	// sends shared immutable buffer, it is kept alive until reply is completed
+	void send_shared(enum swarm::http_response::status_type status, reply_format fmt,
+			const std::shared_ptr<const std::string> &data) {
+		thevoid::http_response reply;
+		reply.set_code(status);
+		reply.headers().set_content_type(reply_content_type(fmt));
+		reply.headers().set_content_length(data->size());
+
+		auto self = this->shared_from_this();
+		this->send_headers(std::move(reply), boost::asio::const_buffer(data->data(), data->size()),
+			[self, data] (const boost::system::error_code &error) {
+				self->close(error);
+			});
+	}
+
+	static void add_bucket(rapidjson::Value &obj, const ebucket::bucket_meta &meta, rapidjson::MemoryPoolAllocator<> &allocator) {
+		rapidjson::Value name_val(meta.name.c_str(), meta.name.size(), allocator);
+		obj.AddMember("bucket", name_val, allocator);
+
+		rapidjson::Value groups_val(rapidjson::kArrayType);
+		for (auto group: meta.groups) {
+			groups_val.PushBack(group, allocator);
+		}
+		obj.AddMember("groups", groups_val, allocator);
+	}
+
+	static void add_error(rapidjson::Value &obj, int code, const std::string &message, rapidjson::MemoryPoolAllocator<> &allocator) {
+		rapidjson::Value error(rapidjson::kObjectType);
+		rapidjson::Value message_val(message.c_str(), message.size(), allocator);
+		error.AddMember("message", message_val, allocator);
+		error.AddMember("code", code, allocator);
+
+		obj.AddMember("error", error, allocator);
+	}
+
+	template <typename Packer>
+	static void pack_error(Packer &pk, int code, const std::string &message) {
+		pk.pack(std::string("error"));
+		pk.pack_map(2);
+		pk.pack(std::string("message"));
+		pk.pack(message);
+		pk.pack(std::string("code"));
+		pk.pack(code);
+	}
+
+	void send_json(enum swarm::http_response::status_type status, reply_format fmt, const JsonValue &ret) {
+		send_body(status, fmt, ret.ToString(fmt == reply_json_pretty));
+	}
+
+	void send_error(enum swarm::http_response::status_type status, int code, const std::string &message) {
+		reply_format fmt = format();
+
+		if (fmt == reply_msgpack) {
+			msgpack::sbuffer buffer;
+			msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+			pk.pack_map(1);
+			pack_error(pk, code, message);
+
+			send_body(status, fmt, std::string(buffer.data(), buffer.size()));
+			return;
+		}
+
+		JsonValue ret;
+		add_error(ret, code, message, ret.GetAllocator());
+
+		send_json(status, fmt, ret);
+	}
+
+private:
+	std::chrono::steady_clock::time_point m_start;
+	ebucket::latency_histogram *m_hist = NULL;
+};
+
 template <typename Server, typename Stream>
-class on_bucket_base : public thevoid::simple_request_stream<Server>, public std::enable_shared_from_this<Stream> {
+class on_bucket_base : public on_request_base<Server, Stream> {
 public:
 	virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+		this->track("bucket");
+
 		(void) buffer;
 
 		size_t size = 1024;
@@ -79,7 +254,7 @@ public:
 		} catch (const std::exception &e) {
 			EBUCKET_LOG_ERROR("on_request: url: %s: invalid size parameter: %s",
 					req.url().to_human_readable().c_str(), e.what());
-			send_error(swarm::http_response::bad_request, -EINVAL, e.what());
+			this->send_error(swarm::http_response::bad_request, -EINVAL, e.what());
 			return;
 		}
 
@@ -88,59 +263,829 @@ public:
 		if (err) {
 			EBUCKET_LOG_ERROR("on_request: url: %s: could not find bucket for size: %ld, error: %s [%d]",
 					req.url().to_human_readable().c_str(), size, err.message().c_str(), err.code());
-			send_error(swarm::http_response::service_unavailable, err.code(), err.message());
+			this->send_error(swarm::http_response::service_unavailable, err.code(), err.message());
 			return;
 		}
 
-		auto meta = b->meta();
+		// arguments are only formatted if info level is enabled
+		EBUCKET_HOT_LOG_INFO("on_request: url: %s: size: %ld, bucket: %s",
+			req.url().to_human_readable().c_str(), size, b->meta().to_string().c_str());
 
-		EBUCKET_LOG_INFO("on_request: url: %s: size: %ld, bucket: %s",
-			req.url().to_human_readable().c_str(), size, meta.to_string().c_str());
+		// reply body is serialized by the bucket when its metadata is loaded,
+		// it is shared between all requests
+		reply_format fmt = this->format();
+		if (fmt == reply_msgpack) {
+			this->send_shared(swarm::http_response::ok, fmt, b->meta_msgpack());
+		} else {
+			this->send_shared(swarm::http_response::ok, fmt, b->meta_json());
+		}
+	}
+};
+
+template <typename Server>
+class on_bucket : public on_bucket_base<Server, on_bucket<Server>>
+{
+public:
+};
+
+// Selects buckets for multiple sizes in one request.
+// Sizes are either comma-separated list in @sizes query parameter: /buckets?sizes=1024,4096,100
+// or JSON array in request body: {"sizes": [1024, 4096, 100]}
+//
+// Reply contains "buckets" array with one entry per requested size in the same order,
+// entry has either "bucket" and "groups" fields or "error" object.
+template <typename Server, typename Stream>
+class on_buckets_base : public on_request_base<Server, Stream> {
+public:
+	virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+		this->track("buckets");
+
+		std::vector<uint64_t> sizes;
+
+		try {
+			parse_sizes(req, buffer, sizes);
+		} catch (const std::exception &e) {
+			EBUCKET_LOG_ERROR("on_request: url: %s: invalid sizes: %s",
+					req.url().to_human_readable().c_str(), e.what());
+			this->send_error(swarm::http_response::bad_request, -EINVAL, e.what());
+			return;
+		}
+
+		if (sizes.empty()) {
+			this->send_error(swarm::http_response::bad_request, -EINVAL, "there are no sizes in request");
+			return;
+		}
+
+		size_t max_batch_size = this->server()->max_batch_size();
+		if (sizes.size() > max_batch_size) {
+			this->send_error(swarm::http_response::bad_request, -E2BIG,
+					"too many sizes in request: " + std::to_string(sizes.size()) +
+					", max: " + std::to_string(max_batch_size));
+			return;
+		}
+
+		std::vector<ebucket::bucket> buckets;
+		std::vector<elliptics::error_info> errors;
+		auto err = this->server()->bucket_processor()->get_buckets(sizes, buckets, errors);
+		if (err) {
+			EBUCKET_LOG_ERROR("on_request: url: %s: could not find buckets for %zd sizes, error: %s [%d]",
+					req.url().to_human_readable().c_str(), sizes.size(), err.message().c_str(), err.code());
+			this->send_error(swarm::http_response::service_unavailable, err.code(), err.message());
+			return;
+		}
+
+		EBUCKET_HOT_LOG_INFO("on_request: url: %s: selected buckets for %zd sizes",
+			req.url().to_human_readable().c_str(), sizes.size());
+
+		reply_format fmt = this->format();
+		if (fmt == reply_msgpack) {
+			msgpack::sbuffer buffer;
+			msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+			pk.pack_map(1);
+			pk.pack(std::string("buckets"));
+			pk.pack_array(sizes.size());
+			for (size_t i = 0; i < sizes.size(); ++i) {
+				pk.pack_map(errors[i] ? 2 : 3);
+				pk.pack(std::string("size"));
+				pk.pack(sizes[i]);
+
+				if (errors[i]) {
+					this->pack_error(pk, errors[i].code(), errors[i].message());
+				} else {
+					ebucket::bucket_meta meta = buckets[i]->meta();
+					pk.pack(std::string("bucket"));
+					pk.pack(meta.name);
+					pk.pack(std::string("groups"));
+					pk.pack(meta.groups);
+				}
+			}
+
+			this->send_body(swarm::http_response::ok, fmt, std::string(buffer.data(), buffer.size()));
+			return;
+		}
 
 		JsonValue ret;
 		auto &allocator = ret.GetAllocator();
 
-		rapidjson::Value name_val(meta.name.c_str(), meta.name.size(), allocator);
-		ret.AddMember("bucket", name_val, allocator);
+		rapidjson::Value buckets_val(rapidjson::kArrayType);
+		for (size_t i = 0; i < sizes.size(); ++i) {
+			rapidjson::Value obj(rapidjson::kObjectType);
+			obj.AddMember("size", sizes[i], allocator);
 
-		rapidjson::Value groups_val(rapidjson::kArrayType);
-		for (auto group: meta.groups) {
-			groups_val.PushBack(group, allocator);
+			if (errors[i]) {
+				this->add_error(obj, errors[i].code(), errors[i].message(), allocator);
+			} else {
+				this->add_bucket(obj, buckets[i]->meta(), allocator);
+			}
+
+			buckets_val.PushBack(obj, allocator);
 		}
-		ret.AddMember("groups", groups_val, allocator);
+		ret.AddMember("buckets", buckets_val, allocator);
 
-		std::string data = ret.ToString();
+		this->send_json(swarm::http_response::ok, fmt, ret);
+	}
 
-		thevoid::http_response reply;
-		reply.set_code(swarm::http_response::ok);
-		reply.headers().set_content_type("text/json; charset=utf-8");
-		reply.headers().set_content_length(data.size());
+private:
+	void parse_sizes(const thevoid::http_request &req, const boost::asio::const_buffer &buffer, std::vector<uint64_t> &sizes) {
+		const auto &query = req.url().query();
+		if (query.has_item("sizes")) {
+			std::string sizes_str = query.item_value("sizes", std::string());
+
+			std::istringstream ss(sizes_str);
+			std::string item;
+			while (std::getline(ss, item, ',')) {
+				if (item.empty())
+					continue;
+
+				size_t pos = 0;
+				sizes.push_back(std::stoull(item, &pos));
+				if (pos != item.size())
+					throw std::invalid_argument("invalid size '" + item + "'");
+			}
 
-		this->send_reply(std::move(reply), std::move(data));
+			return;
+		}
+
+		size_t buffer_size = boost::asio::buffer_size(buffer);
+		if (buffer_size == 0)
+			return;
+
+		// rapidjson requires zero-terminated string
+		std::string body(boost::asio::buffer_cast<const char *>(buffer), buffer_size);
+
+		rapidjson::Document doc;
+		doc.Parse<0>(body.c_str());
+		if (doc.HasParseError()) {
+			throw std::invalid_argument(std::string("could not parse json body: ") + doc.GetParseError());
+		}
+
+		const rapidjson::Value &sizes_val = ebucket::get_array(doc, "sizes");
+		if (!sizes_val.IsArray()) {
+			throw std::invalid_argument("there is no 'sizes' array in json body");
+		}
+
+		for (auto it = sizes_val.Begin(), end = sizes_val.End(); it != end; ++it) {
+			if (!it->IsUint64()) {
+				throw std::invalid_argument("'sizes' array must contain only unsigned integers");
+			}
+
+			sizes.push_back(it->GetUint64());
+		}
+	}
+};
+
+template <typename Server>
+class on_buckets : public on_buckets_base<Server, on_buckets<Server>>
+{
+public:
+};
+
+
+// Uploads object through the server: PUT /upload/<key> with Content-Length header.
+//
+// Bucket is selected by Content-Length, then request body is written into elliptics chunk by chunk
+// as it arrives: the first chunk prepares the object, the last one commits it, object which fits into
+// single chunk is written with plain write. The next chunk is only read from the client after
+// the previous one has been written, thus memory usage does not depend on the object size.
+//
+// Every chunk has to be written into every group of the bucket, the body can not be replayed,
+// thus there is no failover to other buckets, client has to retry the upload.
+// Reply contains "bucket", "groups", "key" and "size" fields.
+template <typename Server, typename Stream>
+class on_upload_base : public on_request_base<Server, Stream, thevoid::buffered_request_stream<Server>> {
+public:
+	virtual void on_request(const thevoid::http_request &req) {
+		this->track("upload");
+
+		static const std::string prefix = "/upload/";
+		const std::string &path = req.url().path();
+		if (path.size() <= prefix.size() || path.compare(0, prefix.size(), prefix) != 0) {
+			this->send_error(swarm::http_response::bad_request, -EINVAL, "there is no key in upload url");
+			return;
+		}
+		m_key = path.substr(prefix.size());
+
+		auto size = req.headers().content_length();
+		if (!size) {
+			this->send_error(swarm::http_response::length_required, -EINVAL, "upload requires Content-Length header");
+			return;
+		}
+		m_size = *size;
+
+		ebucket::bucket b;
+		auto err = this->server()->bucket_processor()->get_bucket(m_size, b);
+		if (err) {
+			EBUCKET_LOG_ERROR("on_request: url: %s: could not find bucket for size: %llu, error: %s [%d]",
+					req.url().to_human_readable().c_str(), (unsigned long long)m_size,
+					err.message().c_str(), err.code());
+			this->send_error(swarm::http_response::service_unavailable, err.code(), err.message());
+			return;
+		}
+
+		EBUCKET_HOT_LOG_INFO("on_request: url: %s: key: %s, size: %llu, bucket: %s",
+			req.url().to_human_readable().c_str(), m_key.c_str(), (unsigned long long)m_size,
+			b->name().c_str());
+
+		m_bucket = b;
+		this->set_chunk_size(this->server()->upload_chunk_size());
+	}
+
+	virtual void on_chunk(const boost::asio::const_buffer &buffer, unsigned int flags) {
+		// reply has already been sent from @on_request()
+		if (!m_bucket)
+			return;
+
+		std::string data(boost::asio::buffer_cast<const char *>(buffer), boost::asio::buffer_size(buffer));
+		uint64_t offset = m_offset;
+		m_offset += data.size();
+		m_last = (flags & Base::last_chunk) != 0;
+
+		auto self = this->shared_from_this();
+		ebucket::storage_handler handler = [self] (const std::vector<ebucket::storage_result> &result,
+				const elliptics::error_info &error) {
+			self->on_write_completed(result, error);
+		};
+
+		if ((flags & Base::single_chunk) == Base::single_chunk) {
+			m_bucket->write(m_key, data, handler);
+		} else if (flags & Base::first_chunk) {
+			m_bucket->write_part(m_key, data, offset, m_size, ebucket::write_part_prepare, handler);
+		} else if (m_last) {
+			m_bucket->write_part(m_key, data, offset, m_offset, ebucket::write_part_commit, handler);
+		} else {
+			m_bucket->write_part(m_key, data, offset, 0, ebucket::write_part_plain, handler);
+		}
 	}
 
 	virtual void on_error(const boost::system::error_code &error) {
-		EBUCKET_LOG_ERROR("on_error: url: %s, error: %s",
-			this->request().url().to_human_readable().c_str(), error.message().c_str());
+		EBUCKET_LOG_ERROR("on_error: url: %s, key: %s, uploaded: %llu/%llu, error: %s",
+			this->request().url().to_human_readable().c_str(), m_key.c_str(),
+			(unsigned long long)m_offset, (unsigned long long)m_size, error.message().c_str());
 	}
 
 private:
-	void send_error(enum swarm::http_response::status_type status, int code, const std::string &message) {
+	typedef thevoid::buffered_request_stream<Server> Base;
+
+	std::string m_key;
+	uint64_t m_size = 0;
+	uint64_t m_offset = 0;
+	bool m_last = false;
+	ebucket::bucket m_bucket;
+
+	void on_write_completed(const std::vector<ebucket::storage_result> &result, const elliptics::error_info &error) {
+		elliptics::error_info err = error;
+		for (auto r = result.begin(), rend = result.end(); r != rend && !err; ++r) {
+			if (r->error)
+				err = r->error;
+		}
+		if (!err && result.empty())
+			err = elliptics::create_error(-ENXIO, "write has not returned any result");
+
+		if (err) {
+			EBUCKET_LOG_ERROR("on_write_completed: url: %s: key: %s, bucket: %s, offset: %llu, error: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_key.c_str(),
+					m_bucket->name().c_str(), (unsigned long long)m_offset,
+					err.message().c_str(), err.code());
+			this->send_error(swarm::http_response::service_unavailable, err.code(), err.message());
+			return;
+		}
+
+		if (!m_last) {
+			this->try_next_chunk();
+			return;
+		}
+
+		ebucket::bucket_meta meta = m_bucket->meta();
+
+		reply_format fmt = this->format();
+		if (fmt == reply_msgpack) {
+			msgpack::sbuffer buffer;
+			msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+			pk.pack_map(4);
+			pk.pack(std::string("bucket"));
+			pk.pack(meta.name);
+			pk.pack(std::string("groups"));
+			pk.pack(meta.groups);
+			pk.pack(std::string("key"));
+			pk.pack(m_key);
+			pk.pack(std::string("size"));
+			pk.pack(m_offset);
+
+			this->send_body(swarm::http_response::ok, fmt, std::string(buffer.data(), buffer.size()));
+			return;
+		}
+
 		JsonValue ret;
 		auto &allocator = ret.GetAllocator();
 
-		rapidjson::Value error(rapidjson::kObjectType);
-		rapidjson::Value message_val(message.c_str(), message.size(), allocator);
-		error.AddMember("message", message_val, allocator);
-		error.AddMember("code", code, allocator);
+		this->add_bucket(ret, meta, allocator);
+		rapidjson::Value key_val(m_key.c_str(), m_key.size(), allocator);
+		ret.AddMember("key", key_val, allocator);
+		ret.AddMember("size", m_offset, allocator);
+
+		this->send_json(swarm::http_response::ok, fmt, ret);
+	}
+};
 
-		ret.AddMember("error", error, allocator);
+template <typename Server>
+class on_upload : public on_upload_base<Server, on_upload<Server>>
+{
+public:
+};
+
+// Reads object through the server: GET /get/<bucket>/<key>
+//
+// Object is read from the storage and sent to the client chunk by chunk, the next chunk is only read
+// after the previous one has been sent, thus memory usage does not depend on the object size.
+// Single byte range is supported: "Range: bytes=<first>-[<last>]" or "Range: bytes=-<suffix length>",
+// multiple ranges and malformed Range headers are ignored and the whole object is sent.
+template <typename Server, typename Stream>
+class on_get_base : public on_request_base<Server, Stream> {
+public:
+	virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+		(void) buffer;
+
+		this->track("get");
+
+		static const std::string prefix = "/get/";
+		const std::string &path = req.url().path();
+		size_t pos = path.find('/', prefix.size());
+		if (path.compare(0, prefix.size(), prefix) != 0 || pos == std::string::npos ||
+				pos == prefix.size() || pos + 1 == path.size()) {
+			this->send_error(swarm::http_response::bad_request, -EINVAL, "url must be /get/<bucket>/<key>");
+			return;
+		}
 
-		std::string data = ret.ToString();
+		std::string bname = path.substr(prefix.size(), pos - prefix.size());
+		m_key = path.substr(pos + 1);
+
+		auto err = this->server()->bucket_processor()->find_bucket(bname, m_bucket);
+		if (err) {
+			this->send_error(swarm::http_response::not_found, err.code(), err.message());
+			return;
+		}
+
+		auto range = req.headers().get("Range");
+		if (range)
+			parse_range(*range);
+
+		EBUCKET_HOT_LOG_INFO("on_request: url: %s: bucket: %s, key: %s, range: %s",
+			req.url().to_human_readable().c_str(), bname.c_str(), m_key.c_str(),
+			range ? range->c_str() : "none");
+
+		// suffix range needs object size to find its start, the first byte of the object is read to get it
+		if (m_suffix) {
+			read(0, 1);
+			return;
+		}
+
+		read(m_first, chunk_size(m_first));
+	}
+
+private:
+	std::string m_key;
+	ebucket::bucket m_bucket;
+
+	bool m_range = false;
+	bool m_suffix = false;
+
+	// range boundaries, inclusive, @m_last is only valid after object size is known
+	uint64_t m_first = 0;
+	uint64_t m_last = UINT64_MAX;
+	uint64_t m_total = 0;
+
+	// offset of the next chunk to read
+	uint64_t m_offset = 0;
+	bool m_headers_sent = false;
+
+	void parse_range(const std::string &range) {
+		static const std::string prefix = "bytes=";
+		if (range.compare(0, prefix.size(), prefix) != 0 || range.find(',') != std::string::npos)
+			return;
+
+		std::string spec = range.substr(prefix.size());
+		size_t dash = spec.find('-');
+		if (dash == std::string::npos)
+			return;
+
+		std::string first = spec.substr(0, dash);
+		std::string last = spec.substr(dash + 1);
+
+		try {
+			size_t pos = 0;
+
+			if (first.empty()) {
+				if (last.empty())
+					return;
+
+				m_last = std::stoull(last, &pos);
+				if (pos != last.size())
+					return;
+
+				m_suffix = true;
+			} else {
+				m_first = std::stoull(first, &pos);
+				if (pos != first.size())
+					return;
+
+				if (!last.empty()) {
+					m_last = std::stoull(last, &pos);
+					if (pos != last.size() || m_last < m_first)
+						return;
+				}
+			}
+		} catch (const std::exception &) {
+			m_first = 0;
+			m_last = UINT64_MAX;
+			m_suffix = false;
+			return;
+		}
+
+		m_range = true;
+	}
+
+	uint64_t chunk_size(uint64_t offset) {
+		uint64_t size = this->server()->read_chunk_size();
+		if (m_last != UINT64_MAX && m_last - offset + 1 < size)
+			size = m_last - offset + 1;
+
+		return size;
+	}
+
+	void read(uint64_t offset, uint64_t size) {
+		m_offset = offset;
+
+		auto self = this->shared_from_this();
+		m_bucket->read_part(m_key, offset, size,
+			[self] (const std::vector<ebucket::storage_result> &result, const elliptics::error_info &error) {
+				self->on_read_completed(result, error);
+			});
+	}
+
+	void on_read_completed(const std::vector<ebucket::storage_result> &result, const elliptics::error_info &error) {
+		const ebucket::storage_result *res = NULL;
+		for (auto r = result.begin(), rend = result.end(); r != rend; ++r) {
+			if (!r->error) {
+				res = &(*r);
+				break;
+			}
+		}
+
+		if (!res) {
+			elliptics::error_info err = error ? error :
+				elliptics::create_error(-ENXIO, "read has not returned any result");
+			on_read_error(err);
+			return;
+		}
+
+		if (!m_headers_sent) {
+			if (!start_reply(*res))
+				return;
+
+			if (m_suffix) {
+				read(m_first, chunk_size(m_first));
+				return;
+			}
+		}
+
+		// object has been changed or truncated while it is being sent
+		uint64_t expected = chunk_size(m_offset);
+		if (res->data.size() != expected) {
+			EBUCKET_LOG_ERROR("on_read_completed: url: %s: key: %s, offset: %llu, read: %zd, expected: %llu",
+					this->request().url().to_human_readable().c_str(), m_key.c_str(),
+					(unsigned long long)m_offset, res->data.size(), (unsigned long long)expected);
+			this->close(boost::system::errc::make_error_code(boost::system::errc::io_error));
+			return;
+		}
+
+		send(res->data);
+	}
+
+	// sends reply headers once object size is known, returns false if reply has been completed
+	bool start_reply(const ebucket::storage_result &res) {
+		m_total = res.total_size;
+
+		if (m_suffix) {
+			if (m_last == 0) {
+				send_unsatisfiable();
+				return false;
+			}
+
+			m_first = m_total > m_last ? m_total - m_last : 0;
+			m_last = UINT64_MAX;
+		}
+
+		if (m_total == 0 || m_first >= m_total) {
+			if (m_range) {
+				send_unsatisfiable();
+				return false;
+			}
+		}
+
+		if (m_last == UINT64_MAX || m_last >= m_total)
+			m_last = m_total ? m_total - 1 : 0;
 
 		thevoid::http_response reply;
-		reply.set_code(status);
-		reply.headers().set_content_type("text/json; charset=utf-8");
+		reply.headers().set_content_type("application/octet-stream");
+		reply.headers().set("Accept-Ranges", "bytes");
+
+		if (m_range) {
+			reply.set_code(swarm::http_response::partial_content);
+			reply.headers().set("Content-Range", "bytes " + std::to_string(m_first) + "-" +
+					std::to_string(m_last) + "/" + std::to_string(m_total));
+			reply.headers().set_content_length(m_last - m_first + 1);
+		} else {
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_length(m_total);
+		}
+
+		m_headers_sent = true;
+
+		if (m_total == 0) {
+			this->send_reply(std::move(reply));
+			return false;
+		}
+
+		auto self = this->shared_from_this();
+		this->send_headers(std::move(reply), [self] (const boost::system::error_code &error) {
+				if (error)
+					self->close(error);
+			});
+
+		return true;
+	}
+
+	void send(const std::string &data) {
+		std::shared_ptr<std::string> chunk = std::make_shared<std::string>(data);
+		uint64_t next = m_offset + chunk->size();
+
+		auto self = this->shared_from_this();
+		this->send_data(boost::asio::const_buffer(chunk->data(), chunk->size()),
+			[self, chunk, next] (const boost::system::error_code &error) {
+				self->on_data_sent(next, error);
+			});
+	}
+
+	void on_data_sent(uint64_t next, const boost::system::error_code &error) {
+		if (error || next > m_last) {
+			this->close(error);
+			return;
+		}
+
+		read(next, chunk_size(next));
+	}
+
+	void on_read_error(const elliptics::error_info &err) {
+		EBUCKET_LOG_ERROR("on_read_completed: url: %s: key: %s, bucket: %s, offset: %llu, error: %s [%d]",
+				this->request().url().to_human_readable().c_str(), m_key.c_str(),
+				m_bucket->name().c_str(), (unsigned long long)m_offset,
+				err.message().c_str(), err.code());
+
+		if (m_headers_sent) {
+			this->close(boost::system::errc::make_error_code(boost::system::errc::io_error));
+			return;
+		}
+
+		if (err.code() == -E2BIG && m_range) {
+			send_unsatisfiable();
+			return;
+		}
+
+		if (err.code() == -ENOENT) {
+			this->send_error(swarm::http_response::not_found, err.code(), err.message());
+			return;
+		}
+
+		this->send_error(swarm::http_response::service_unavailable, err.code(), err.message());
+	}
+
+	void send_unsatisfiable() {
+		thevoid::http_response reply;
+		reply.set_code(swarm::http_response::requested_range_not_satisfiable);
+		if (m_total)
+			reply.headers().set("Content-Range", "bytes */" + std::to_string(m_total));
+		reply.headers().set_content_length(0);
+
+		this->send_reply(std::move(reply));
+	}
+};
+
+template <typename Server>
+class on_get : public on_get_base<Server, on_get<Server>>
+{
+public:
+};
+
+// Returns the last published processor snapshot: per-bucket validity, groups,
+// cached weight, free space, quota usage, failure domains and per-group backend statistics, as well as statistics age.
+// Snapshot is read without processor or bucket locks.
+template <typename Server, typename Stream>
+class on_stat_base : public on_request_base<Server, Stream> {
+public:
+	virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+		(void) req;
+		(void) buffer;
+
+		this->track("stat");
+
+		std::shared_ptr<const ebucket::processor_state> st = this->server()->bucket_processor()->state();
+
+		auto now = std::chrono::system_clock::now();
+		double stat_age = std::chrono::duration_cast<std::chrono::duration<double>>(now - st->stat_time).count();
+		double meta_age = std::chrono::duration_cast<std::chrono::duration<double>>(now - st->meta_time).count();
+
+		reply_format fmt = this->format();
+		if (fmt == reply_msgpack) {
+			msgpack::sbuffer buffer;
+			msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+			pk.pack_map(3);
+			pk.pack(std::string("stat_age"));
+			pk.pack(stat_age);
+			pk.pack(std::string("meta_age"));
+			pk.pack(meta_age);
+
+			pk.pack(std::string("buckets"));
+			pk.pack_array(st->buckets->size());
+			for (auto it = st->buckets->begin(), end = st->buckets->end(); it != end; ++it) {
+				pk.pack_map(9);
+				pk.pack(std::string("name"));
+				pk.pack(it->name);
+				pk.pack(std::string("valid"));
+				pk.pack(it->valid);
+				pk.pack(std::string("groups"));
+				pk.pack(it->groups);
+				pk.pack(std::string("weight"));
+				pk.pack(it->weight);
+				pk.pack(std::string("avail"));
+				pk.pack(it->avail);
+				pk.pack(std::string("used_size"));
+				pk.pack(it->used_size);
+				pk.pack(std::string("used_keys"));
+				pk.pack(it->used_keys);
+				pk.pack(std::string("domains"));
+				pk.pack(it->domains);
+
+				pk.pack(std::string("backends"));
+				pk.pack_array(it->stat.backends.size());
+				for (auto b = it->stat.backends.begin(), bend = it->stat.backends.end(); b != bend; ++b) {
+					pack_backend(pk, b->second);
+				}
+			}
+
+			this->send_body(swarm::http_response::ok, fmt, std::string(buffer.data(), buffer.size()));
+			return;
+		}
+
+		JsonValue ret;
+		auto &allocator = ret.GetAllocator();
+
+		ret.AddMember("stat_age", stat_age, allocator);
+		ret.AddMember("meta_age", meta_age, allocator);
+
+		rapidjson::Value buckets_val(rapidjson::kArrayType);
+		for (auto it = st->buckets->begin(), end = st->buckets->end(); it != end; ++it) {
+			rapidjson::Value obj(rapidjson::kObjectType);
+
+			rapidjson::Value name_val(it->name.c_str(), it->name.size(), allocator);
+			obj.AddMember("name", name_val, allocator);
+			obj.AddMember("valid", it->valid, allocator);
+
+			rapidjson::Value groups_val(rapidjson::kArrayType);
+			for (auto group: it->groups) {
+				groups_val.PushBack(group, allocator);
+			}
+			obj.AddMember("groups", groups_val, allocator);
+
+			obj.AddMember("weight", (double)it->weight, allocator);
+			obj.AddMember("avail", (uint64_t)it->avail, allocator);
+			obj.AddMember("used_size", (uint64_t)it->used_size, allocator);
+			obj.AddMember("used_keys", (uint64_t)it->used_keys, allocator);
+
+			rapidjson::Value domains_val(rapidjson::kArrayType);
+			for (auto d = it->domains.begin(), dend = it->domains.end(); d != dend; ++d) {
+				rapidjson::Value domain_val(d->c_str(), d->size(), allocator);
+				domains_val.PushBack(domain_val, allocator);
+			}
+			obj.AddMember("domains", domains_val, allocator);
+
+			rapidjson::Value backends_val(rapidjson::kArrayType);
+			for (auto b = it->stat.backends.begin(), bend = it->stat.backends.end(); b != bend; ++b) {
+				rapidjson::Value backend_val(rapidjson::kObjectType);
+				add_backend(backend_val, b->second, allocator);
+				backends_val.PushBack(backend_val, allocator);
+			}
+			obj.AddMember("backends", backends_val, allocator);
+
+			buckets_val.PushBack(obj, allocator);
+		}
+		ret.AddMember("buckets", buckets_val, allocator);
+
+		this->send_json(swarm::http_response::ok, fmt, ret);
+	}
+
+private:
+	template <typename Packer>
+	static void pack_backend(Packer &pk, const ebucket::backend_stat &bs) {
+		pk.pack_map(11);
+		pk.pack(std::string("addr"));
+		pk.pack(std::string(dnet_addr_string(&bs.addr)));
+		pk.pack(std::string("backend_id"));
+		pk.pack(bs.backend_id);
+		pk.pack(std::string("group"));
+		pk.pack(bs.group);
+		pk.pack(std::string("state"));
+		pk.pack(bs.state);
+		pk.pack(std::string("ro"));
+		pk.pack(bs.ro);
+		pk.pack(std::string("start_error"));
+		pk.pack(bs.start_error);
+		pk.pack(std::string("defrag_state"));
+		pk.pack(bs.defrag_state);
+		pk.pack(std::string("health"));
+		pk.pack(bs.health);
+
+		pk.pack(std::string("size"));
+		pk.pack_map(3);
+		pk.pack(std::string("limit"));
+		pk.pack(bs.size.limit);
+		pk.pack(std::string("used"));
+		pk.pack(bs.size.used);
+		pk.pack(std::string("removed"));
+		pk.pack(bs.size.removed);
+
+		pk.pack(std::string("vfs"));
+		pk.pack_map(2);
+		pk.pack(std::string("avail"));
+		pk.pack(bs.vfs.avail);
+		pk.pack(std::string("total"));
+		pk.pack(bs.vfs.total);
+
+		pk.pack(std::string("records"));
+		pk.pack_map(3);
+		pk.pack(std::string("total"));
+		pk.pack(bs.records.total);
+		pk.pack(std::string("removed"));
+		pk.pack(bs.records.removed);
+		pk.pack(std::string("corrupted"));
+		pk.pack(bs.records.corrupted);
+	}
+
+	static void add_backend(rapidjson::Value &obj, const ebucket::backend_stat &bs, rapidjson::MemoryPoolAllocator<> &allocator) {
+		const char *addr = dnet_addr_string(&bs.addr);
+		rapidjson::Value addr_val(addr, strlen(addr), allocator);
+		obj.AddMember("addr", addr_val, allocator);
+		obj.AddMember("backend_id", bs.backend_id, allocator);
+		obj.AddMember("group", bs.group, allocator);
+		obj.AddMember("state", bs.state, allocator);
+		obj.AddMember("ro", bs.ro, allocator);
+		obj.AddMember("start_error", bs.start_error, allocator);
+		obj.AddMember("defrag_state", bs.defrag_state, allocator);
+		obj.AddMember("health", (double)bs.health, allocator);
+
+		rapidjson::Value size_val(rapidjson::kObjectType);
+		size_val.AddMember("limit", (uint64_t)bs.size.limit, allocator);
+		size_val.AddMember("used", (uint64_t)bs.size.used, allocator);
+		size_val.AddMember("removed", (uint64_t)bs.size.removed, allocator);
+		obj.AddMember("size", size_val, allocator);
+
+		rapidjson::Value vfs_val(rapidjson::kObjectType);
+		vfs_val.AddMember("avail", (uint64_t)bs.vfs.avail, allocator);
+		vfs_val.AddMember("total", (uint64_t)bs.vfs.total, allocator);
+		obj.AddMember("vfs", vfs_val, allocator);
+
+		rapidjson::Value records_val(rapidjson::kObjectType);
+		records_val.AddMember("total", (uint64_t)bs.records.total, allocator);
+		records_val.AddMember("removed", (uint64_t)bs.records.removed, allocator);
+		records_val.AddMember("corrupted", (uint64_t)bs.records.corrupted, allocator);
+		obj.AddMember("records", records_val, allocator);
+	}
+};
+
+template <typename Server>
+class on_stat : public on_stat_base<Server, on_stat<Server>>
+{
+public:
+};
+
+// Exports processor and server metrics in Prometheus text format
+template <typename Server, typename Stream>
+class on_metrics_base : public on_request_base<Server, Stream> {
+public:
+	virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+		(void) req;
+		(void) buffer;
+
+		this->track("metrics");
+
+		std::string data = this->server()->bucket_processor()->metrics().prometheus() +
+			ebucket::lock_metrics().prometheus();
+
+		thevoid::http_response reply;
+		reply.set_code(swarm::http_response::ok);
+		reply.headers().set_content_type("text/plain; version=0.0.4");
 		reply.headers().set_content_length(data.size());
 
 		this->send_reply(std::move(reply), std::move(data));
@@ -148,12 +1093,11 @@ private:
 };
 
 template <typename Server>
-class on_bucket : public on_bucket_base<Server, on_bucket<Server>>
+class on_metrics : public on_metrics_base<Server, on_metrics<Server>>
 {
 public:
 };
 
-
 class ebucket_server : public thevoid::server<ebucket_server>
 {
 public:
@@ -163,6 +1107,39 @@ public:
 		if (!elliptics_init(config))
 			return false;
 
+		const char *handlers[] = {"bucket", "buckets", "upload", "get", "stat", "metrics"};
+		for (size_t i = 0; i < ARRAY_SIZE(handlers); ++i) {
+			m_http_hists[handlers[i]] = &m_bp->metrics().histogram("ebucket_http_request_seconds",
+					"HTTP request handling time including reply transmission",
+					std::string("handler=\"") + handlers[i] + "\"");
+		}
+
+		on<on_metrics<ebucket_server>>(
+			options::exact_match("/metrics"),
+			options::methods("GET")
+		);
+
+		on<on_stat<ebucket_server>>(
+			options::exact_match("/stat"),
+			options::methods("GET")
+		);
+
+		// must be registered before "/bucket" prefix handler
+		on<on_buckets<ebucket_server>>(
+			options::exact_match("/buckets"),
+			options::methods("GET", "POST")
+		);
+
+		on<on_upload<ebucket_server>>(
+			options::prefix_match("/upload/"),
+			options::methods("PUT")
+		);
+
+		on<on_get<ebucket_server>>(
+			options::prefix_match("/get/"),
+			options::methods("GET")
+		);
+
 		on<on_bucket<ebucket_server>>(
 			options::prefix_match("/bucket"),
 			options::methods("GET")
@@ -175,13 +1152,44 @@ public:
 		return m_bp;
 	}
 
+	size_t max_batch_size() const {
+		return m_max_batch_size;
+	}
+
+	size_t upload_chunk_size() const {
+		return m_upload_chunk_size;
+	}
+
+	size_t read_chunk_size() const {
+		return m_read_chunk_size;
+	}
+
+	ebucket::latency_histogram *http_histogram(const std::string &handler) const {
+		auto it = m_http_hists.find(handler);
+		if (it == m_http_hists.end())
+			return NULL;
+
+		return it->second;
+	}
+
 private:
 	std::shared_ptr<elliptics::node> m_node;
 	std::shared_ptr<ebucket::bucket_processor> m_bp;
 
+	// handler name -> latency histogram, filled at initialization and never modified afterwards
+	std::map<std::string, ebucket::latency_histogram *> m_http_hists;
+
 	long m_read_timeout = 60;
 	long m_write_timeout = 60;
 
+	size_t m_max_batch_size = 10000;
+
+	// every upload keeps at most one chunk of this size in memory
+	size_t m_upload_chunk_size = 10 * 1024 * 1024;
+
+	// every read keeps at most one chunk of this size in memory
+	size_t m_read_chunk_size = 10 * 1024 * 1024;
+
 	bool elliptics_init(const rapidjson::Value &config) {
 		dnet_config node_config;
 		memset(&node_config, 0, sizeof(node_config));
@@ -200,12 +1208,14 @@ private:
 			return false;
 		}
 
-		m_bp.reset(new ebucket::bucket_processor(m_node));
-
 		if (!prepare_session(config)) {
 			return false;
 		}
 
+		std::shared_ptr<ebucket::elliptics_storage> st = std::make_shared<ebucket::elliptics_storage>(m_node);
+		st->set_timeouts(m_read_timeout, m_write_timeout);
+		m_bp.reset(new ebucket::bucket_processor(st));
+
 		if (!prepare_buckets(config)) {
 			return false;
 		}
@@ -287,6 +1297,51 @@ private:
 				mgroups.push_back(it->GetInt());
 		}
 
+		// time constant in milliseconds of the bucket weight transition after statistics update,
+		// weights jump to the new values if it is not set
+		if (config.HasMember("weight-smoothing")) {
+			auto &ws = config["weight-smoothing"];
+			if (ws.IsUint()) {
+				ebucket::weight_smoothing smoothing;
+				smoothing.rise = std::chrono::milliseconds(ws.GetUint());
+				smoothing.fall = std::chrono::milliseconds(ws.GetUint());
+				m_bp->set_weight_smoothing(smoothing);
+			}
+		}
+
+		// quota usage is taken from backend statistics only if backends are dedicated to buckets,
+		// otherwise it is accounted from writes made through this server
+		m_bp->set_quota_stat_usage(ebucket::get_bool(config, "quota-stat-usage", false));
+
+		// two-level selection over failure domains:
+		// "failure-domains": {"hosts": {"<host address>": "<domain>"}, "groups": {"<group>": "<domain>"}}
+		// unlisted groups belong to the domain of their backend host
+		if (config.HasMember("failure-domains")) {
+			auto &fd_val = config["failure-domains"];
+			if (fd_val.IsObject()) {
+				ebucket::failure_domains fd;
+				fd.enabled = true;
+
+				if (fd_val.HasMember("hosts") && fd_val["hosts"].IsObject()) {
+					auto &hosts = fd_val["hosts"];
+					for (auto it = hosts.MemberBegin(), end = hosts.MemberEnd(); it != end; ++it) {
+						if (it->value.IsString())
+							fd.hosts[it->name.GetString()] = it->value.GetString();
+					}
+				}
+
+				if (fd_val.HasMember("groups") && fd_val["groups"].IsObject()) {
+					auto &groups = fd_val["groups"];
+					for (auto it = groups.MemberBegin(), end = groups.MemberEnd(); it != end; ++it) {
+						if (it->value.IsString())
+							fd.groups[atoi(it->name.GetString())] = it->value.GetString();
+					}
+				}
+
+				m_bp->set_failure_domains(fd);
+			}
+		}
+
 		if (!config.HasMember("buckets") && !config.HasMember("buckets_key")) {
 			EBUCKET_LOG_ERROR("neither \"application.buckets\" nor \"application.bucket_key\" fields is present");
 			return false;
@@ -313,12 +1368,38 @@ private:
 			return false;
 		}
 
+		// placement trace for offline simulations, see ebucket_simulator
+		const char *trace_file = ebucket::get_string(config, "trace-file");
+		if (trace_file && *trace_file) {
+			if (!m_bp->start_trace(trace_file))
+				return false;
+		}
 
 		return true;
 	}
 
 	bool prepare_server(const rapidjson::Value &config) {
-		(void) config;
+		// lock statistics costs two clock reads per lock acquisition, it is disabled by default
+		ebucket::set_lock_stats(ebucket::get_bool(config, "lock-stats", false));
+
+		if (config.HasMember("max-batch-size")) {
+			auto &mbs = config["max-batch-size"];
+			if (mbs.IsUint())
+				m_max_batch_size = mbs.GetUint();
+		}
+
+		if (config.HasMember("upload-chunk-size")) {
+			auto &ucs = config["upload-chunk-size"];
+			if (ucs.IsUint() && ucs.GetUint() > 0)
+				m_upload_chunk_size = ucs.GetUint();
+		}
+
+		if (config.HasMember("read-chunk-size")) {
+			auto &rcs = config["read-chunk-size"];
+			if (rcs.IsUint() && rcs.GetUint() > 0)
+				m_read_chunk_size = rcs.GetUint();
+		}
+
 		return true;
 	}
 };
@@ -0,0 +1,357 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+#include "ebucket/bucket.hpp"
+#include "ebucket/memory_storage.hpp"
+#include "ebucket/trace.hpp"
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+// Replays placement trace recorded by bucket_processor::start_trace() against different
+// selection policies and projects how groups would have been filled.
+//
+// Statistics records bring real group usage, every replayed selection adds its size to the groups
+// of the bucket chosen by the policy and subtracts it from the groups of the bucket which was chosen in production,
+// thus projected usage is real usage plus the difference between simulated and real placements.
+// Bucket weights are recalculated only at statistics records, like bucket processor does.
+//
+// Policies:
+//  * recorded - replays production choices, projected usage equals real usage
+//  * weight - raw_bucket::weight() logic with weighted random selection, what bucket processor does
+//  * uniform - uniform random selection among buckets with non-zero weight
+//  * most-free - bucket with the largest minimal free space among its backends
+
+struct sim_bucket {
+	ebucket::bucket		b;
+	std::vector<int>	groups;
+};
+
+struct sim_group {
+	ebucket::backend_stat	real;
+	bool			present = false;
+
+	// simulated minus real bytes placed into this group
+	int64_t			delta = 0;
+
+	ebucket::backend_stat projected() const {
+		ebucket::backend_stat bs = real;
+
+		int64_t used = (int64_t)real.size.used + delta;
+		if (used < 0)
+			used = 0;
+		bs.size.used = used;
+
+		return bs;
+	}
+};
+
+class simulation {
+public:
+	simulation(std::shared_ptr<ebucket::storage> st, const std::string &policy, uint64_t seed) :
+	m_storage(st), m_policy(policy), m_rng(seed) {}
+
+	void process(const ebucket::trace_record &rec) {
+		if (m_start == 0)
+			m_start = rec.time;
+		m_time = rec.time;
+
+		switch (rec.type) {
+		case ebucket::trace_record::bucket:
+			add_bucket(rec);
+			break;
+		case ebucket::trace_record::stat:
+			update_stat(rec);
+			break;
+		case ebucket::trace_record::select:
+			select(rec);
+			break;
+		}
+	}
+
+	void report(std::ostream &out) const {
+		double min = 0, max = 0, sum = 0, sum2 = 0;
+		size_t num = 0;
+
+		for (auto it = m_groups.begin(), end = m_groups.end(); it != end; ++it) {
+			double f = fill(it->second);
+			if (f < 0)
+				continue;
+
+			if (num == 0 || f < min)
+				min = f;
+			if (num == 0 || f > max)
+				max = f;
+
+			sum += f;
+			sum2 += f * f;
+			num++;
+		}
+
+		double mean = num ? sum / num : 0;
+		double stddev = num ? std::sqrt(std::max(0.0, sum2 / num - mean * mean)) : 0;
+
+		out << "policy: " << m_policy <<
+			", time: " << (m_time - m_start) / 1000000 << " s" <<
+			", selections: " << m_selections <<
+			", failed: " << m_failed <<
+			", placed: " << m_placed << " bytes" <<
+			", groups: " << num <<
+			", fill: min: " << min * 100 << "%" <<
+			", mean: " << mean * 100 << "%" <<
+			", max: " << max * 100 << "%" <<
+			", stddev: " << stddev * 100 << "%" <<
+			std::endl;
+	}
+
+	void report_groups(std::ostream &out) const {
+		for (auto it = m_groups.begin(), end = m_groups.end(); it != end; ++it) {
+			double f = fill(it->second);
+			if (f < 0)
+				continue;
+
+			ebucket::backend_stat bs = it->second.projected();
+			out << "policy: " << m_policy <<
+				", group: " << it->first <<
+				", limit: " << bs.size.limit <<
+				", used: " << bs.size.used <<
+				", fill: " << f * 100 << "%" <<
+				std::endl;
+		}
+	}
+
+	uint64_t elapsed() const {
+		return m_time - m_start;
+	}
+
+private:
+	std::shared_ptr<ebucket::storage> m_storage;
+	std::string m_policy;
+	std::mt19937_64 m_rng;
+
+	uint64_t m_start = 0;
+	uint64_t m_time = 0;
+
+	size_t m_selections = 0;
+	size_t m_failed = 0;
+	uint64_t m_placed = 0;
+
+	std::map<std::string, sim_bucket> m_buckets;
+	std::map<int, sim_group> m_groups;
+	bool m_stats_dirty = false;
+
+	// returns negative value if there is no statistics for given group
+	static double fill(const sim_group &g) {
+		if (!g.present || g.real.size.limit == 0)
+			return -1;
+
+		ebucket::backend_stat bs = g.projected();
+		return (double)bs.size.used / (double)bs.size.limit;
+	}
+
+	void add_bucket(const ebucket::trace_record &rec) {
+		ebucket::bucket_meta meta;
+		meta.name = rec.name;
+		meta.groups = rec.groups;
+
+		sim_bucket &sb = m_buckets[rec.name];
+		sb.b = ebucket::make_bucket(m_storage, meta);
+		sb.groups = rec.groups;
+
+		apply_stats(sb);
+	}
+
+	void update_stat(const ebucket::trace_record &rec) {
+		int group = rec.bs.group;
+
+		sim_group &g = m_groups[group];
+		g.present = rec.bs.size.limit != 0;
+		g.real = rec.bs;
+
+		// statistics records of one update go one after another, weights are recalculated
+		// once per update before the next selection
+		m_stats_dirty = true;
+	}
+
+	void apply_stats(sim_bucket &sb) {
+		for (auto g = sb.groups.begin(), gend = sb.groups.end(); g != gend; ++g) {
+			auto it = m_groups.find(*g);
+			if (it == m_groups.end() || !it->second.present) {
+				sb.b->clear_backend_stat(*g);
+				continue;
+			}
+
+			sb.b->set_backend_stat(*g, it->second.projected());
+		}
+	}
+
+	void select(const ebucket::trace_record &rec) {
+		m_selections++;
+
+		// weights of all buckets are recalculated using projected usage, even buckets
+		// whose groups were not updated, their projected usage changes with simulated placements
+		if (m_stats_dirty) {
+			for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
+				apply_stats(it->second);
+			}
+			m_stats_dirty = false;
+		}
+
+		// space used in production will appear in the next statistics records, it must not be counted twice
+		auto real = m_buckets.find(rec.name);
+		if (real != m_buckets.end()) {
+			for (auto g = real->second.groups.begin(), gend = real->second.groups.end(); g != gend; ++g) {
+				m_groups[*g].delta -= rec.size;
+			}
+		}
+
+		const sim_bucket *chosen = choose(rec);
+		if (!chosen) {
+			m_failed++;
+			return;
+		}
+
+		for (auto g = chosen->groups.begin(), gend = chosen->groups.end(); g != gend; ++g) {
+			m_groups[*g].delta += rec.size;
+		}
+		m_placed += rec.size;
+	}
+
+	const sim_bucket *choose(const ebucket::trace_record &rec) {
+		if (m_policy == "recorded") {
+			auto it = m_buckets.find(rec.name);
+			return it == m_buckets.end() ? NULL : &it->second;
+		}
+
+		std::vector<const sim_bucket *> cands;
+		std::vector<float> weights;
+		float sum = 0;
+
+		for (auto it = m_buckets.begin(), end = m_buckets.end(); it != end; ++it) {
+			if (!it->second.b->valid())
+				continue;
+
+			float w = it->second.b->weight(rec.size);
+			if (w <= 0)
+				continue;
+
+			cands.push_back(&it->second);
+			weights.push_back(w);
+			sum += w;
+		}
+
+		if (cands.empty())
+			return NULL;
+
+		if (m_policy == "uniform") {
+			std::uniform_int_distribution<size_t> dist(0, cands.size() - 1);
+			return cands[dist(m_rng)];
+		}
+
+		if (m_policy == "most-free") {
+			const sim_bucket *best = cands[0];
+			for (auto it = cands.begin(), end = cands.end(); it != end; ++it) {
+				if ((*it)->b->avail() > best->b->avail())
+					best = *it;
+			}
+
+			return best;
+		}
+
+		// weight
+		std::uniform_real_distribution<float> dist(0, sum);
+		float rnd = dist(m_rng);
+		for (size_t i = 0; i < cands.size(); ++i) {
+			rnd -= weights[i];
+			if (rnd < 0)
+				return cands[i];
+		}
+
+		return cands.back();
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	std::string trace_file;
+	std::vector<std::string> policies;
+	uint64_t report_interval, seed;
+
+	bpo::options_description generic("Placement trace simulator options");
+	generic.add_options()
+		("help", "this help message")
+		("trace", bpo::value<std::string>(&trace_file)->required(), "placement trace file")
+		("policy", bpo::value<std::vector<std::string>>(&policies)->composing(),
+			"selection policy: recorded, weight, uniform, most-free, can be specified multiple times, "
+			"all policies are simulated by default")
+		("report-interval", bpo::value<uint64_t>(&report_interval)->default_value(3600),
+			"report projected fill every this number of seconds of the trace time")
+		("seed", bpo::value<uint64_t>(&seed)->default_value(0), "random generator seed")
+		("groups", "report projected fill of every group at the end of the trace")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	std::vector<std::string> known = {"recorded", "weight", "uniform", "most-free"};
+	if (policies.empty())
+		policies = known;
+
+	for (auto p = policies.begin(), pend = policies.end(); p != pend; ++p) {
+		if (std::find(known.begin(), known.end(), *p) == known.end()) {
+			std::cerr << "Invalid policy: " << *p << "\n" << generic << std::endl;
+			return -1;
+		}
+	}
+
+	// simulated buckets are created with known metadata, storage is never accessed
+	elliptics::file_logger log("/dev/null", DNET_LOG_ERROR);
+	std::shared_ptr<ebucket::storage> st = std::make_shared<ebucket::memory_storage>(
+			elliptics::logger(log, blackhole::log::attributes_t()), 0);
+
+	for (auto p = policies.begin(), pend = policies.end(); p != pend; ++p) {
+		simulation sim(st, *p, seed);
+		uint64_t next_report = report_interval * 1000000;
+
+		try {
+			ebucket::trace_reader reader(trace_file);
+
+			ebucket::trace_record rec;
+			while (reader.next(rec)) {
+				sim.process(rec);
+
+				if (report_interval && sim.elapsed() >= next_report) {
+					sim.report(std::cout);
+					next_report += report_interval * 1000000;
+				}
+			}
+		} catch (const std::exception &e) {
+			std::cerr << "policy: " << *p << ": could not replay trace: " << e.what() << std::endl;
+			return -1;
+		}
+
+		sim.report(std::cout);
+		if (vm.count("groups"))
+			sim.report_groups(std::cout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#include "ebucket/bucket_processor.hpp"
+#include "ebucket/log.hpp"
+
+#include <benchmark/benchmark.h>
+
+using namespace ioremap;
+
+// Offline microbenchmarks, there is no need in elliptics cluster:
+// buckets are created from synthetic metadata and get synthetic backend statistics,
+// node has no remotes, thus statistics updates in background thread fail fast
+// and do not change synthetic state.
+
+#ifndef EBUCKET_FIXTURES_DIR
+#define EBUCKET_FIXTURES_DIR "fixtures"
+#endif
+
+static std::shared_ptr<elliptics::node> bench_node()
+{
+	static std::mutex lock;
+	static std::shared_ptr<elliptics::node> node;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (!node) {
+		static elliptics::file_logger log("/dev/null", DNET_LOG_ERROR);
+		node.reset(new elliptics::node(elliptics::logger(log, blackhole::log::attributes_t())));
+	}
+
+	return node;
+}
+
+static ebucket::bucket_meta bench_meta(int idx, int groups_num)
+{
+	ebucket::bucket_meta meta;
+	meta.name = "bench-bucket-" + std::to_string(idx);
+	for (int i = 0; i < groups_num; ++i) {
+		meta.groups.push_back(idx * groups_num + i + 1);
+	}
+
+	return meta;
+}
+
+static ebucket::backend_stat bench_stat(int group)
+{
+	ebucket::backend_stat bs;
+	memset(&bs.addr, 0, sizeof(bs.addr));
+
+	bs.backend_id = group;
+	bs.group = group;
+	bs.state = DNET_BACKEND_ENABLED;
+	bs.ro = false;
+
+	// spread used space over [10%, 85%) of the limit, so that weights differ
+	bs.size.limit = 1ULL << 40;
+	bs.size.used = bs.size.limit / 100 * (10 + (group * 37) % 75);
+	bs.size.removed = bs.size.used / 10;
+
+	bs.records.total = 1000000;
+	bs.records.removed = 100000;
+
+	return bs;
+}
+
+static ebucket::bucket bench_bucket(int idx)
+{
+	std::shared_ptr<elliptics::node> node = bench_node();
+	ebucket::bucket b = ebucket::make_bucket(node, bench_meta(idx, 3));
+
+	const ebucket::bucket_meta &meta = b->meta();
+	for (auto group: meta.groups) {
+		b->set_backend_stat(group, bench_stat(group));
+	}
+
+	return b;
+}
+
+// processors are shared by all threads of the same benchmark, they are created
+// on the first use and live until the process exits
+static ebucket::bucket_processor &bench_processor(int buckets_num)
+{
+	static std::mutex lock;
+	static std::map<int, std::shared_ptr<ebucket::bucket_processor>> processors;
+
+	std::lock_guard<std::mutex> guard(lock);
+	std::shared_ptr<ebucket::bucket_processor> &bp = processors[buckets_num];
+	if (!bp) {
+		std::vector<ebucket::bucket> buckets;
+		buckets.reserve(buckets_num);
+		for (int i = 0; i < buckets_num; ++i) {
+			buckets.push_back(bench_bucket(i));
+		}
+
+		bp = std::make_shared<ebucket::bucket_processor>(bench_node());
+		bp->init(buckets);
+	}
+
+	return *bp;
+}
+
+static void BM_get_bucket(benchmark::State &state)
+{
+	ebucket::bucket_processor &bp = bench_processor(state.range(0));
+
+	size_t size = 1024 * 1024;
+	while (state.KeepRunning()) {
+		ebucket::bucket b;
+		elliptics::error_info err = bp.get_bucket(size, b);
+		if (err) {
+			state.SkipWithError(err.message().c_str());
+			break;
+		}
+
+		benchmark::DoNotOptimize(b);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_get_bucket)->RangeMultiplier(10)->Range(10, 100000)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_bucket_weight_cached(benchmark::State &state)
+{
+	ebucket::bucket b = bench_bucket(1);
+
+	uint64_t size = 0;
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(b->weight(size++));
+	}
+}
+BENCHMARK(BM_bucket_weight_cached);
+
+static void BM_bucket_weight_full(benchmark::State &state)
+{
+	ebucket::bucket b = bench_bucket(1);
+	ebucket::limits l;
+
+	uint64_t size = 0;
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(b->weight(size++, l));
+	}
+}
+BENCHMARK(BM_bucket_weight_full);
+
+static void BM_bucket_meta_pack(benchmark::State &state)
+{
+	ebucket::bucket_meta meta = bench_meta(1, state.range(0));
+
+	while (state.KeepRunning()) {
+		msgpack::sbuffer buffer;
+		msgpack::pack(buffer, meta);
+		benchmark::DoNotOptimize(buffer.data());
+	}
+}
+BENCHMARK(BM_bucket_meta_pack)->Arg(3)->Arg(16);
+
+static void BM_bucket_meta_unpack(benchmark::State &state)
+{
+	msgpack::sbuffer buffer;
+	msgpack::pack(buffer, bench_meta(1, state.range(0)));
+
+	while (state.KeepRunning()) {
+		msgpack::unpacked msg;
+		msgpack::unpack(&msg, buffer.data(), buffer.size());
+
+		ebucket::bucket_meta meta;
+		msg.get().convert(&meta);
+		benchmark::DoNotOptimize(meta.groups.data());
+	}
+}
+BENCHMARK(BM_bucket_meta_unpack)->Arg(3)->Arg(16);
+
+static std::string read_fixture(const std::string &name)
+{
+	std::string path = std::string(EBUCKET_FIXTURES_DIR) + "/" + name;
+	std::ifstream in(path.c_str());
+	if (!in) {
+		std::cerr << "could not open fixture " << path << std::endl;
+		return std::string();
+	}
+
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+// @monitor_stat_backends.json is backend statistics of one 16-backend node, as returned by monitor_stat()
+static void BM_stat_parse(benchmark::State &state)
+{
+	std::string statistics = read_fixture("monitor_stat_backends.json");
+	if (statistics.empty()) {
+		state.SkipWithError("empty fixture");
+		return;
+	}
+
+	elliptics::file_logger log("/dev/null", DNET_LOG_ERROR);
+	elliptics::logger logger(log, blackhole::log::attributes_t());
+
+	struct dnet_addr addr;
+	memset(&addr, 0, sizeof(addr));
+
+	while (state.KeepRunning()) {
+		std::map<int, ebucket::backend_stat> gstat;
+		ebucket::elliptics_stat::parse(logger, &addr, statistics, gstat);
+		if (gstat.empty()) {
+			state.SkipWithError("fixture does not contain valid backends");
+			break;
+		}
+	}
+
+	state.SetBytesProcessed(state.iterations() * statistics.size());
+}
+BENCHMARK(BM_stat_parse);
+
+// Request log line of the /bucket handler with info level disabled:
+//  * eager - how it used to be logged, bucket metadata is formatted before level check
+//  * lazy - EBUCKET_HOT_LOG_TO(), record is opened first, nothing is formatted,
+//	with -DEBUCKET_HOT_LOG_LEVEL=3 statement is compiled out completely
+static void BM_request_log_eager(benchmark::State &state)
+{
+	elliptics::file_logger log("/dev/null", DNET_LOG_ERROR);
+	elliptics::logger logger(log, blackhole::log::attributes_t());
+	ebucket::bucket b = bench_bucket(1);
+
+	size_t size = 1024;
+	while (state.KeepRunning()) {
+		ioremap::nulla::dolog(logger, DNET_LOG_INFO, "on_request: url: %s: size: %zd, bucket: %s",
+				"/bucket?size=1024", size, b->meta().to_string().c_str());
+	}
+}
+BENCHMARK(BM_request_log_eager);
+
+static void BM_request_log_lazy(benchmark::State &state)
+{
+	elliptics::file_logger log("/dev/null", DNET_LOG_ERROR);
+	elliptics::logger logger(log, blackhole::log::attributes_t());
+	ebucket::bucket b = bench_bucket(1);
+
+	size_t size = 1024;
+	while (state.KeepRunning()) {
+		EBUCKET_HOT_LOG_TO(logger, DNET_LOG_INFO, "on_request: url: %s: size: %zd, bucket: %s",
+				"/bucket?size=1024", size, b->meta().to_string().c_str());
+	}
+}
+BENCHMARK(BM_request_log_lazy);
+
+BENCHMARK_MAIN();
@@ -20,6 +20,9 @@ int main(int argc, char *argv[])
 		;
 
 	std::string log_file, log_level, groups_str;
+	size_t test_selections;
+	int test_threads;
+	double test_confidence;
 	bpo::options_description ell("Elliptics options, this test will generate random bucket names, put them into bucket key and test, "
 			"whether bucket key initialization works. If it works, common bucket processor test will be started.");
 	ell.add_options()
@@ -29,8 +32,16 @@ int main(int argc, char *argv[])
 		("groups", bpo::value<std::string>(&groups_str)->required(), "groups where bucket metadata is stored: 1:2:3")
 		;
 
+	bpo::options_description test("Selection test options");
+	test.add_options()
+		("test-selections", bpo::value<size_t>(&test_selections)->default_value(100000), "number of bucket selections")
+		("test-threads", bpo::value<int>(&test_threads)->default_value(4), "number of threads which select buckets")
+		("test-confidence", bpo::value<double>(&test_confidence)->default_value(0.999),
+			"confidence level of the chi-square test, selection distribution must match bucket weights")
+		;
+
 	bpo::options_description cmdline_options;
-	cmdline_options.add(generic).add(ell);
+	cmdline_options.add(generic).add(ell).add(test);
 
 	bpo::variables_map vm;
 
@@ -119,7 +130,13 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	bp.test();
+	ebucket::bucket_processor::test_result res = bp.test(test_selections, test_threads, test_confidence);
+	std::cout << "selection test passed: buckets: " << res.buckets <<
+		", selections: " << res.selections <<
+		", throughput: " << res.throughput << " selections/s" <<
+		", chi2: " << res.chi2 <<
+		", critical value: " << res.critical <<
+		std::endl;
 
 	return 0;
 }
@@ -0,0 +1,233 @@
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <random>
+
+#include "ebucket/bucket_processor.hpp"
+#include "ebucket/memory_storage.hpp"
+#include "ebucket/write_coalescer.hpp"
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+// Load test of the whole bucket processor against in-memory cluster:
+// bucket list and metadata are read from the storage, statistics and metadata
+// are periodically reloaded by the update thread, while client threads select buckets
+// and write objects into them with failover. Every write changes backend sizes, thus bucket weights
+// change during the test the same way they do in production.
+// Test fails if not every write has completed or if there are more write errors than group failure rate explains.
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	int buckets_num, groups_num, threads_num, requests_num;
+	int object_size, backend_size;
+	int latency_min, latency_max;
+	int stat_interval, meta_interval;
+	int write_attempts, coalesce_delay;
+	double failure_rate;
+	std::string log_file, log_level;
+
+	bpo::options_description generic("In-memory cluster load test options");
+	generic.add_options()
+		("help", "this help message")
+		("buckets", bpo::value<int>(&buckets_num)->default_value(100), "number of buckets")
+		("groups", bpo::value<int>(&groups_num)->default_value(3), "number of groups in every bucket")
+		("threads", bpo::value<int>(&threads_num)->default_value(16), "number of client threads")
+		("requests", bpo::value<int>(&requests_num)->default_value(10000), "number of writes per client thread")
+		("object-size", bpo::value<int>(&object_size)->default_value(64 * 1024), "size of every written object")
+		("backend-size", bpo::value<int>(&backend_size)->default_value(1024), "backend size limit in megabytes")
+		("latency-min", bpo::value<int>(&latency_min)->default_value(100), "minimal group latency in microseconds")
+		("latency-max", bpo::value<int>(&latency_max)->default_value(2000), "maximal group latency in microseconds")
+		("failure-rate", bpo::value<double>(&failure_rate)->default_value(0.001), "probability of the group request failure")
+		("write-attempts", bpo::value<int>(&write_attempts)->default_value(3),
+			"number of buckets every object is tried to be written into, 1 disables failover")
+		("coalesce-delay", bpo::value<int>(&coalesce_delay)->default_value(0),
+			"write objects through coalescer with this flush delay in milliseconds, "
+			"client threads do not wait for every write, 0 disables coalescing")
+		("stat-interval", bpo::value<int>(&stat_interval)->default_value(100), "statistics update interval in milliseconds")
+		("meta-interval", bpo::value<int>(&meta_interval)->default_value(1000), "metadata reload interval in milliseconds")
+		("log-file", bpo::value<std::string>(&log_file)->default_value("/dev/stdout"), "log file")
+		("log-level", bpo::value<std::string>(&log_level)->default_value("error"), "log level: error, info, notice, debug")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	elliptics::file_logger log(log_file.c_str(), elliptics::file_logger::parse_level(log_level));
+	std::shared_ptr<ebucket::memory_storage> st = std::make_shared<ebucket::memory_storage>(
+			elliptics::logger(log, blackhole::log::attributes_t()));
+
+	ebucket::memory_storage::group_config gc;
+	gc.latency_min = std::chrono::microseconds(latency_min);
+	gc.latency_max = std::chrono::microseconds(latency_max);
+	gc.failure_rate = failure_rate;
+	st->set_default_group(gc);
+
+	// metadata group is reliable, otherwise buckets randomly become invalid
+	std::vector<int> mgroups = {1};
+	st->set_group(1, ebucket::memory_storage::group_config());
+
+	std::mt19937 rng(0);
+	std::uniform_int_distribution<int> used_percent(10, 80);
+
+	uint64_t limit = (uint64_t)backend_size * 1024 * 1024;
+	std::vector<std::string> bnames;
+	for (int i = 0; i < buckets_num; ++i) {
+		ebucket::bucket_meta meta;
+		meta.name = "bucket-" + std::to_string(i);
+
+		for (int j = 0; j < groups_num; ++j) {
+			int group = 2 + i * groups_num + j;
+			meta.groups.push_back(group);
+
+			ebucket::memory_storage::backend_config cfg;
+			cfg.port = 1025 + group / 8;
+			cfg.limit = limit;
+			cfg.used = limit / 100 * used_percent(rng);
+			st->add_backend(group, cfg);
+		}
+
+		st->put_bucket(mgroups, meta);
+		bnames.push_back(meta.name);
+	}
+	st->put_bucket_list(mgroups, "buckets", bnames);
+
+	ebucket::bucket_processor bp(st);
+	bp.set_update_intervals(std::chrono::milliseconds(stat_interval), std::chrono::milliseconds(meta_interval));
+	bp.set_write_attempts(write_attempts);
+
+	if (!bp.init(mgroups, "buckets")) {
+		std::cerr << "could not initialize bucket processor" << std::endl;
+		return -1;
+	}
+
+	ebucket::latency_histogram write_hist;
+	std::atomic<uint64_t> written(0), write_errors(0), bucket_errors(0);
+
+	ebucket::coalescer_config ccfg;
+	ccfg.max_delay = std::chrono::milliseconds(coalesce_delay);
+	std::unique_ptr<ebucket::write_coalescer> coalescer;
+	if (coalesce_delay > 0)
+		coalescer.reset(new ebucket::write_coalescer(bp, ccfg));
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threads_num; ++t) {
+		threads.emplace_back([&, t] () {
+			std::string data(object_size, 'x');
+
+			for (int i = 0; i < requests_num; ++i) {
+				if (coalescer) {
+					auto wstart = std::chrono::steady_clock::now();
+
+					// write latency includes time spent in the coalescer buffer
+					coalescer->write("key-" + std::to_string(t) + "-" + std::to_string(i), data,
+						[&, wstart] (const ebucket::write_result &res) {
+							if (res.error) {
+								write_errors++;
+							} else {
+								written++;
+							}
+							bucket_errors += res.failed.size();
+
+							write_hist.record(std::chrono::steady_clock::now() - wstart);
+						});
+					continue;
+				}
+
+				auto wstart = std::chrono::steady_clock::now();
+
+				// bucket selection and failover to other buckets are included into write latency
+				ebucket::write_result res = bp.write("key-" + std::to_string(t) + "-" + std::to_string(i), data);
+				if (res.error) {
+					write_errors++;
+				} else {
+					written++;
+				}
+				bucket_errors += res.failed.size();
+
+				write_hist.record(std::chrono::steady_clock::now() - wstart);
+			}
+		});
+	}
+
+	for (auto it = threads.begin(), end = threads.end(); it != end; ++it) {
+		it->join();
+	}
+
+	if (coalescer) {
+		coalescer->close();
+
+		ebucket::write_coalescer::counters cc = coalescer->get_counters();
+		std::cout << "coalescer: batches: " << cc.batches << ", full batches: " << cc.full_batches <<
+			", objects: " << cc.objects << ", objects/batch: " << (cc.batches ? cc.objects / cc.batches : 0) <<
+			std::endl;
+	}
+
+	double seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count() / 1000000.0;
+
+	ebucket::latency_histogram::snapshot snap = write_hist.get();
+	ebucket::memory_storage::counters c = st->get_counters();
+
+	std::cout << "duration: " << seconds << " seconds" <<
+		", written: " << written << ", write errors: " << write_errors <<
+		", failed bucket writes: " << bucket_errors <<
+		", writes/s: " << written / seconds <<
+		std::endl;
+	std::cout << "write latency: p50: " << snap.percentile(50) / 1000 << " us" <<
+		", p99: " << snap.percentile(99) / 1000 << " us" <<
+		", p99.9: " << snap.percentile(99.9) / 1000 << " us" <<
+		std::endl;
+	std::cout << "storage: reads: " << c.reads << ", read errors: " << c.read_errors <<
+		", writes: " << c.writes << ", write errors: " << c.write_errors <<
+		", stat requests: " << c.stat_requests <<
+		std::endl;
+
+	std::shared_ptr<const ebucket::processor_state> state = bp.state();
+	for (auto it = state->buckets->begin(), end = state->buckets->end(); it != end; ++it) {
+		std::cout << "bucket: " << it->name << ", valid: " << it->valid <<
+			", weight: " << it->weight << ", avail: " << it->avail << std::endl;
+	}
+
+	// Object fails if one of its bucket groups fails in every attempt (coalesced writes are not retried),
+	// anything above 5 standard deviations of that (Poisson) error count is a bug, for example
+	// bucket selection failure or lost completion
+	uint64_t total = (uint64_t)threads_num * requests_num;
+	double bucket_failure = 1 - std::pow(1 - failure_rate, groups_num);
+	double object_failure = std::pow(bucket_failure, coalescer ? 1 : std::max(write_attempts, 1));
+	double expected_errors = total * object_failure;
+	double allowed_errors = expected_errors + 5 * std::sqrt(expected_errors) + 1;
+
+	std::cout << "write errors: " << write_errors << ", expected: " << expected_errors <<
+		", allowed: " << (uint64_t)allowed_errors << std::endl;
+
+	if (written + write_errors != total) {
+		std::cerr << "completed writes: " << written + write_errors << ", requested: " << total << std::endl;
+		return -1;
+	}
+
+	if (write_errors > allowed_errors) {
+		std::cerr << "too many write errors: " << write_errors <<
+			", failure rate " << failure_rate << " explains " << (uint64_t)allowed_errors << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
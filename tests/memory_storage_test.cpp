@@ -0,0 +1,691 @@
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "ebucket/bucket_processor.hpp"
+#include "ebucket/memory_storage.hpp"
+#include "ebucket/stripe.hpp"
+#include "ebucket/weight_policy.hpp"
+#include "ebucket/write_coalescer.hpp"
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+// Functional checks of the bucket processor features against in-memory storage,
+// every check builds its own storage and buckets, backend statistics are set directly,
+// thus results do not depend on the update thread timing.
+namespace {
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			std::ostringstream ss; \
+			ss << __FILE__ << ":" << __LINE__ << ": check failed: " << #cond; \
+			throw std::runtime_error(ss.str()); \
+		} \
+	} while (0)
+
+struct cluster {
+	std::shared_ptr<ebucket::memory_storage> st;
+	std::vector<ebucket::bucket> buckets;
+
+	explicit cluster(elliptics::file_logger &log) :
+	st(std::make_shared<ebucket::memory_storage>(elliptics::logger(log, blackhole::log::attributes_t())))
+	{
+	}
+
+	ebucket::backend_stat stat(int group) {
+		ebucket::memory_storage::backend_config cfg = st->get_backend(group);
+
+		ebucket::backend_stat bs;
+		bs.group = group;
+		bs.state = DNET_BACKEND_ENABLED;
+		bs.ro = cfg.ro;
+		bs.size.limit = cfg.limit;
+		bs.size.used = cfg.used;
+		return bs;
+	}
+
+	// adds bucket whose groups are backed by memory backends with given limit and used space,
+	// groups which already have backends are shared with other buckets
+	ebucket::bucket add_bucket(const std::string &name, const std::vector<int> &groups,
+			uint64_t limit = 1024 * 1024 * 1024, uint64_t used = 0) {
+		ebucket::bucket_meta meta;
+		meta.name = name;
+		meta.groups = groups;
+		return add_bucket(meta, limit, used);
+	}
+
+	ebucket::bucket add_bucket(const ebucket::bucket_meta &meta,
+			uint64_t limit = 1024 * 1024 * 1024, uint64_t used = 0) {
+		for (auto g = meta.groups.begin(), end = meta.groups.end(); g != end; ++g) {
+			if (st->get_backend(*g).limit == 0)
+				st->add_backend(*g, limit, used);
+		}
+
+		ebucket::bucket b = ebucket::make_bucket(std::shared_ptr<ebucket::storage>(st), meta);
+		for (auto g = meta.groups.begin(), end = meta.groups.end(); g != end; ++g) {
+			b->set_backend_stat(*g, stat(*g));
+		}
+
+		buckets.push_back(b);
+		return b;
+	}
+
+	// statistics are only updated by the checks themselves
+	template <typename Processor>
+	void init(Processor &bp) {
+		bp.set_update_intervals(std::chrono::hours(1), std::chrono::hours(1));
+		CHECK(bp.init(buckets));
+	}
+};
+
+// selection counts of every bucket out of @num selections of @size bytes
+template <typename Processor>
+std::map<std::string, size_t> select(Processor &bp, size_t num, size_t size = 1) {
+	std::map<std::string, size_t> ret;
+	for (size_t i = 0; i < num; ++i) {
+		ebucket::bucket b;
+		elliptics::error_info err = bp.get_bucket(size, b);
+		CHECK(!err);
+		ret[b->name()]++;
+	}
+
+	return ret;
+}
+
+struct read_reply {
+	elliptics::error_info	error;
+	int			group = -1;
+	std::chrono::milliseconds	time;
+};
+
+read_reply read_hedged(const ebucket::bucket &b, const std::string &key, const ebucket::hedge_config &cfg) {
+	std::shared_ptr<std::promise<read_reply>> done = std::make_shared<std::promise<read_reply>>();
+	std::future<read_reply> completed = done->get_future();
+
+	auto start = std::chrono::steady_clock::now();
+	b->read_hedged(key, [done] (const std::vector<ebucket::storage_result> &result, const elliptics::error_info &error) {
+			read_reply reply;
+			reply.error = error;
+			if (!error && !result.empty())
+				reply.group = result.front().group;
+			done->set_value(reply);
+		}, cfg);
+
+	read_reply reply = completed.get();
+	reply.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	return reply;
+}
+
+// read is hedged to the next group when the fastest known group becomes slow
+void check_hedged_read(elliptics::file_logger &log) {
+	cluster c(log);
+
+	ebucket::memory_storage::group_config fast, slower, slow;
+	fast.latency_min = fast.latency_max = std::chrono::microseconds(100);
+	slower.latency_min = slower.latency_max = std::chrono::milliseconds(2);
+	slow.latency_min = slow.latency_max = std::chrono::milliseconds(300);
+
+	c.st->set_group(1, fast);
+	c.st->set_group(2, slower);
+	ebucket::bucket b = c.add_bucket("hedged", {1, 2});
+	c.st->put("hedged", "key", {1, 2}, "data");
+
+	ebucket::hedge_config cfg;
+
+	// group 1 becomes the first one to read from
+	for (int i = 0; i < 30; ++i) {
+		read_reply reply = read_hedged(b, "key", cfg);
+		CHECK(!reply.error);
+	}
+	CHECK(b->read_latency(1, 50) < b->read_latency(2, 50));
+
+	c.st->set_group(1, slow);
+
+	// hedge is sent to group 2 after 95th percentile of group 1 latency
+	uint64_t reads = c.st->get_counters().reads;
+	read_reply reply = read_hedged(b, "key", cfg);
+	CHECK(!reply.error);
+	CHECK(reply.group == 2);
+	CHECK(reply.time < std::chrono::milliseconds(150));
+	CHECK(c.st->get_counters().reads == reads + 2);
+
+	// without hedges the read waits for the slow group
+	cfg.max_hedges = 0;
+	reply = read_hedged(b, "key", cfg);
+	CHECK(!reply.error);
+	CHECK(reply.group == 1);
+	CHECK(reply.time >= std::chrono::milliseconds(300));
+}
+
+// objects which do not fit into one group of the bucket fail one by one, the rest of the batch is written
+void check_bulk_write(elliptics::file_logger &log) {
+	cluster c(log);
+	c.add_bucket("bulk", {1, 2});
+
+	ebucket::bucket_processor bp(c.st);
+	c.init(bp);
+
+	// statistics still shows plenty of space, while group 2 has room only for the first half of the batch
+	const size_t num = 20, size = 1024;
+	ebucket::memory_storage::backend_config cfg = c.st->get_backend(2);
+	cfg.limit = num / 2 * size;
+	c.st->set_backend(2, cfg);
+
+	std::vector<std::string> keys, data;
+	for (size_t i = 0; i < num; ++i) {
+		keys.push_back("bulk-" + std::to_string(i));
+		data.push_back(std::string(size, 'a' + i));
+	}
+
+	ebucket::bulk_write_result res = bp.bulk_write(keys, data);
+	CHECK(res.urls.size() == num);
+	CHECK(res.errors.size() == num);
+	CHECK(res.failed == num / 2);
+
+	for (size_t i = 0; i < num; ++i) {
+		if (i < num / 2) {
+			CHECK(!res.errors[i]);
+			CHECK(res.urls[i].bucket == "bulk");
+			CHECK(res.urls[i].key == keys[i]);
+		} else {
+			CHECK(res.errors[i].code() == -ENOSPC);
+			CHECK(res.urls[i].bucket.empty());
+		}
+	}
+}
+
+// striped object is read back the same as it was written, chunk whose size does not match
+// the manifest fails the read
+void check_stripe(elliptics::file_logger &log) {
+	cluster c(log);
+	for (int i = 0; i < 4; ++i) {
+		c.add_bucket("stripe-" + std::to_string(i), {i * 2 + 1, i * 2 + 2});
+	}
+
+	ebucket::bucket_processor bp(c.st);
+	c.init(bp);
+
+	ebucket::stripe_config cfg;
+	cfg.chunk_size = 64 * 1024;
+	cfg.max_inflight = 3;
+
+	// 10 full chunks and a shorter one, written in uneven pieces
+	std::string data;
+	for (size_t i = 0; i < cfg.chunk_size * 10 + cfg.chunk_size / 2; ++i) {
+		data.push_back('a' + i % 251 % 26);
+	}
+
+	ebucket::stripe_writer writer(bp, "striped", cfg);
+	for (size_t pos = 0; pos < data.size(); pos += 10000) {
+		CHECK(!writer.write(data.substr(pos, 10000)));
+	}
+
+	ebucket::write_result res;
+	CHECK(!writer.finish(res));
+
+	ebucket::stripe_manifest manifest = writer.manifest();
+	CHECK(manifest.size == data.size());
+	CHECK(manifest.chunks.size() == 11);
+
+	std::string read;
+	ebucket::stripe_reader reader(bp, cfg);
+	CHECK(!reader.open(res.url));
+
+	std::string chunk;
+	while (reader.next(chunk)) {
+		read += chunk;
+	}
+	CHECK(!reader.error());
+	CHECK(read == data);
+
+	// truncated chunk
+	const ebucket::stripe_chunk &broken = manifest.chunks[5];
+	ebucket::bucket b;
+	CHECK(!bp.find_bucket(broken.bucket, b));
+	c.st->put(broken.bucket, broken.key, b->meta().groups, data.substr(0, broken.size - 1));
+
+	ebucket::stripe_reader truncated(bp, cfg);
+	CHECK(!truncated.open(res.url));
+
+	size_t chunks = 0;
+	while (truncated.next(chunk)) {
+		chunks++;
+	}
+	CHECK(chunks <= 5);
+	CHECK(truncated.error().code() == -EILSEQ);
+}
+
+// counts completions of the coalesced writes, handlers are called from storage IO thread
+struct write_counter {
+	std::mutex		lock;
+	std::condition_variable	wait;
+	size_t			completed = 0;
+	size_t			errors = 0;
+
+	ebucket::write_handler handler() {
+		return [this] (const ebucket::write_result &res) {
+			std::lock_guard<std::mutex> guard(lock);
+			completed++;
+			if (res.error || res.url.key.empty())
+				errors++;
+			wait.notify_all();
+		};
+	}
+
+	bool wait_for(size_t num, std::chrono::milliseconds timeout) {
+		std::unique_lock<std::mutex> guard(lock);
+		return wait.wait_for(guard, timeout, [&] {return completed >= num;});
+	}
+};
+
+// coalescer counts written objects after their handlers have been called
+ebucket::write_coalescer::counters wait_objects(ebucket::write_coalescer &wr, uint64_t num) {
+	ebucket::write_coalescer::counters cnt;
+	for (int i = 0; i < 1000; ++i) {
+		cnt = wr.get_counters();
+		if (cnt.objects >= num)
+			break;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return cnt;
+}
+
+// batch is flushed when it is full or when its deadline expires, writes are rejected
+// at pending bytes limit, close completes every buffered object
+void check_write_coalescer(elliptics::file_logger &log) {
+	cluster c(log);
+	c.add_bucket("coalesced-1", {1, 2});
+	c.add_bucket("coalesced-2", {3, 4});
+
+	ebucket::bucket_processor bp(c.st);
+	c.init(bp);
+
+	std::string data(1024, 'x');
+
+	{
+		ebucket::coalescer_config cfg;
+		cfg.max_batch_objects = 4;
+		cfg.max_delay = std::chrono::milliseconds(200);
+
+		ebucket::bucket b;
+		CHECK(!bp.get_bucket(data.size(), b));
+
+		write_counter wc;
+		ebucket::write_coalescer wr(bp, cfg);
+
+		// full batch is sent by the writing thread
+		for (int i = 0; i < 4; ++i) {
+			wr.write(b, "full-" + std::to_string(i), data, wc.handler());
+		}
+		CHECK(wc.wait_for(4, std::chrono::milliseconds(1000)));
+
+		ebucket::write_coalescer::counters cnt = wait_objects(wr, 4);
+		CHECK(cnt.batches == 1);
+		CHECK(cnt.full_batches == 1);
+		CHECK(cnt.objects == 4);
+
+		// the rest is sent by flush thread after the deadline
+		wr.write(b, "deadline", data, wc.handler());
+		CHECK(!wc.wait_for(5, std::chrono::milliseconds(50)));
+		CHECK(wc.wait_for(5, std::chrono::milliseconds(2000)));
+
+		cnt = wait_objects(wr, 5);
+		CHECK(cnt.batches == 2);
+		CHECK(cnt.full_batches == 1);
+		CHECK(cnt.objects == 5);
+		CHECK(wc.errors == 0);
+	}
+
+	{
+		ebucket::coalescer_config cfg;
+		cfg.max_delay = std::chrono::hours(1);
+		cfg.max_pending_bytes = data.size() * 3;
+
+		write_counter wc;
+		ebucket::write_coalescer wr(bp, cfg);
+
+		CHECK(wr.try_write("pending-0", data, wc.handler()));
+		CHECK(wr.try_write("pending-1", data, wc.handler()));
+		CHECK(wr.try_write("pending-2", data, wc.handler()));
+		CHECK(!wr.try_write("rejected", data, wc.handler()));
+
+		// nothing is written before its deadline
+		CHECK(!wc.wait_for(1, std::chrono::milliseconds(20)));
+
+		wr.close();
+		CHECK(wc.completed == 3);
+		CHECK(wc.errors == 0);
+		CHECK(wr.get_counters().objects == 3);
+		CHECK(wr.get_counters().full_batches == 0);
+
+		// closed coalescer completes new writes with an error
+		CHECK(wr.try_write("closed", data, wc.handler()));
+		CHECK(wc.completed == 4);
+		CHECK(wc.errors == 1);
+	}
+}
+
+// bucket over its size or key quota is never selected, quota usage is not taken
+// from the statistics of the backends shared with other buckets unless it is enabled
+void check_quota(elliptics::file_logger &log) {
+	cluster c(log);
+
+	const uint64_t mb = 1024 * 1024;
+	const uint64_t limit = 1024 * mb;
+
+	// both buckets share backends which are almost half full with data of other buckets
+	ebucket::bucket_meta meta;
+	meta.name = "quota-size";
+	meta.groups = {1, 2};
+	meta.max_size = 10 * mb;
+	ebucket::bucket sized = c.add_bucket(meta, limit, limit / 2);
+
+	meta.name = "quota-keys";
+	meta.max_size = 0;
+	meta.max_key_num = 20;
+	ebucket::bucket keyed = c.add_bucket(meta, limit, limit / 2);
+
+	c.add_bucket("free", {3, 4}, limit, limit / 2);
+
+	ebucket::bucket_processor bp(c.st);
+	c.init(bp);
+
+	CHECK(sized->usage().size() == 0);
+	CHECK(select(bp, 10000)["quota-size"] > 0);
+
+	// bucket is excluded when less than hard limit (10%) of its quota is left, at exactly 10% it only
+	// gets soft limit weight, thus keep writing until both buckets are past the hard limit
+	std::string data(mb, 'x');
+	for (int i = 0; i < 1000 && (sized->usage().size() <= 9 * mb || keyed->usage().keys() <= 18); ++i) {
+		ebucket::write_result res = bp.write("key-" + std::to_string(i), data);
+		CHECK(!res.error);
+	}
+
+	CHECK(sized->usage().size() > 9 * mb);
+	CHECK(sized->usage().size() <= 10 * mb);
+	CHECK(keyed->usage().keys() > 18);
+	CHECK(keyed->usage().keys() <= 20);
+
+	std::map<std::string, size_t> counts = select(bp, 10000);
+	CHECK(counts["quota-size"] == 0);
+	CHECK(counts["quota-keys"] == 0);
+	CHECK(counts["free"] == 10000);
+
+	// statistics usage: written counters are dropped only when every group has reported
+	bp.set_quota_stat_usage(true);
+
+	uint64_t written = keyed->usage().keys();
+	ebucket::backend_stat bs = c.stat(1);
+	bs.records.total = 5;
+	keyed->set_backend_stat(1, bs);
+	CHECK(keyed->usage().keys() == written + 5);
+
+	bs.group = 2;
+	keyed->set_backend_stat(2, bs);
+	CHECK(keyed->usage().keys() == 5);
+}
+
+// read-only and corrupted backends lose weight, health of the backend stops changing
+// soon after corrupted records stop growing
+void check_health(elliptics::file_logger &log) {
+	cluster c(log);
+
+	ebucket::health_config cfg;
+
+	ebucket::bucket healthy = c.add_bucket("healthy", {1});
+	ebucket::bucket ro = c.add_bucket("ro", {2});
+	ebucket::bucket corrupted = c.add_bucket("corrupted", {3});
+
+	ebucket::backend_stat bs = c.stat(2);
+	bs.ro = true;
+	ebucket::elliptics_stat::update_health(bs, NULL, cfg);
+	ro->set_backend_stat(2, bs);
+
+	// 1% of records are corrupted, that is 10 times more than @health_config::corrupted_ratio
+	bs = c.stat(3);
+	bs.records.total = 1000;
+	bs.records.corrupted = 10;
+	ebucket::elliptics_stat::update_health(bs, NULL, cfg);
+	corrupted->set_backend_stat(3, bs);
+
+	CHECK(ro->weight(0) == 0);
+	CHECK(corrupted->weight(0) > 0);
+	CHECK(corrupted->weight(0) < healthy->weight(0) / 5);
+
+	ebucket::bucket_processor bp(c.st);
+	c.init(bp);
+
+	std::map<std::string, size_t> counts = select(bp, 10000);
+	CHECK(counts["ro"] == 0);
+	CHECK(counts["corrupted"] < counts["healthy"] / 5);
+
+	// 100 records got corrupted at once, smoothed growth decays afterwards
+	ebucket::backend_stat prev = c.stat(4);
+	prev.records.total = 1000000;
+	ebucket::elliptics_stat::update_health(prev, NULL, cfg);
+
+	ebucket::backend_stat cur = prev;
+	cur.records.corrupted = 100;
+	ebucket::elliptics_stat::update_health(cur, &prev, cfg);
+	CHECK(cur.health < prev.health);
+
+	int changes = 0;
+	for (int i = 0; i < 100; ++i) {
+		prev = cur;
+		ebucket::elliptics_stat::update_health(cur, &prev, cfg);
+		if (cur != prev)
+			changes++;
+	}
+	CHECK(changes <= 25);
+	CHECK(cur == prev);
+}
+
+// strict policy never selects bucket with backend below soft limit, default policy only decreases its weight
+void check_strict_policy(elliptics::file_logger &log) {
+	const uint64_t limit = 1024 * 1024 * 1024;
+
+	cluster c(log);
+	c.add_bucket("free", {1, 2}, limit, limit / 2);
+	c.add_bucket("soft", {3, 4}, limit, limit / 2);
+
+	// 15% of free space, that is between hard (10%) and soft (20%) limits
+	ebucket::memory_storage::backend_config cfg = c.st->get_backend(4);
+	cfg.used = limit - limit / 100 * 15;
+	c.st->set_backend(4, cfg);
+	c.buckets.back()->set_backend_stat(4, c.stat(4));
+
+	ebucket::bucket_processor plain(c.st);
+	c.init(plain);
+	CHECK(select(plain, 10000)["soft"] > 0);
+
+	ebucket::basic_bucket_processor<ebucket::strict_threshold_weight_policy> strict(c.st);
+	c.init(strict);
+
+	std::map<std::string, size_t> counts = select(strict, 10000);
+	CHECK(counts["soft"] == 0);
+	CHECK(counts["free"] == 10000);
+}
+
+// group whose used space grows faster runs out of space sooner and loses weight
+void check_time_to_full_policy(elliptics::file_logger &log) {
+	const uint64_t limit = 1024 * 1024 * 1024;
+
+	cluster c(log);
+	ebucket::bucket fast = c.add_bucket("fast", {1}, limit, 0);
+	ebucket::bucket slow = c.add_bucket("slow", {2}, limit, 0);
+
+	typedef ebucket::basic_bucket_processor<ebucket::time_to_full_weight_policy> processor;
+	processor bp(c.st, ebucket::time_to_full_weight_policy(std::chrono::seconds(100)));
+	c.init(bp);
+
+	// write rate is not known yet, the policy behaves like the default one
+	std::map<std::string, size_t> counts = select(bp, 10000);
+	CHECK(counts["fast"] > 4000);
+	CHECK(counts["slow"] > 4000);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	// 100Mb in about 20ms fills the group in a fraction of a second, while the other group
+	// is not going to be full within the horizon
+	ebucket::memory_storage::backend_config cfg = c.st->get_backend(1);
+	cfg.used += 100 * 1024 * 1024;
+	c.st->set_backend(1, cfg);
+	fast->set_backend_stat(1, c.stat(1), bp.weight_policy());
+
+	cfg = c.st->get_backend(2);
+	cfg.used += 1024;
+	c.st->set_backend(2, cfg);
+	slow->set_backend_stat(2, c.stat(2), bp.weight_policy());
+
+	CHECK(bp.weight_policy().rate(1) > bp.weight_policy().rate(2));
+	CHECK(bp.weight_policy().rate(2) > 0);
+	CHECK(fast->weight(0) < slow->weight(0) / 100);
+
+	counts = select(bp, 10000);
+	CHECK(counts["fast"] < 100);
+}
+
+// every bucket has two replicas in different racks, most buckets are placed into racks 1 and 2,
+// flat selection writes 7/16 of replicas into each of them and only 1/8 into rack 3,
+// two-level selection picks rack first, then bucket which has replica in that rack
+void check_failure_domains(elliptics::file_logger &log) {
+	cluster c(log);
+
+	ebucket::failure_domains fd;
+	fd.enabled = true;
+
+	std::map<std::string, std::vector<std::string>> racks;
+	auto add = [&] (const std::string &name, int g1, const std::string &r1, int g2, const std::string &r2) {
+		c.add_bucket(name, {g1, g2});
+		fd.groups[g1] = r1;
+		fd.groups[g2] = r2;
+		racks[name] = {r1, r2};
+	};
+
+	for (int i = 0; i < 6; ++i) {
+		add("rack12-" + std::to_string(i), 1 + i * 2, "rack1", 2 + i * 2, "rack2");
+	}
+	add("rack13", 20, "rack1", 21, "rack3");
+	add("rack23", 22, "rack2", 23, "rack3");
+
+	ebucket::bucket_processor bp(c.st);
+	c.init(bp);
+
+	const size_t num = 100000;
+
+	// share of replicas written into every rack
+	auto shares = [&] () {
+		std::map<std::string, double> ret;
+		std::map<std::string, size_t> counts = select(bp, num);
+		for (auto it = counts.begin(), end = counts.end(); it != end; ++it) {
+			for (auto r = racks[it->first].begin(), rend = racks[it->first].end(); r != rend; ++r) {
+				ret[*r] += (double)it->second / num / 2;
+			}
+		}
+
+		return ret;
+	};
+
+	std::map<std::string, double> flat = shares();
+	CHECK(std::fabs(flat["rack1"] - 7. / 16) < 0.01);
+	CHECK(std::fabs(flat["rack3"] - 1. / 8) < 0.01);
+
+	bp.set_failure_domains(fd);
+
+	std::shared_ptr<const ebucket::processor_state> state = bp.state();
+	for (auto it = state->buckets->begin(), end = state->buckets->end(); it != end; ++it) {
+		CHECK(it->domains == racks[it->name]);
+	}
+
+	// every rack is selected with 1/3 probability, rack3 also gets replicas of buckets selected
+	// through rack1 and rack2: 1/3 * (1/7 + 1/7) + 1/3 * 2 / 2, that is 3/14 of all replicas
+	std::map<std::string, double> domains = shares();
+	CHECK(std::fabs(domains["rack3"] - 3. / 14) < 0.01);
+	CHECK(std::fabs(domains["rack1"] - 11. / 28) < 0.01);
+	CHECK(std::fabs(domains["rack2"] - 11. / 28) < 0.01);
+
+	// selection distribution matches two-level probabilities
+	bp.test(num);
+}
+
+struct check {
+	const char	*name;
+	std::function<void (elliptics::file_logger &)> func;
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	std::vector<check> checks = {
+		{"hedged-read", check_hedged_read},
+		{"bulk-write", check_bulk_write},
+		{"stripe", check_stripe},
+		{"write-coalescer", check_write_coalescer},
+		{"quota", check_quota},
+		{"health", check_health},
+		{"strict-policy", check_strict_policy},
+		{"time-to-full-policy", check_time_to_full_policy},
+		{"failure-domains", check_failure_domains},
+	};
+
+	std::string log_file, log_level, only;
+
+	bpo::options_description generic("In-memory storage functional test options");
+	generic.add_options()
+		("help", "this help message")
+		("check", bpo::value<std::string>(&only), "run only this check")
+		("log-file", bpo::value<std::string>(&log_file)->default_value("/dev/stderr"), "log file")
+		("log-level", bpo::value<std::string>(&log_level)->default_value("error"), "log level: error, info, notice, debug")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			std::cout << "Checks:";
+			for (auto it = checks.begin(), end = checks.end(); it != end; ++it)
+				std::cout << " " << it->name;
+			std::cout << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	elliptics::file_logger log(log_file.c_str(), elliptics::file_logger::parse_level(log_level));
+
+	int failed = 0;
+	for (auto it = checks.begin(), end = checks.end(); it != end; ++it) {
+		if (!only.empty() && only != it->name)
+			continue;
+
+		try {
+			it->func(log);
+			std::cout << it->name << ": ok" << std::endl;
+		} catch (const std::exception &e) {
+			std::cout << it->name << ": failed: " << e.what() << std::endl;
+			failed++;
+		}
+	}
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,99 @@
+#include <chrono>
+#include <iostream>
+
+#include "ebucket/bucket.hpp"
+
+#include <thevoid/rapidjson/document.h>
+#include <thevoid/rapidjson/prettywriter.h>
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+// Compares serialization cost of bucket selection reply:
+//  * dom-pretty - rapidjson DOM with pretty writer, how ebucket_server used to build every reply
+//  * json - compact JSON writer, which is used to pre-serialize bucket reply
+//  * msgpack - msgpack map with the same fields
+static std::string pack_dom_pretty(const ebucket::bucket_meta &meta)
+{
+	rapidjson::Document ret;
+	ret.SetObject();
+	auto &allocator = ret.GetAllocator();
+
+	rapidjson::Value name_val(meta.name.c_str(), meta.name.size(), allocator);
+	ret.AddMember("bucket", name_val, allocator);
+
+	rapidjson::Value groups_val(rapidjson::kArrayType);
+	for (auto group: meta.groups) {
+		groups_val.PushBack(group, allocator);
+	}
+	ret.AddMember("groups", groups_val, allocator);
+
+	rapidjson::StringBuffer buffer;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+	ret.Accept(writer);
+	buffer.Put('\n');
+
+	return std::string(buffer.GetString(), buffer.Size());
+}
+
+template <typename Func>
+static void run(const std::string &name, int num, Func func)
+{
+	size_t size = 0;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < num; ++i) {
+		size += func();
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+	std::cout << name <<
+		": iterations: " << num <<
+		", ns/op: " << ns / num <<
+		", bytes/op: " << size / num <<
+		std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	int num, groups_num;
+	bpo::options_description generic("Reply serialization benchmark options");
+	generic.add_options()
+		("help", "this help message")
+		("iterations", bpo::value<int>(&num)->default_value(1000000), "number of serializations per format")
+		("groups", bpo::value<int>(&groups_num)->default_value(3), "number of groups in the bucket")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	ebucket::bucket_meta meta;
+	meta.name = "bucket-benchmark-name";
+	for (int i = 0; i < groups_num; ++i) {
+		meta.groups.push_back(i + 1);
+	}
+
+	run("dom-pretty", num, [&] () { return pack_dom_pretty(meta).size(); });
+	run("json", num, [&] () { return ebucket::raw_bucket::pack_json(meta)->size(); });
+	run("msgpack", num, [&] () { return ebucket::raw_bucket::pack_msgpack(meta)->size(); });
+
+	return 0;
+}
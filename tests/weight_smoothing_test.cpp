@@ -0,0 +1,198 @@
+#include <cmath>
+#include <iostream>
+#include <random>
+
+#include "ebucket/bucket_processor.hpp"
+#include "ebucket/memory_storage.hpp"
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+namespace {
+
+struct sim_config {
+	int		buckets = 10;
+	int		duration = 7200;
+	int		stat_interval = 30;
+	int		warmup = 600;
+
+	// total write rate and total removal rate are fractions of the single backend size per hour
+	double		write_rate = 0.5;
+	double		remove_rate = 0.45;
+
+	ebucket::weight_smoothing smoothing;
+};
+
+struct sim_result {
+	// total variation distance between bucket selection shares of consecutive statistics intervals
+	double		mean_tv = 0;
+	double		max_tv = 0;
+};
+
+// Virtual time simulation of the buckets hovering around soft free space limit:
+// writes are spread over buckets according to their weights, while every backend constantly
+// frees space (removals and defragmentation). Statistics of all buckets is refreshed at the same time,
+// without smoothing every refresh moves the whole write stream from the buckets which have just crossed
+// the soft limit to the ones which have just left it, and the next refresh moves it back.
+sim_result simulate(std::shared_ptr<ebucket::storage> st, const sim_config &cfg) {
+	const uint64_t limit = 1024ULL * 1024 * 1024 * 1024;
+	const double write_per_second = cfg.write_rate * limit / 3600;
+	const double remove_per_second = cfg.remove_rate * limit / 3600 / cfg.buckets;
+
+	std::mt19937 rng(0);
+	std::uniform_real_distribution<double> free_ratio(0.18, 0.24);
+
+	std::vector<ebucket::bucket> buckets;
+	std::vector<double> used;
+	for (int i = 0; i < cfg.buckets; ++i) {
+		ebucket::bucket_meta meta;
+		meta.name = "bucket-" + std::to_string(i);
+		meta.groups.push_back(i + 1);
+
+		ebucket::bucket b = ebucket::make_bucket(st, meta);
+		b->set_weight_smoothing(cfg.smoothing);
+		buckets.push_back(b);
+		used.push_back(limit * (1 - free_ratio(rng)));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto refresh = [&] (int second) {
+		auto now = start + std::chrono::seconds(second);
+		for (int i = 0; i < cfg.buckets; ++i) {
+			ebucket::backend_stat bs;
+			bs.group = i + 1;
+			bs.size.limit = limit;
+			bs.size.used = used[i];
+			buckets[i]->set_backend_stat(bs.group, bs, ebucket::default_weight_policy(), now);
+		}
+	};
+
+	sim_result res;
+	int intervals = 0;
+
+	std::vector<double> shares(cfg.buckets), prev;
+
+	for (int second = 0; second < cfg.duration; ++second) {
+		if (second % cfg.stat_interval == 0) {
+			refresh(second);
+
+			if (second >= cfg.warmup + cfg.stat_interval) {
+				double total = 0;
+				for (auto s: shares)
+					total += s;
+
+				if (total > 0) {
+					for (auto &s: shares)
+						s /= total;
+
+					if (!prev.empty()) {
+						double tv = 0;
+						for (int i = 0; i < cfg.buckets; ++i)
+							tv += std::fabs(shares[i] - prev[i]);
+						tv /= 2;
+
+						res.mean_tv += tv;
+						res.max_tv = std::max(res.max_tv, tv);
+						intervals++;
+					}
+
+					prev = shares;
+				}
+			}
+
+			std::fill(shares.begin(), shares.end(), 0);
+		}
+
+		auto now = start + std::chrono::seconds(second);
+
+		std::vector<float> weights;
+		double sum = 0;
+		for (auto &b: buckets) {
+			weights.push_back(b->weight(0, now));
+			sum += weights.back();
+		}
+
+		for (int i = 0; i < cfg.buckets; ++i) {
+			double written = sum > 0 ? write_per_second * weights[i] / sum : 0;
+			shares[i] += written;
+
+			used[i] += written;
+			used[i] = std::max(0.0, std::min<double>(limit, used[i] - remove_per_second));
+		}
+	}
+
+	if (intervals)
+		res.mean_tv /= intervals;
+
+	return res;
+}
+
+} // namespace
+
+// Simulation of the bucket selection with and without weight smoothing (see @ebucket::weight_smoothing),
+// test fails if smoothing does not reduce oscillation of the write distribution between buckets.
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	sim_config cfg;
+	int smoothing;
+
+	bpo::options_description generic("Weight smoothing simulation options");
+	generic.add_options()
+		("help", "this help message")
+		("buckets", bpo::value<int>(&cfg.buckets)->default_value(cfg.buckets), "number of buckets")
+		("duration", bpo::value<int>(&cfg.duration)->default_value(cfg.duration), "simulated time in seconds")
+		("stat-interval", bpo::value<int>(&cfg.stat_interval)->default_value(cfg.stat_interval),
+			"statistics update interval in seconds")
+		("write-rate", bpo::value<double>(&cfg.write_rate)->default_value(cfg.write_rate),
+			"total write rate, fraction of the backend size per hour")
+		("remove-rate", bpo::value<double>(&cfg.remove_rate)->default_value(cfg.remove_rate),
+			"total rate of freed space, fraction of the backend size per hour")
+		("smoothing", bpo::value<int>(&smoothing)->default_value(60), "weight smoothing time constant in seconds")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	if (cfg.buckets <= 0 || cfg.stat_interval <= 0 || smoothing <= 0) {
+		std::cerr << "Invalid options: buckets, stat-interval and smoothing must be positive\n" << generic << std::endl;
+		return -1;
+	}
+
+	elliptics::file_logger log("/dev/stderr", elliptics::file_logger::parse_level("error"));
+	std::shared_ptr<ebucket::memory_storage> st = std::make_shared<ebucket::memory_storage>(
+			elliptics::logger(log, blackhole::log::attributes_t()));
+
+	sim_result plain = simulate(st, cfg);
+
+	cfg.smoothing.rise = std::chrono::seconds(smoothing);
+	cfg.smoothing.fall = std::chrono::seconds(smoothing);
+	sim_result smoothed = simulate(st, cfg);
+
+	std::cout << "selection share change between statistics updates: " <<
+		"without smoothing: mean: " << plain.mean_tv << ", max: " << plain.max_tv <<
+		", with smoothing: mean: " << smoothed.mean_tv << ", max: " << smoothed.max_tv <<
+		std::endl;
+
+	if (smoothed.max_tv >= plain.max_tv || smoothed.mean_tv >= plain.mean_tv) {
+		std::cerr << "weight smoothing has not reduced oscillation" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}